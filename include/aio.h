@@ -0,0 +1,92 @@
+#ifndef AIO_H_
+#define AIO_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AIO_DEPTH 64  // requests on the ring at once, later ones wait in the backlog
+#define AIO_WORKERS 4 // threads of the pread fallback
+
+typedef enum {
+    AIO_ENGINE_NONE = 0, // not started
+    AIO_ENGINE_URING,    // io_uring, falling back to AIO_ENGINE_THREADS where the kernel refuses it
+    AIO_ENGINE_THREADS   // worker threads calling preadv/pwritev
+} AioEngine;
+
+struct IoRequest;
+typedef void (*IoDoneFn)(struct IoRequest *request);
+
+// Filled by the caller, which keeps it and its iovecs alive until done runs.
+// An empty vector completes without any I/O.
+typedef struct IoRequest {
+    int write;               // 1 for pwritev, 0 for preadv
+    off_t offset;            // byte offset in the image
+    const struct iovec *iov;
+    int iovcnt;
+    ssize_t result;          // bytes moved or -errno, set on completion
+    int complete;            // set on completion, before done runs
+    IoDoneFn done;           // may be NULL for a caller waiting on complete
+    void *arg;
+    struct IoRequest *next;  // engine queue link
+} IoRequest;
+
+typedef struct AioStats {
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long syscalls;      // io_uring_enter calls, or the workers' preadv/pwritev calls
+    unsigned long max_in_flight; // most requests outstanding at once
+} AioStats;
+
+typedef struct AsyncIo {
+    AioEngine engine;
+    int fd;
+    int in_flight;       // submitted and not yet reaped
+    IoRequest *backlog;  // waiting for room on the ring
+    IoRequest *backlog_tail;
+
+    // io_uring
+    int ring_fd;
+    int unsubmitted;     // entries queued since the last io_uring_enter
+    unsigned ring_entries;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // worker threads
+    pthread_t workers[AIO_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;       // queue gained a request or stopping was set
+    pthread_cond_t finished;   // done list gained a request
+    IoRequest *queue;
+    IoRequest *queue_tail;
+    IoRequest *done;
+    IoRequest *done_tail;
+    int stopping;
+
+    AioStats stats;
+} AsyncIo;
+
+int aio_init(AsyncIo *aio, int fd, AioEngine engine);
+void aio_destroy(AsyncIo *aio);
+
+// Queues a request. io_uring picks it up on the next aio_kick or aio_reap.
+void aio_submit(AsyncIo *aio, IoRequest *request);
+void aio_kick(AsyncIo *aio);
+
+// Runs the done callbacks of finished requests in the calling thread,
+// waiting until at least min_complete have finished or nothing is left in
+// flight. Returns how many finished.
+int aio_reap(AsyncIo *aio, int min_complete);
+
+#endif // AIO_H_
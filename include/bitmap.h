@@ -0,0 +1,20 @@
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include "fs_types.h"
+
+#define BITS_PER_BLOCK(fs) ((fs)->sb.block_size * 8)
+
+int bitmap_find_zero(FsContext *fs, int start_block, int num_bits, int from);
+void bitmap_set(FsContext *fs, int start_block, int index, int value);
+
+int alloc_blocks_near(FsContext *fs, int goal, int count, int *length);
+int alloc_block_near(FsContext *fs, int goal);
+void free_block_run(FsContext *fs, int block_number, int count);
+void free_block(FsContext *fs, int block_number);
+int count_free_blocks(const FsContext *fs);
+
+int alloc_inode(FsContext *fs, int group);
+void release_inode(FsContext *fs, int inode_number);
+
+#endif // BITMAP_H_
@@ -0,0 +1,70 @@
+#ifndef BLOCKDEV_H_
+#define BLOCKDEV_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "aio.h"
+
+typedef enum {
+    BACKEND_STDIO = 0,
+    BACKEND_MMAP,
+    BACKEND_PREAD,
+    BACKEND_URING // io_uring, BACKEND_PREAD where the kernel refuses it
+} Backend;
+
+struct BlockDevice;
+
+// Transfers cover consecutive blocks from block_number on; every iovec
+// holds a whole number of blocks.
+typedef struct BlockDeviceOps {
+    int (*open)(struct BlockDevice *dev, const char *path);
+    void (*close)(struct BlockDevice *dev);
+    int (*readv)(struct BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt);
+    int (*writev)(struct BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt);
+    int (*sync)(struct BlockDevice *dev);
+} BlockDeviceOps;
+
+typedef struct BlockDeviceStats {
+    unsigned long syscalls;  // system calls made for reads, writes and syncs
+    unsigned long reads;     // read requests from the layers above
+    unsigned long writes;    // write requests from the layers above
+} BlockDeviceStats;
+
+typedef struct BlockDevice {
+    const BlockDeviceOps *ops;
+    Backend backend;
+    int block_size;
+    FILE *fp;        // stdio backend
+    int fd;          // mmap, pread and io_uring backends
+    char *map;       // mmap backend, whole image mapped shared
+    size_t map_size;
+    AioEngine engine; // engine the async path starts with
+    AsyncIo aio;      // async path, started on first submit by every backend but io_uring
+    BlockDeviceStats stats;
+} BlockDevice;
+
+int blockdev_open(BlockDevice *dev, const char *path, Backend backend, AioEngine engine, int block_size);
+void blockdev_close(BlockDevice *dev);
+
+int blockdev_read(void *device, int block_number, void *block);
+int blockdev_write(void *device, int block_number, const void *block);
+
+// count consecutive blocks in a single backend call
+int blockdev_read_run(void *device, int block_number, int count, void *blocks);
+int blockdev_write_run(void *device, int block_number, int count, const void *blocks);
+
+// consecutive blocks gathered from or scattered to several buffers in a single backend call
+int blockdev_readv(void *device, int block_number, const struct iovec *iov, int iovcnt);
+int blockdev_writev(void *device, int block_number, const struct iovec *iov, int iovcnt);
+
+int blockdev_sync(BlockDevice *dev);
+
+// Async path: the request's iovecs cover whole blocks from block_number on.
+// Requests run side by side with each other, not with the synchronous calls
+// above, which they do not see through any buffering of their own.
+int blockdev_submit(BlockDevice *dev, int block_number, IoRequest *request);
+void blockdev_kick(BlockDevice *dev);
+int blockdev_reap(BlockDevice *dev, int min_complete);
+
+#endif // BLOCKDEV_H_
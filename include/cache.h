@@ -0,0 +1,70 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <sys/uio.h>
+#include "lock.h"
+
+#define CACHE_FRAMES 64
+#define CACHE_FLUSH_IOVS 64 // frames gathered into one device call by cache_flush
+
+typedef int (*BlockReadFn)(void *device, int block_number, const struct iovec *iov, int iovcnt);
+typedef int (*BlockWriteFn)(void *device, int block_number, const struct iovec *iov, int iovcnt);
+
+typedef struct CacheFrame {
+    int block_number; // -1 when the frame is empty
+    int dirty;        // 1 if the frame differs from the disk
+    int referenced;   // CLOCK second chance bit
+    int next;         // next frame in the same hash bucket, -1 ends the chain
+    char *data;
+} CacheFrame;
+
+typedef struct CacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+    unsigned long run_ios;    // device calls made by the run and vector functions
+} CacheStats;
+
+typedef struct BlockCache {
+    CacheFrame *frames;
+    int *buckets;
+    CacheFrame **order;  // scratch for cache_flush, dirty frames by block number
+    int num_frames;
+    int block_size;
+    int hand;            // CLOCK hand
+    void *device;
+    BlockReadFn read;
+    BlockWriteFn write;
+    CacheStats stats;
+    RwLock lock;         // shared by lookups that hit, exclusive to change the frames
+} BlockCache;
+
+int cache_init(BlockCache *cache, int num_frames, int block_size, void *device, BlockReadFn read, BlockWriteFn write,
+               int thread_safe);
+void cache_destroy(BlockCache *cache);
+
+void cache_read(BlockCache *cache, int block_number, void *block);
+
+// copies the block only if it is cached; 1 if it was
+int cache_lookup(BlockCache *cache, int block_number, void *block);
+void cache_write(BlockCache *cache, int block_number, const void *block);
+
+// Multi-block transfers: cached blocks are served from or updated in their
+// frames, every other stretch moves in one device call without being cached.
+void cache_read_run(BlockCache *cache, int block_number, int count, void *blocks);
+void cache_write_run(BlockCache *cache, int block_number, int count, const void *blocks);
+
+// Like the run functions for consecutive blocks spread over several buffers,
+// each a whole number of blocks, but always one device call: a read overlays
+// the cached blocks on what the device returned.
+void cache_read_vec(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt);
+void cache_write_vec(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt);
+
+// copies the cached blocks of a vector read behind the cache's back over it
+void cache_overlay(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt);
+
+void cache_flush(BlockCache *cache);
+void cache_invalidate(BlockCache *cache);
+
+#endif // CACHE_H_
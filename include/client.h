@@ -0,0 +1,62 @@
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#include "fs_errors.h"
+#include "fs_types.h"
+#include "protocol.h"
+#include <stddef.h>
+
+typedef struct ClientBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} ClientBuffer;
+
+typedef struct FsClient {
+    int fd;
+    uint32_t next_id;  // id of the next request, never 0
+    ClientBuffer out;  // requests not yet sent
+    ClientBuffer in;   // received bytes
+    size_t start;      // first byte of in not yet handed out as a reply
+    ErrorCode error;   // why the last call failed
+} FsClient;
+
+// A reply as received; data points into the client's buffer and stays valid
+// until the next client_receive.
+typedef struct FsReply {
+    uint32_t id;
+    int status;        // as in WireReply
+    const char *data;
+    size_t length;
+} FsReply;
+
+// Connects to a mini_fs server on socket_path. Returns -1 when it cannot.
+int client_connect(FsClient *client, const char *socket_path);
+void client_close(FsClient *client);
+
+// Pipelining: client_send queues a request and returns its id, or 0 when it
+// does not fit in a frame. Queued requests go out on client_flush or once
+// enough pile up; client_receive waits for the next reply, in send order.
+// client_buffered tells whether that reply is already here. The transport
+// calls return -1 with error ERR_CONNECTION when the server is gone.
+uint32_t client_send(FsClient *client, WireOp op, const char *path, const char *data, size_t length,
+                     uint32_t count, long long offset);
+int client_flush(FsClient *client);
+int client_receive(FsClient *client, FsReply *reply);
+int client_buffered(const FsClient *client);
+
+// One request at a time, returning what the fs_* call of the same name does
+// on the server; on failure -1, with the server's code in error.
+int client_mkdir(FsClient *client, const char *path);
+int client_create(FsClient *client, const char *path);
+int client_write(FsClient *client, const char *path, const char *data);
+int client_read(FsClient *client, const char *path, char *buf, int bufsize);
+int client_delete(FsClient *client, const char *path);
+int client_rmdir(FsClient *client, const char *path);
+int client_ls(FsClient *client, const char *path, DirectoryEntry *entries, int max_entries);
+int client_preallocate(FsClient *client, const char *path, long long size);
+int client_pread(FsClient *client, const char *path, char *buf, int length, long long offset);
+int client_pwrite(FsClient *client, const char *path, const char *data, int length, long long offset);
+int client_sync(FsClient *client);
+
+#endif // CLIENT_H_
@@ -0,0 +1,19 @@
+#ifndef CONTEND_H_
+#define CONTEND_H_
+
+typedef struct ContendOptions {
+    int readers; // most reader threads; runs double from 1 up to this
+    int seconds; // per run
+    int files;   // that stay in the directory
+} ContendOptions;
+
+void contend_default_options(ContendOptions *options);
+
+// Lists one directory of diskfile from reader threads while a writer creates
+// and deletes files in it, once with every listing taking the namespace lock
+// and once copying kept listings without it, and prints listings per second
+// and the writer's changes per second for each reader count. Leaves the
+// image as it found it. Returns -1 when a listing came out wrong.
+int contend(const char *diskfile, const ContendOptions *options);
+
+#endif // CONTEND_H_
@@ -0,0 +1,46 @@
+#ifndef DCACHE_H_
+#define DCACHE_H_
+
+#include "lock.h"
+
+#define DCACHE_ENTRIES 256
+#define DCACHE_NAME_SIZE 28 // same as MAX_NAME_SIZE
+
+typedef struct Dentry {
+    int parent;       // directory inode, -1 when the slot is empty
+    int inode_number; // -1 caches a name that does not exist
+    int type;         // entry type, -1 for a missing name
+    int referenced;   // CLOCK second chance bit
+    int next;         // next dentry in the same hash bucket, -1 ends the chain
+    char name[DCACHE_NAME_SIZE];
+} Dentry;
+
+typedef struct DentryStats {
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+    unsigned long invalidations;
+    unsigned long retries;       // lookups started over because the cache changed under them
+} DentryStats;
+
+typedef struct DentryCache {
+    Dentry *entries;
+    int *buckets;
+    int num_entries;
+    int hand;         // CLOCK hand
+    DentryStats stats;
+    Mutex lock;       // held to change the entries; lookups take no lock
+    SeqLock seq;      // odd while the entries change
+} DentryCache;
+
+int dcache_init(DentryCache *dcache, int num_entries, int thread_safe);
+void dcache_destroy(DentryCache *dcache);
+
+int dcache_lookup(DentryCache *dcache, int parent, const char *name, int *inode_number, int *type);
+void dcache_insert(DentryCache *dcache, int parent, const char *name, int inode_number, int type);
+
+void dcache_invalidate(DentryCache *dcache, int parent, const char *name);
+void dcache_invalidate_dir(DentryCache *dcache, int parent);
+void dcache_clear(DentryCache *dcache);
+
+#endif // DCACHE_H_
@@ -0,0 +1,40 @@
+#ifndef DELALLOC_H_
+#define DELALLOC_H_
+
+#define DELALLOC_FILES 16           // files that can hold buffered appends at once
+#define DELALLOC_LIMIT (256 * 1024) // buffered bytes at which a file is flushed
+#define DELALLOC_PATH_SIZE 256      // same as MAX_PATH_SIZE
+
+typedef struct PendingWrite {
+    int inode_number; // -1 when the slot is empty
+    int length;       // bytes buffered past the file's size on disk
+    int capacity;
+    int reserved;     // data blocks held back for this file until it is flushed
+    long long size;   // size on disk when the first append was buffered
+    int allocated;    // data blocks mapped on disk, preallocated ones included
+    char *data;
+    char path[DELALLOC_PATH_SIZE]; // path of the first buffered write, for error reports
+} PendingWrite;
+
+typedef struct DelallocStats {
+    unsigned long appends;  // writes buffered without touching the disk
+    unsigned long flushes;  // buffered files written out
+    unsigned long extents;  // extents the flushes added to files
+} DelallocStats;
+
+typedef struct DelayedAlloc {
+    PendingWrite files[DELALLOC_FILES];
+    int reserved;           // sum of the files' reservations
+    DelallocStats stats;
+} DelayedAlloc;
+
+void delalloc_init(DelayedAlloc *delalloc);
+void delalloc_destroy(DelayedAlloc *delalloc);
+
+PendingWrite *delalloc_find(DelayedAlloc *delalloc, int inode_number);
+PendingWrite *delalloc_open(DelayedAlloc *delalloc, int inode_number, const char *path, long long size, int allocated);
+int delalloc_append(PendingWrite *pending, const char *data, int length);
+void delalloc_reserve(DelayedAlloc *delalloc, PendingWrite *pending, int blocks);
+void delalloc_drop(DelayedAlloc *delalloc, PendingWrite *pending);
+
+#endif // DELALLOC_H_
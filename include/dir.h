@@ -0,0 +1,37 @@
+#ifndef DIR_H_
+#define DIR_H_
+
+#include "fs_types.h"
+
+#define DIR_INDEX_MAGIC 0x48545245
+
+typedef struct DirIndexEntry {
+    unsigned int hash; // lowest name hash stored in the leaf
+    int block_number;  // leaf block, laid out like a linear directory block
+} DirIndexEntry;
+
+// first block of an indexed directory, entries sorted by hash
+typedef struct DirIndex {
+    int magic;
+    int count;
+    DirIndexEntry entries[];
+} DirIndex;
+
+#define MAX_INDEX_ENTRIES(fs) ((int)(((fs)->sb.block_size - sizeof(DirIndex)) / sizeof(DirIndexEntry)))
+
+#define DIR_FULL 1 // dir_insert: the directory has no leaf that can take the name
+
+// The index is a single block, so a directory holds at most
+// MAX_INDEX_ENTRIES leaves of MAX_ENTRIES names: 4064 names with 1K blocks,
+// and in practice about 2900, as a split leaves both halves part empty. A
+// full leaf splits while the index has room; once it has none, two
+// neighbouring leaves that fit in one are merged to make room. dir_insert
+// returns DIR_FULL when neither works, and -1 when the image is out of blocks.
+
+int dir_lookup(FsContext *fs, const Inode *dir, const char *name, int *type);
+int dir_insert(FsContext *fs, int dir_number, Inode *dir, const char *name, int inode_number, int type);
+int dir_remove(FsContext *fs, int dir_number, Inode *dir, const char *name);
+int dir_list(FsContext *fs, const Inode *dir, DirectoryEntry *entries, int max_entries);
+void dir_release(FsContext *fs, Inode *dir);
+
+#endif // DIR_H_
@@ -1,37 +1,59 @@
-#ifndef DISK_H_
-#define DISK_H_
-
-#include "fs_types.h"
-#include <stdio.h>
-
-#define MAX_DEPTH 20
-#define TOKEN_LEN 28
-
-#define MAX_ENTRIES BLOCK_SIZE/sizeof(DirectoryEntry)
-#define MAX_INODES BLOCK_SIZE/sizeof(Inode)
-
-static char disk_image[28] = "disk.img";
-static char backup_image[35] = "disk.img.backup";
-
-void begin_transaction();
-void rollback_transaction();
-void commit_transaction();
-
-int read_superblock(FILE *disk, SuperBlock *sb);
-void read_inode(FILE *disk, int inode_start, int inode_number, Inode *inode);
-void read_block(FILE *disk, int block_number, void *bock);
-
-void write_superblock(FILE *disk, const SuperBlock *sb);
-void write_inode(FILE *disk, int inode_start, int inode_number, const Inode *inode);
-void write_block(FILE *disk, int block_number, const void *bock);
-
-int create_inode(FILE *disk, SuperBlock *sb, Type type);
-
-int tokenize_path(const char *path, char tokens[MAX_DEPTH][TOKEN_LEN]);
-
-int find_inode_by_path(FILE *disk, int inode_start, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth);
-
-int is_dir_exist(FILE *disk, int inode_start, int parent_inode, const char *name);
-int is_file_exist(FILE *disk, int inode_start, int parent_inode, const char *name);
-
-#endif // DISK_H_
\ No newline at end of file
+#ifndef DISK_H_
+#define DISK_H_
+
+#include "fs_types.h"
+#include <stdio.h>
+
+#define MAX_DEPTH 20
+#define TOKEN_LEN 28
+
+#define MAX_ENTRIES(fs) ((int)((fs)->sb.block_size / sizeof(DirectoryEntry)))
+#define MAX_INODES(fs) ((int)((fs)->sb.block_size / sizeof(Inode)))
+
+int disk_open(FsContext *fs, const MountOptions *options);
+void disk_close(FsContext *fs);
+void flush_blocks(FsContext *fs);
+int open_journal(FsContext *fs, int replay);
+
+// A commit that fails loses its whole group, operations that have already
+// returned included. The mount then refuses changes (commit_failed) and
+// reloads what it keeps in memory from the image.
+void begin_transaction(FsContext *fs);
+void rollback_transaction(FsContext *fs);
+int commit_transaction(FsContext *fs);
+int sync_transaction(FsContext *fs);
+
+int read_superblock(FsContext *fs);
+void read_inode(FsContext *fs, int inode_number, Inode *inode);
+void read_block(FsContext *fs, int block_number, void *block);
+
+void write_superblock(FsContext *fs);
+void write_inode(FsContext *fs, int inode_number, const Inode *inode);
+
+// Inside a transaction a block that cannot be logged is not written at all:
+// these return -1, and commit_transaction rolls the operation back.
+int write_block(FsContext *fs, int block_number, const void *block);
+
+void read_blocks(FsContext *fs, int block_number, int count, void *blocks);
+int write_blocks(FsContext *fs, int block_number, int count, const void *blocks);
+
+// consecutive blocks scattered over buffers that each hold whole blocks
+void read_blocks_vec(FsContext *fs, int block_number, const struct iovec *iov, int iovcnt);
+void overlay_blocks(FsContext *fs, int block_number, const struct iovec *iov, int iovcnt);
+
+int create_inode(FsContext *fs, int parent_inode, Type type);
+void free_inode(FsContext *fs, int inode_number);
+
+int tokenize_path(const char *path, char tokens[MAX_DEPTH][TOKEN_LEN]);
+
+int lookup_child(FsContext *fs, int parent_inode, const char *name, int *type);
+int find_inode_by_path(FsContext *fs, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth);
+
+// find_inode_by_path from cached names alone, for readers holding no lock:
+// -1 when a component is not cached, missing or not a directory.
+int find_cached_inode(FsContext *fs, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth);
+
+int is_dir_exist(FsContext *fs, int parent_inode, const char *name);
+int is_file_exist(FsContext *fs, int parent_inode, const char *name);
+
+#endif // DISK_H_
@@ -0,0 +1,17 @@
+#ifndef EXTENT_H_
+#define EXTENT_H_
+
+#include "fs_types.h"
+
+// runs past INODE_EXTENTS are kept in the file's extent_block
+#define MAX_BLOCK_EXTENTS(fs) ((int)((fs)->sb.block_size / sizeof(Extent)))
+#define MAX_FILE_EXTENTS(fs) (INODE_EXTENTS + MAX_BLOCK_EXTENTS(fs))
+
+int extent_list(FsContext *fs, const Inode *inode, Extent *extents);
+int extent_lookup(const Extent *extents, int num_extents, int logical, int *run);
+int extent_blocks(const Extent *extents, int num_extents);
+
+int extent_grow(FsContext *fs, int inode_number, Inode *inode, int count);
+void extent_release(FsContext *fs, Inode *inode);
+
+#endif // EXTENT_H_
@@ -1,15 +1,103 @@
-#ifndef FS_H_
-#define FS_H_
-
-#include "fs_types.h"
-
-void mkfs(const char *diskfile);
-int mkdir_fs(const char *path);
-int create_fs(const char *path);
-int write_fs(const char *path, const char *data);
-int read_fs(const char *path, char *buf, int bufsize);
-int delete_fs(const char *path);
-int rmdir_fs(const char *path);
-int ls_fs(const char *path, DirectoryEntry *entries, int max_entries);
-
-#endif // FS_H_
\ No newline at end of file
+#ifndef FS_H_
+#define FS_H_
+
+#include "fs_types.h"
+#include "fs_errors.h"
+
+void mkfs(const char *diskfile);
+void mkfs_default_options(MkfsOptions *options);
+int mkfs_with(const char *diskfile, const MkfsOptions *options);
+int mkdir_fs(const char *path);
+int create_fs(const char *path);
+int write_fs(const char *path, const char *data);
+int read_fs(const char *path, char *buf, int bufsize);
+int delete_fs(const char *path);
+int rmdir_fs(const char *path);
+int ls_fs(const char *path, DirectoryEntry *entries, int max_entries);
+int preallocate_fs(const char *path, long long size);
+int pread_fs(const char *path, char *buf, int length, long long offset);
+int pwrite_fs(const char *path, const char *data, int length, long long offset);
+
+// A mount with thread_safe set takes calls from any number of threads. Calls
+// that read a file or list a directory run side by side, a call changing a
+// file waits for that file's readers only, and changes run one at a time;
+// creating, deleting, opening and closing hold every other call off. Such a
+// mount always reads and writes the image positionally and reads no blocks
+// ahead.
+//
+// Path lookups found in the name cache take no lock, and fs_ls answers from a
+// kept copy of the directory's entries without locking, retrying when a
+// change to the names lands halfway through; listing_dirs directories are
+// kept, 0 for none.
+//
+// Between processes a mount holds a lock on the image until it is unmounted:
+// exclusive by default, or shared with image_lock set to IMAGE_LOCK_SHARED,
+// in which case the calls that would change the image fail with
+// ERR_READ_ONLY. mkfs waits for every mount to go. fs_image_lock_stats says
+// how long the mount waited for other processes.
+//
+// With group commit a call returns before its changes are durable. A commit
+// that fails loses every call in its group: the mount then refuses changes
+// with ERR_COMMIT, and fs_sync and fs_unmount return -1.
+void fs_default_options(MountOptions *options);
+ErrorCode fs_mount(const char *diskfile, FsContext *fs);
+ErrorCode fs_mount_with(const char *diskfile, const MountOptions *options, FsContext *fs);
+int fs_unmount(FsContext *fs);
+int fs_sync(FsContext *fs);
+void fs_commit_due(FsContext *fs);
+void fs_cache_stats(const FsContext *fs, CacheStats *stats);
+void fs_dcache_stats(const FsContext *fs, DentryStats *stats);
+void fs_listing_stats(const FsContext *fs, ListingStats *stats);
+void fs_delalloc_stats(const FsContext *fs, DelallocStats *stats);
+void fs_io_stats(const FsContext *fs, BlockDeviceStats *stats);
+void fs_aio_stats(const FsContext *fs, AioStats *stats);
+void fs_readahead_stats(const FsContext *fs, ReadaheadStats *stats);
+void fs_open_file_stats(const FsContext *fs, OpenFileStats *stats);
+void fs_journal_stats(const FsContext *fs, JournalStats *stats);
+void fs_image_lock_stats(const FsContext *fs, ImageLockStats *stats);
+
+int fs_mkdir(FsContext *fs, const char *path);
+int fs_create(FsContext *fs, const char *path);
+int fs_write(FsContext *fs, const char *path, const char *data);
+int fs_read(FsContext *fs, const char *path, char *buf, int bufsize);
+int fs_delete(FsContext *fs, const char *path);
+int fs_rmdir(FsContext *fs, const char *path);
+int fs_ls(FsContext *fs, const char *path, DirectoryEntry *entries, int max_entries);
+int fs_preallocate(FsContext *fs, const char *path, long long size);
+
+// Positional, binary-safe I/O: pread returns the bytes read, short at the end
+// of the file and never NUL-terminated; pwrite overwrites in place and extends
+// the file past its end, zero-filling any gap.
+int fs_pread(FsContext *fs, const char *path, char *buf, int length, long long offset);
+int fs_pwrite(FsContext *fs, const char *path, const char *data, int length, long long offset);
+
+// Handles: fs_open resolves the path once and keeps the inode and block map
+// in memory, so fs_pread_fd and fs_pwrite_fd skip the path walk and the inode
+// table. The inode is written back by fs_flush and fs_close, and a file with
+// open handles cannot be deleted.
+int fs_open(FsContext *fs, const char *path);
+int fs_pread_fd(FsContext *fs, int handle, char *buf, int length, long long offset);
+int fs_pwrite_fd(FsContext *fs, int handle, const char *data, int length, long long offset);
+int fs_flush(FsContext *fs, int handle);
+int fs_close(FsContext *fs, int handle);
+
+// Batches: between fs_begin_batch and fs_end_batch every call joins a single
+// transaction. fs_end_batch commits it, or returns -1 and writes nothing when
+// commit is 0 or a call failed and rolled back (fs_batch_failed tells); the
+// calls after a failed one find the batch's changes gone, and are thrown away
+// as well. The transaction is logged in one journal pass, so a call that
+// takes the batch past one fails with ERR_NO_SPACE like any other. On a
+// thread-safe mount no other thread may call in while a batch is open.
+void fs_begin_batch(FsContext *fs);
+int fs_batch_failed(const FsContext *fs);
+int fs_end_batch(FsContext *fs, int commit);
+
+// Asynchronous read_fs: the path is resolved at once, the data runs are read
+// in the background and done gets the byte count or -1 from fs_poll. buf
+// must stay valid until then; changes to the file meanwhile may or may not
+// be seen.
+typedef void (*FsReadDone)(void *arg, int result);
+int fs_read_submit(FsContext *fs, const char *path, char *buf, int bufsize, FsReadDone done, void *arg);
+int fs_poll(FsContext *fs, int wait);
+
+#endif // FS_H_
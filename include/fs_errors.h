@@ -1,18 +1,32 @@
-#ifndef ERRORS_H
-#define ERRORS_H
-
-typedef enum {
-    ERR_NONE = 0,
-    ERR_PATH,
-    ERR_DISK,
-    ERR_FORMAT,
-    ERR_NO_SUCH_FILE,
-    ERR_FILE_EXISTS,
-    ERR_DIR_EXISTS,
-    ERR_DIR_NOT_EMPTY,
-    ERR_NO_SPACE
-} ErrorCode;
-
-void print_error(const char *command, const char* path, ErrorCode code);
-
-#endif // ERRORS_H
+#ifndef ERRORS_H
+#define ERRORS_H
+
+typedef enum {
+    ERR_NONE = 0,
+    ERR_PATH,
+    ERR_DISK,
+    ERR_FORMAT,
+    ERR_NO_SUCH_FILE,
+    ERR_FILE_EXISTS,
+    ERR_DIR_EXISTS,
+    ERR_DIR_NOT_EMPTY,
+    ERR_NO_SPACE,
+    ERR_INVALID,
+    ERR_BAD_HANDLE,
+    ERR_FILE_OPEN,
+    ERR_TOO_MANY_OPEN,
+    ERR_READ_ONLY,
+    ERR_CONNECTION,
+    ERR_COMMIT,
+    ERR_DIR_FULL
+} ErrorCode;
+
+void print_error(const char *command, const char* path, ErrorCode code);
+
+// The code of the calling thread's last print_error, cleared by reading it,
+// and whether print_error prints at all in this thread; a server reports
+// errors to its clients instead.
+ErrorCode take_error(void);
+void quiet_errors(int on);
+
+#endif // ERRORS_H
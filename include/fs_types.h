@@ -1,37 +1,182 @@
-#ifndef FS_TYPES_H_
-#define FS_TYPES_H_
-
-#define BLOCK_SIZE 1024
-#define MAX_NAME_SIZE 28
-
-typedef enum {
-    TYPE_FILE = 0,
-    TYPE_DIR
-} Type;
-
-
-typedef struct SuperBlock {
-    int magic_number; // filesystem identifier
-    int num_blocks;   // total blocks(1024)
-    int num_inodes;   // total inodes(e.g., 128)
-    int bitmap_start; // block index of free-block bitmap
-    int inode_start;  // block index of inode table
-    int data_start;   // block index of first data block
-} SuperBlock;
-
-
-typedef struct Inode {
-    int is_valid;         // 0=free, 1= used
-    int size;             // bytes(file) or entry count(directory)
-    int direct_blocks[4]; // direct block pointers
-    int is_directory;     // 0=file, 1= directory
-    int owner_id;         // your student id number
-} Inode;
-
-
-typedef struct DirectoryEntry {
-    int inode_number;
-    char name[MAX_NAME_SIZE]; // 27 ASCII chars + null terminator (\0)
-} DirectoryEntry;
-
+#ifndef FS_TYPES_H_
+#define FS_TYPES_H_
+
+#include "blockdev.h"
+#include "cache.h"
+#include "dcache.h"
+#include "delalloc.h"
+#include "journal.h"
+#include "listing.h"
+#include "lock.h"
+#include "readahead.h"
+
+#define FS_MAGIC 0xDEADBEEF
+#define FS_VERSION 9
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_IMAGE_SIZE (1024LL * 1024)
+#define DEFAULT_INODE_RATIO 4096 // bytes of image per inode
+#define MAX_INODE_NUMBER 0xFFFFFF // directory entries keep 24 bit inode numbers
+#define MAX_NAME_SIZE 28
+#define MAX_PATH_SIZE 256
+
+typedef enum {
+    TYPE_FILE = 0,
+    TYPE_DIR
+} Type;
+
+#define INODE_INDEXED 0x1 // directory keeps a hash index in direct_blocks[0]
+
+
+typedef struct SuperBlock {
+    int magic_number; // filesystem identifier
+    int num_blocks;   // total blocks in the image
+    int num_inodes;   // inodes in use
+    int version;        // on-disk format version (FS_VERSION)
+    int journal_start;  // block index of the journal region
+    int journal_blocks; // length of the journal region
+    int total_inodes;        // inode slots over all groups
+    int block_size;          // bytes per block, chosen at mkfs
+    int gdt_start;           // block index of the group descriptor table
+    int gdt_blocks;          // length of the group descriptor table
+    int group_start;         // block index of group 0
+    int num_groups;          // block groups in the image
+    int blocks_per_group;    // stride between groups, the last one may be shorter
+    int inodes_per_group;    // inode slots in each group's inode table
+    int inode_table_blocks;  // length of each group's inode table
+} SuperBlock;
+
+
+// group regions mkfs leaves as holes in the image
+#define GROUP_BLOCK_UNINIT  0x1 // block bitmap never written, every data block free
+#define GROUP_INODE_UNINIT  0x2 // inode bitmap never written, every inode free
+#define GROUP_ITABLE_UNINIT 0x4 // inode table written only up to inode_table_init
+
+// A group is a block bitmap, an inode bitmap, an inode table and the data
+// blocks they describe, laid out in that order.
+typedef struct GroupDesc {
+    int data_blocks;      // data blocks in the group, one bitmap bit each
+    int free_blocks;      // clear bits in the block bitmap
+    int free_inodes;      // clear bits in the inode bitmap
+    int free_hint;        // every data block below this index is in use
+    int flags;            // GROUP_* bits
+    int inode_table_init; // leading inode table blocks written since mkfs
+} GroupDesc;
+
+
+typedef struct Extent {
+    int start;  // first block of the run
+    int length; // blocks in the run
+} Extent;
+
+#define INODE_EXTENTS 4
+
+typedef struct Inode {
+    long long size;       // bytes(file) or entry count(directory)
+    int is_valid;         // 0=free, 1= used
+    int is_directory;     // 0=file, 1= directory
+    union {
+        int direct_blocks[4];          // directory: direct block pointers
+        Extent extents[INODE_EXTENTS]; // file: first runs of data, in file order
+    };
+    int num_extents;      // file: runs in use, the ones past INODE_EXTENTS live in extent_block
+    int extent_block;     // file: block holding the further runs, -1 if none
+    int owner_id;         // your student id number
+    int flags;            // INODE_* bits
+} Inode;
+
+
+typedef struct DirectoryEntry {
+    unsigned int inode_number : 24; // 0 marks a free slot
+    unsigned int type : 8;          // Type of the child, so lookups need not read its inode
+    char name[MAX_NAME_SIZE]; // 27 ASCII chars + null terminator (\0)
+} DirectoryEntry;
+
+
+typedef struct MkfsOptions {
+    long long image_size; // bytes, rounded down to whole blocks
+    int block_size;       // 1024, 4096 or 65536
+    int inode_ratio;      // one inode per this many bytes of image
+} MkfsOptions;
+
+
+typedef struct MountOptions {
+    Backend backend;   // BACKEND_PREAD, BACKEND_URING, BACKEND_STDIO or BACKEND_MMAP
+    AioEngine aio_engine; // engine behind fs_read_submit, AIO_ENGINE_URING or AIO_ENGINE_THREADS
+    int cache_frames;  // 0 sends every block straight to the backend
+    int dcache_entries; // 0 resolves every path component from directory blocks
+    int listing_dirs;  // directories whose listing ls_fs copies without locking, 0 for none
+    int commit_ops;    // group commit: operations gathered into one commit, 1 commits each alone
+    int commit_ms;     // and the longest the first of them waits for it, 0 for no limit
+    int thread_safe;   // calls may come from several threads at once
+    ImageLockMode image_lock; // IMAGE_LOCK_SHARED mounts only read, beside other such mounts
+} MountOptions;
+
+
+// A file opened with fs_open. Its inode and block map stay in memory, so
+// reads and writes through the handle walk no path and read no inode; the
+// inode goes back to the table on fs_flush, fs_close, fs_sync or unmount.
+#define FS_OPEN_FILES 32
+#define FS_FILE_LOCKS 64 // file locks of a thread-safe mount, picked by inode number
+
+typedef struct OpenFile {
+    int inode_number;    // -1 when the slot is free
+    int opens;           // fs_open calls not closed yet; they share the slot
+    int dirty;           // inode changed since it was last written
+    int stale;           // a call by path changed the file, reload before use
+    Inode inode;
+    Extent *extents;     // the file's runs, room for MAX_FILE_EXTENTS
+    int num_extents;
+    char path[MAX_PATH_SIZE]; // path of the first open, for error reports
+} OpenFile;
+
+typedef struct OpenFileStats {
+    unsigned long opens;      // fs_open calls that walked a path
+    unsigned long calls;      // reads and writes served from a handle
+    unsigned long writebacks; // inodes written back from a handle
+    unsigned long reloads;    // handles refreshed after a call by path
+} OpenFileStats;
+
+
+typedef struct FsContext {
+    BlockDevice dev;                 // open disk image
+    SuperBlock sb;                   // superblock read at mount time
+    GroupDesc *groups;               // descriptor table, loaded at mount
+    int *inode_hints;                // per group, every inode below this index is in use
+    int uninit_groups;               // groups with any GROUP_*_UNINIT bit set
+    RwLock group_lock;               // the GROUP_*_UNINIT state, which reads check
+    BlockCache cache;                // write-back cache in front of the disk
+    DentryCache dcache;              // (parent inode, name) -> inode, misses included
+    ListingCache listing;            // listings of directories ls_fs reads often
+    Journal journal;                 // redo log for mutating operations
+    ImageLock image_lock;            // against other processes mounting the image
+    DelayedAlloc delalloc;           // appends waiting for blocks
+    Readahead readahead;             // per file prefetch for sequential readers
+    OpenFile files[FS_OPEN_FILES];   // handles from fs_open
+    OpenFileStats file_stats;
+    int batch;                       // inside fs_begin_batch: one transaction for every call
+    int batch_failed;                // a call in the batch rolled back
+    int commit_failed;               // a commit lost operations that had returned: no more changes
+    int reads_in_flight;             // fs_read_submit calls not yet completed
+    unsigned long reads_completed;   // fs_read_submit callbacks run so far
+    char image[MAX_PATH_SIZE];       // disk image path
+
+    // Thread-safe mounts: a call holds names throughout, shared unless it
+    // changes a directory or the handle table, then the lock of the one file
+    // it works on, shared to read it and exclusive to change it, and a call
+    // that changes anything takes the transaction last.
+    int thread_safe;
+    RwLock names;
+    SeqLock names_seq;               // odd while a call holds names exclusive, for readers that skip it
+    RwLock file_locks[FS_FILE_LOCKS];
+    Mutex transaction;               // writers take turns at the running transaction
+    Mutex async;                     // fs_read_submit and fs_poll share the async engine
+    pthread_cond_t commit_wake;      // the committer keeps commit_ms while calls are idle
+    pthread_t committer;
+    int committer_running;
+    int committer_stop;
+} FsContext;
+
 #endif // FS_TYPES_H_
\ No newline at end of file
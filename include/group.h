@@ -0,0 +1,29 @@
+#ifndef GROUP_H_
+#define GROUP_H_
+
+#include "fs_types.h"
+
+#define GROUPS_PER_BLOCK(fs) ((int)((fs)->sb.block_size / sizeof(GroupDesc)))
+
+#define GROUP_START(fs, group) ((fs)->sb.group_start + (group) * (fs)->sb.blocks_per_group)
+#define GROUP_BLOCK_BITMAP(fs, group) GROUP_START(fs, group)
+#define GROUP_INODE_BITMAP(fs, group) (GROUP_START(fs, group) + 1)
+#define GROUP_INODE_TABLE(fs, group) (GROUP_START(fs, group) + 2)
+#define GROUP_DATA_START(fs, group) (GROUP_INODE_TABLE(fs, group) + (fs)->sb.inode_table_blocks)
+
+#define GROUP_OF_BLOCK(fs, block_number) (((block_number) - (fs)->sb.group_start) / (fs)->sb.blocks_per_group)
+#define GROUP_OF_INODE(fs, inode_number) ((inode_number) / (fs)->sb.inodes_per_group)
+
+// where the first block of an inode's data is looked for
+#define INODE_GOAL(fs, inode_number) GROUP_DATA_START(fs, GROUP_OF_INODE(fs, inode_number))
+
+int read_groups(FsContext *fs);
+void write_group(FsContext *fs, int group);
+void free_groups(FsContext *fs);
+
+int group_for_directory(const FsContext *fs, int parent_group);
+
+int group_block_uninit(FsContext *fs, int block_number);
+void group_block_written(FsContext *fs, int block_number);
+
+#endif // GROUP_H_
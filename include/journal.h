@@ -0,0 +1,113 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include "blockdev.h"
+#include "cache.h"
+#include "lock.h"
+
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4A444553
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54
+
+#define JOURNAL_FULL 1 // journal_add: the transaction has no room for the block
+
+// journal block 0
+typedef struct JournalHeader {
+    int magic;
+    int sequence; // sequence number of the next transaction
+} JournalHeader;
+
+// journal block 1, followed by one copy per listed block and a commit block
+typedef struct JournalDescriptor {
+    int magic;
+    int sequence;
+    int count;
+    int blocks[]; // home locations of the logged blocks
+} JournalDescriptor;
+
+typedef struct JournalCommit {
+    int magic;
+    int sequence;
+    int count;
+    unsigned int checksum; // over the descriptor and every logged block
+} JournalCommit;
+
+typedef struct JournalStats {
+    unsigned long commits;
+    unsigned long blocks_logged;
+    unsigned long replays;
+    unsigned long ops;            // operations the commits made durable
+    unsigned long max_ops;        // most operations in one commit
+    unsigned long long commit_ns; // time spent writing commits
+    unsigned long long max_commit_ns;
+    unsigned long long wait_ns;   // summed over operations, from finishing to durable
+    unsigned long long max_wait_ns;
+} JournalStats;
+
+typedef struct Journal {
+    int start;       // first block of the journal region
+    int num_blocks;  // length of the journal region
+    int block_size;
+    int sequence;
+    int active;      // inside begin/commit
+    int count;       // blocks in the running transaction
+    int capacity;
+    int *blocks;     // home block numbers, in first write order
+    char *data;      // count block images
+    int *slots;      // open addressed index into blocks, 0 means empty
+    int num_slots;
+    int mark;        // count when the running operation began
+    int *undo;       // entries below mark the running operation overwrote
+    char *undo_data; // their images from before it
+    int undo_count;
+    int undo_capacity;
+    int failed;      // the running operation lost a block and cannot commit
+    int ops;         // finished operations waiting for the commit
+    long long first_ns;  // when the first of them finished
+    long long ops_ns;    // sum of their finish times
+    int group_ops;   // commit once this many operations wait
+    int group_ms;    // or once the first has waited this long
+    unsigned long checkpoints; // times logged blocks went home and left the write set
+    JournalStats stats;
+    RwLock lock;     // the write set: shared by lookups, exclusive to change it
+} Journal;
+
+int journal_init(Journal *journal, int start, int num_blocks, int block_size, int thread_safe);
+void journal_destroy(Journal *journal);
+
+// Replays a committed transaction the journal still holds. With replay 0 it
+// writes nothing and returns 1 when there is one.
+int journal_recover(Journal *journal, BlockDevice *dev, int replay);
+
+// Operations log into one running transaction. journal_end closes an
+// operation and says whether the transaction is due, journal_abort takes back
+// only the running operation, and journal_commit makes everything durable.
+// One thread at a time runs the transaction; any thread may look blocks up.
+//
+// A transaction is committed in one pass, so it never holds more blocks than
+// journal_pass_blocks. journal_add returns JOURNAL_FULL for a block that
+// would take it past that; journal_commit_before then commits the operations
+// before the running one, which carries on in a transaction of its own, or
+// fails when there are none. The caller sets failed for a block it could not
+// log; the running operation then logs nothing more and has to be aborted.
+void journal_begin(Journal *journal);
+int journal_empty(Journal *journal);
+int journal_lookup(Journal *journal, int block_number, void *block);
+int journal_add(Journal *journal, int block_number, const void *block);
+int journal_end(Journal *journal);
+int journal_due(const Journal *journal);
+int journal_commit(Journal *journal, BlockDevice *dev, BlockCache *cache);
+int journal_commit_before(Journal *journal, BlockDevice *dev, BlockCache *cache);
+void journal_abort(Journal *journal);
+int journal_pass_blocks(const Journal *journal);
+
+// A read that goes to the device behind the journal's back, as prefetches and
+// asynchronous ones do, can only rely on journal_lookup for the blocks it got
+// while the count stays where it was: a checkpoint writes the blocks home
+// after the read may have fetched them and then forgets them.
+unsigned long journal_checkpoints(Journal *journal);
+
+// whether the write set holds any of count blocks
+int journal_holds(Journal *journal, const int *blocks, int count);
+
+#endif // JOURNAL_H_
@@ -0,0 +1,54 @@
+#ifndef LISTING_H_
+#define LISTING_H_
+
+#include "lock.h"
+#include <stdint.h>
+
+#define LISTING_DIRS 16     // directories whose listing is kept
+#define LISTING_ENTRIES 128 // entries a kept listing holds at most
+#define LISTING_RETRIES 8   // copies a reader tries before it takes the locks instead
+
+// A copy of one directory's listing, as dir_list returns it. Whoever changes
+// the directory brings the copy up to date under its sequence count, and
+// readers copy it out without taking a lock.
+typedef struct Listing {
+    int dir;             // directory inode, -1 when the slot is empty
+    int count;           // entries in the copy
+    int referenced;      // CLOCK second chance bit
+    SeqLock seq;         // odd while the copy changes
+    uint64_t *words;     // the entries, LISTING_ENTRIES of them at most
+} Listing;
+
+typedef struct ListingStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long retries; // copies started over because the listing or the names changed under them
+    unsigned long stores;  // listings copied in, after a locked read or a change to the directory
+    unsigned long drops;
+} ListingStats;
+
+typedef struct ListingCache {
+    Listing *dirs;
+    int num_dirs;
+    int entry_size;      // bytes per entry, a multiple of 8
+    int hand;            // CLOCK hand
+    ListingStats stats;
+    Mutex lock;          // held to change a listing; readers take no lock
+} ListingCache;
+
+int listing_init(ListingCache *listing, int num_dirs, int entry_size, int thread_safe);
+void listing_destroy(ListingCache *listing);
+
+// Copies up to max_entries of dir's listing to entries and returns how many,
+// or -1 when it is not kept or kept changing under the reader.
+int listing_copy(ListingCache *listing, int dir, void *entries, int max_entries);
+
+// Keeps count entries as dir's listing, or drops it when they do not fit.
+void listing_store(ListingCache *listing, int dir, const void *entries, int count);
+
+// whether dir's listing is kept, for a writer to know it has one to refresh
+int listing_kept(ListingCache *listing, int dir);
+void listing_drop(ListingCache *listing, int dir);
+void listing_clear(ListingCache *listing);
+
+#endif // LISTING_H_
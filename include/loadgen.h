@@ -0,0 +1,24 @@
+#ifndef LOADGEN_H_
+#define LOADGEN_H_
+
+typedef struct LoadOptions {
+    int clients;       // connections, one thread each
+    int depth;         // requests each keeps in flight
+    int seconds;
+    int files;         // under /load, shared by all clients
+    int file_size;     // bytes
+    int io_size;       // bytes per pread or pwrite
+    int write_percent; // share of pwrites, the rest are preads
+} LoadOptions;
+
+void loadgen_default_options(LoadOptions *options);
+
+// Checks that the server at socket_path refuses an empty and a relative
+// path, fills files under /load on it, then has every client pipeline random
+// preads and pwrites for the given time and prints requests per second and
+// latency percentiles. pwrites rewrite the bytes the files were filled with,
+// so every pread is checked. Returns 0 when the server refused both paths, no
+// request failed and every read came back right.
+int loadgen(const char *socket_path, const LoadOptions *options);
+
+#endif // LOADGEN_H_
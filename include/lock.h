@@ -0,0 +1,87 @@
+#ifndef LOCK_H_
+#define LOCK_H_
+
+#include <pthread.h>
+
+// Locks of a thread-safe mount. One set up disabled does nothing, so the
+// modules take their locks unconditionally and a mount used from a single
+// thread pays a branch for them.
+typedef struct RwLock {
+    int enabled;
+    pthread_rwlock_t lock;
+} RwLock;
+
+typedef struct Mutex {
+    int enabled;
+    pthread_mutex_t lock;
+} Mutex;
+
+void rwlock_init(RwLock *lock, int enabled);
+void rwlock_destroy(RwLock *lock);
+void rwlock_read(RwLock *lock);
+void rwlock_write(RwLock *lock);
+void rwlock_unlock(RwLock *lock);
+
+void mutex_init(Mutex *lock, int enabled);
+void mutex_destroy(Mutex *lock);
+void mutex_lock(Mutex *lock);
+void mutex_unlock(Mutex *lock);
+
+// counters that threads holding a lock shared bump side by side
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// A sequence count for data that readers copy without taking any lock: a
+// writer makes it odd while it changes the data, and a reader that saw it odd
+// or changed across its copy throws the copy away and tries again. Writers
+// exclude each other by other means. Every field a reader copies is loaded
+// and stored with SEQ_LOAD and SEQ_STORE, so a copy torn by a writer is only
+// ever stale, never undefined.
+typedef struct SeqLock {
+    unsigned int sequence;
+} SeqLock;
+
+unsigned int seq_read_begin(const SeqLock *lock);
+int seq_read_retry(const SeqLock *lock, unsigned int start); // 1 if the copy since start cannot be trusted
+void seq_write_begin(SeqLock *lock);
+void seq_write_end(SeqLock *lock);
+
+#define SEQ_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define SEQ_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+// The lock a mount holds on its image against other processes: an advisory
+// record lock over the whole file, on a descriptor of its own. Exclusive
+// mounts may change the image, shared ones only read it.
+typedef enum {
+    IMAGE_LOCK_EXCLUSIVE = 0,
+    IMAGE_LOCK_SHARED,
+    IMAGE_LOCK_NONE // trust the caller to keep other processes off the image
+} ImageLockMode;
+
+typedef struct ImageLockStats {
+    unsigned long locks;           // requests to take or change the lock
+    unsigned long waits;           // requests another process held up
+    unsigned long long wait_ns;    // time spent held up
+    unsigned long long max_wait_ns;
+} ImageLockStats;
+
+typedef struct ImageLock {
+    int fd;               // -1 when closed
+    ImageLockMode mode;   // what is held, IMAGE_LOCK_NONE before the first lock
+    ImageLockStats stats;
+} ImageLock;
+
+int image_lock_open(ImageLock *lock, const char *path, int create);
+void image_lock_close(ImageLock *lock);
+
+// Blocks until mode is held, IMAGE_LOCK_NONE letting go. Taking a shared
+// lock over an exclusive one downgrades it without letting a writer in
+// between; going the other way waits holding the shared lock, so two shared
+// holders must not both try.
+int image_lock(ImageLock *lock, ImageLockMode mode);
+
+// Whether path no longer names the file the lock is open on: an upgrade
+// renames a new image over the old one while holding it exclusively, so a
+// mount that waited on the old one has to open the path again.
+int image_lock_moved(const ImageLock *lock, const char *path);
+
+#endif // LOCK_H_
@@ -0,0 +1,58 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stdint.h>
+
+// Wire format between mini_fs serve and its clients over a Unix domain
+// socket, in the host's byte order since both ends share the host. A client
+// may send any number of requests before reading the replies, which come
+// back in request order. The server stops reading from a client whose
+// replies pile up unread, so a client should not keep more than a few
+// frames' worth of replies in flight while it is blocked sending.
+//
+// request: WireRequest, path_length bytes of path, then the data up to length
+// reply:   WireReply, then status bytes of payload for reads and listings
+
+#define WIRE_MAX_FRAME (1 << 20) // largest frame, header included
+
+typedef enum {
+    WIRE_MKDIR = 1,
+    WIRE_CREATE,
+    WIRE_WRITE,       // appends the data up to its first NUL, like write_fs
+    WIRE_READ,        // up to count bytes from the start
+    WIRE_DELETE,
+    WIRE_RMDIR,
+    WIRE_LS,          // up to count entries
+    WIRE_PREAD,       // count bytes from offset
+    WIRE_PWRITE,      // the data at offset
+    WIRE_PREALLOCATE, // offset bytes
+    WIRE_SYNC
+} WireOp;
+
+typedef struct WireRequest {
+    uint32_t length;      // bytes that follow this field
+    uint32_t id;          // copied into the reply
+    uint8_t op;           // WireOp
+    uint8_t flags;        // 0
+    uint16_t path_length;
+    uint32_t count;
+    int64_t offset;
+} WireRequest;
+
+// status is what the call returned: bytes for reads and writes, entries for
+// a listing, 0 for the rest, or -ErrorCode when it failed.
+typedef struct WireReply {
+    uint32_t length; // bytes that follow this field
+    uint32_t id;
+    int32_t status;
+} WireReply;
+
+// a listing is status of these, each followed by name_length bytes of name
+typedef struct WireEntry {
+    uint32_t inode_number;
+    uint8_t type;        // Type of the child
+    uint8_t name_length;
+    uint16_t reserved;   // 0
+} WireEntry;
+
+#endif // PROTOCOL_H_
@@ -0,0 +1,72 @@
+#ifndef READAHEAD_H_
+#define READAHEAD_H_
+
+#include "blockdev.h"
+
+#define READAHEAD_FILES 16             // files tracked at once, the least recently read gives way
+#define READAHEAD_MIN_WINDOW 4         // blocks prefetched when a file turns sequential
+#define READAHEAD_MAX_BYTES (128 * 1024) // the window never grows past this
+
+typedef struct FileReadahead {
+    int inode_number;   // -1 when the slot is empty
+    int next;           // logical block a sequential reader asks for next, -1 before the first read
+    int window;         // blocks the next prefetch covers
+    int sequential;     // the last read continued the one before it, or began in its last block
+    int start;          // first logical block of the prefetch
+    int count;          // blocks in the prefetch, 0 if none
+    int used;           // distinct prefetched blocks read so far
+    int pending;        // prefetch requests not yet reaped
+    int failed;         // one of them came back short, the prefetch is void
+    int logged;         // the journal held some of its blocks when it started
+    unsigned long checkpoints; // journal checkpoints by then, see journal_checkpoints
+    unsigned long last_access;
+    char *data;         // count blocks, valid once pending reaches 0
+    unsigned char *read; // per prefetched block, 1 once read
+    IoRequest *requests;
+    struct iovec *iov;
+} FileReadahead;
+
+typedef struct ReadaheadStats {
+    unsigned long windows;    // prefetches started
+    unsigned long prefetched; // blocks they covered
+    unsigned long hits;       // prefetched blocks read at least once
+    unsigned long wasted;     // prefetched blocks dropped without being read
+} ReadaheadStats;
+
+typedef struct Readahead {
+    FileReadahead files[READAHEAD_FILES];
+    int block_size;
+    int max_window;      // blocks, 0 turns readahead off
+    unsigned long clock; // last_access source
+    ReadaheadStats stats;
+} Readahead;
+
+void readahead_init(Readahead *ra, int block_size);
+void readahead_destroy(Readahead *ra, BlockDevice *dev);
+
+// Notes a read of logical blocks [first, last] and returns the file's state,
+// claiming a slot if needed, or NULL with readahead off. The first read of a
+// file, and any read that does not continue the previous one, drops the
+// prefetch and shrinks the window back.
+FileReadahead *readahead_access(Readahead *ra, BlockDevice *dev, int inode_number, int first, int last);
+
+// The prefetched copy of a logical block, waiting for it if it is still in
+// flight; NULL when the prefetch does not hold it.
+char *readahead_block(Readahead *ra, BlockDevice *dev, FileReadahead *file, int logical);
+
+// Once a sequential reader has used up the prefetch, retires it, adapting
+// the window to how much of it was read, and returns the blocks the next one
+// should cover from *first on; 0 while no prefetch is due.
+int readahead_next(Readahead *ra, BlockDevice *dev, FileReadahead *file, int *first);
+
+// Starts a prefetch of count blocks from logical block first, physical[i]
+// holding the home of block first + i. Neighbouring homes share a request.
+void readahead_start(Readahead *ra, BlockDevice *dev, FileReadahead *file, int first, const int *physical, int count);
+
+// drops the prefetch, which the caller found out of date
+void readahead_retire(Readahead *ra, BlockDevice *dev, FileReadahead *file);
+
+// drops whatever is known about a file whose data is about to change
+void readahead_forget(Readahead *ra, BlockDevice *dev, int inode_number);
+
+#endif // READAHEAD_H_
@@ -0,0 +1,23 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include "fs.h"
+
+#define SERVER_MAX_THREADS 64
+
+typedef struct ServerStats {
+    unsigned long connections; // clients accepted
+    unsigned long requests;    // requests answered
+    unsigned long reads;       // read calls on client sockets
+    unsigned long writes;      // write calls on client sockets
+} ServerStats;
+
+// Mounts diskfile thread-safe with options and answers clients on the Unix
+// domain socket socket_path from threads event loops, each accepting and
+// serving clients of its own, until SIGINT or SIGTERM; then unmounts, which
+// commits whatever is waiting. A client's requests run one after another in
+// the order they arrive and their replies go back in that order, several per
+// write when the client pipelines. Returns -1 when it cannot start.
+int serve(const char *diskfile, const char *socket_path, const MountOptions *options, int threads, ServerStats *stats);
+
+#endif // SERVER_H_
@@ -0,0 +1,23 @@
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#include "blockdev.h"
+
+#define FS_VERSION_UNTYPED 4 // directory entries without a type
+#define FS_VERSION_DIRECT 5  // typed entries, four direct blocks per inode, one inode table
+
+// Images from before block groups and extents lay out every block
+// differently, so they are not converted in place: the tree is copied into
+// a fresh image of the same size, which is renamed over the old one. Both
+// versions kept 1024 byte blocks and the journal format of today.
+
+// FS_VERSION_UNTYPED or FS_VERSION_DIRECT for an image in one of those
+// formats, 0 for anything else.
+int legacy_version(BlockDevice *dev);
+
+// Replays the old journal and copies the tree, under an exclusive lock on the
+// image. Returns 0 once path holds an image in the current format (someone
+// else may have upgraded it meanwhile), -1 with the old image left as it was.
+int upgrade_image(const char *diskfile);
+
+#endif // UPGRADE_H_
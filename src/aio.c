@@ -0,0 +1,375 @@
+#include "aio.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void append(IoRequest **head, IoRequest **tail, IoRequest *request) {
+    request->next = NULL;
+
+    if (*tail == NULL) {
+        *head = request;
+    } else {
+        (*tail)->next = request;
+    }
+
+    *tail = request;
+}
+
+static void finish(AsyncIo *aio, IoRequest *request) {
+    aio->in_flight--;
+    aio->stats.completed++;
+    request->complete = 1;
+
+    if (request->done != NULL) {
+        request->done(request);
+    }
+}
+
+// io_uring through the raw system calls; there is no liburing to lean on.
+
+static int ring_setup(AsyncIo *aio) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    aio->ring_fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+    if (aio->ring_fd < 0) {
+        return -1;
+    }
+
+    aio->ring_entries = params.sq_entries;
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // kernels with a single mapping share it between both rings
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cq_ring_size > aio->sq_ring_size) {
+            aio->sq_ring_size = aio->cq_ring_size;
+        }
+        aio->cq_ring_size = 0;
+    }
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = aio->sq_ring;
+    if (aio->sq_ring != MAP_FAILED && aio->cq_ring_size != 0) {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+
+    if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        if (aio->sqes != MAP_FAILED) {
+            munmap(aio->sqes, aio->sqes_size);
+        }
+        if (aio->cq_ring != MAP_FAILED && aio->cq_ring_size != 0) {
+            munmap(aio->cq_ring, aio->cq_ring_size);
+        }
+        if (aio->sq_ring != MAP_FAILED) {
+            munmap(aio->sq_ring, aio->sq_ring_size);
+        }
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    char *sq = aio->sq_ring;
+    char *cq = aio->cq_ring;
+    aio->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)(sq + params.sq_off.array);
+    aio->cq_head = (unsigned *)(cq + params.cq_off.head);
+    aio->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void ring_teardown(AsyncIo *aio) {
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring_size != 0) {
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);
+}
+
+static int ring_enter(AsyncIo *aio, int min_complete) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, aio->ring_fd, aio->unsubmitted, min_complete, flags, NULL, 0);
+        aio->stats.syscalls++;
+
+        if (ret >= 0) {
+            aio->unsubmitted -= ret;
+            return 0;
+        }
+
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Moves backlogged requests onto the ring while it has room; the ring never
+// holds more than ring_entries, so the completion queue cannot overflow.
+static void ring_fill(AsyncIo *aio) {
+    while (aio->backlog != NULL && aio->in_flight < (int)aio->ring_entries) {
+        IoRequest *request = aio->backlog;
+        aio->backlog = request->next;
+        if (aio->backlog == NULL) {
+            aio->backlog_tail = NULL;
+        }
+
+        unsigned tail = *aio->sq_tail;
+        unsigned index = tail & *aio->sq_mask;
+
+        struct io_uring_sqe *sqe = &aio->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request->iovcnt == 0 ? IORING_OP_NOP : request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = aio->fd;
+        sqe->off = request->offset;
+        sqe->addr = (unsigned long)request->iov;
+        sqe->len = request->iovcnt;
+        sqe->user_data = (unsigned long)request;
+
+        aio->sq_array[index] = index;
+        __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        aio->in_flight++;
+        aio->unsubmitted++;
+    }
+
+    if ((unsigned long)aio->in_flight > aio->stats.max_in_flight) {
+        aio->stats.max_in_flight = aio->in_flight;
+    }
+}
+
+static int ring_reap(AsyncIo *aio, int min_complete) {
+    int reaped = 0;
+
+    for (;;) {
+        ring_fill(aio);
+
+        unsigned head = *aio->cq_head;
+        unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (reaped >= min_complete || aio->in_flight == 0) {
+                if (aio->unsubmitted > 0) {
+                    ring_enter(aio, 0);
+                }
+                return reaped;
+            }
+
+            if (ring_enter(aio, 1) != 0) {
+                return reaped;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+        IoRequest *request = (IoRequest *)(unsigned long)cqe->user_data;
+        request->result = cqe->res;
+        __atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        finish(aio, request);
+        reaped++;
+    }
+}
+
+// The fallback: a few threads take requests in order and move them with
+// positional vectored calls, so several stay in flight on any kernel.
+
+static ssize_t transfer(AsyncIo *aio, IoRequest *request, unsigned long *calls) {
+    size_t length = 0;
+    for (int i = 0; i < request->iovcnt; ++i) {
+        length += request->iov[i].iov_len;
+    }
+
+    if (length == 0) {
+        return 0;
+    }
+
+    ssize_t done = request->write ? pwritev(aio->fd, request->iov, request->iovcnt, request->offset)
+                                  : preadv(aio->fd, request->iov, request->iovcnt, request->offset);
+    (*calls)++;
+
+    return done < 0 ? -errno : done;
+}
+
+static void *worker_main(void *arg) {
+    AsyncIo *aio = arg;
+
+    pthread_mutex_lock(&aio->lock);
+
+    for (;;) {
+        while (aio->queue == NULL && !aio->stopping) {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+
+        if (aio->queue == NULL) {
+            break;
+        }
+
+        IoRequest *request = aio->queue;
+        aio->queue = request->next;
+        if (aio->queue == NULL) {
+            aio->queue_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&aio->lock);
+
+        unsigned long calls = 0;
+        ssize_t result = transfer(aio, request, &calls);
+
+        pthread_mutex_lock(&aio->lock);
+        request->result = result;
+        aio->stats.syscalls += calls;
+        append(&aio->done, &aio->done_tail, request);
+        pthread_cond_signal(&aio->finished);
+    }
+
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int pool_start(AsyncIo *aio) {
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->finished, NULL);
+
+    for (int i = 0; i < AIO_WORKERS; ++i) {
+        if (pthread_create(&aio->workers[i], NULL, worker_main, aio) != 0) {
+            pthread_mutex_lock(&aio->lock);
+            aio->stopping = 1;
+            pthread_cond_broadcast(&aio->work);
+            pthread_mutex_unlock(&aio->lock);
+
+            for (int j = 0; j < i; ++j) {
+                pthread_join(aio->workers[j], NULL);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void pool_stop(AsyncIo *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio->stopping = 1;
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    for (int i = 0; i < AIO_WORKERS; ++i) {
+        pthread_join(aio->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&aio->finished);
+    pthread_cond_destroy(&aio->work);
+    pthread_mutex_destroy(&aio->lock);
+}
+
+static int pool_reap(AsyncIo *aio, int min_complete) {
+    int reaped = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&aio->lock);
+        while (aio->done == NULL && reaped < min_complete && aio->in_flight > 0) {
+            pthread_cond_wait(&aio->finished, &aio->lock);
+        }
+
+        IoRequest *done = aio->done;
+        aio->done = NULL;
+        aio->done_tail = NULL;
+        pthread_mutex_unlock(&aio->lock);
+
+        if (done == NULL) {
+            return reaped;
+        }
+
+        // callbacks run unlocked, and may submit more work
+        while (done != NULL) {
+            IoRequest *next = done->next;
+            finish(aio, done);
+            reaped++;
+            done = next;
+        }
+    }
+}
+
+int aio_init(AsyncIo *aio, int fd, AioEngine engine) {
+    memset(aio, 0, sizeof(*aio));
+    aio->fd = fd;
+    aio->ring_fd = -1;
+
+    if (engine == AIO_ENGINE_URING && ring_setup(aio) == 0) {
+        aio->engine = AIO_ENGINE_URING;
+        return 0;
+    }
+
+    if (pool_start(aio) != 0) {
+        return -1;
+    }
+
+    aio->engine = AIO_ENGINE_THREADS;
+    return 0;
+}
+
+void aio_destroy(AsyncIo *aio) {
+    if (aio->engine == AIO_ENGINE_NONE) {
+        return;
+    }
+
+    // nothing may be left pointing at the caller's buffers
+    while (aio->in_flight > 0 || aio->backlog != NULL) {
+        aio_reap(aio, 1);
+    }
+
+    if (aio->engine == AIO_ENGINE_URING) {
+        ring_teardown(aio);
+    } else {
+        pool_stop(aio);
+    }
+
+    aio->engine = AIO_ENGINE_NONE;
+}
+
+void aio_submit(AsyncIo *aio, IoRequest *request) {
+    request->complete = 0;
+    request->result = 0;
+    aio->stats.submitted++;
+
+    if (aio->engine == AIO_ENGINE_URING) {
+        append(&aio->backlog, &aio->backlog_tail, request);
+        ring_fill(aio);
+        return;
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    append(&aio->queue, &aio->queue_tail, request);
+    aio->in_flight++;
+    if ((unsigned long)aio->in_flight > aio->stats.max_in_flight) {
+        aio->stats.max_in_flight = aio->in_flight;
+    }
+    pthread_cond_signal(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+void aio_kick(AsyncIo *aio) {
+    if (aio->engine == AIO_ENGINE_URING && aio->unsubmitted > 0) {
+        ring_enter(aio, 0);
+    }
+}
+
+int aio_reap(AsyncIo *aio, int min_complete) {
+    if (aio->engine == AIO_ENGINE_URING) {
+        return ring_reap(aio, min_complete);
+    }
+
+    return pool_reap(aio, min_complete);
+}
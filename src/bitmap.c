@@ -0,0 +1,293 @@
+#include "bitmap.h"
+#include "disk.h"
+#include "group.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define WORDS_PER_BLOCK(fs) ((int)((fs)->sb.block_size / sizeof(uint64_t)))
+#define RUN_CANDIDATES 32 // free runs looked at before settling for the longest
+
+// index of the first word in words[from..count) with a clear bit, -1 if all are full
+static int find_open_word(const uint64_t *words, int from, int count) {
+    int i = from;
+
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi32(-1);
+    for (; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, ones)) != 0xFFFFFFFFu) {
+            break;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi32(-1);
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF) {
+            break;
+        }
+    }
+#endif
+
+    for (; i < count; ++i) {
+        if (words[i] != UINT64_MAX) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int bitmap_find_zero(FsContext *fs, int start_block, int num_bits, int from) {
+    uint64_t words[WORDS_PER_BLOCK(fs)];
+
+    while (from < num_bits) {
+        int block = from / BITS_PER_BLOCK(fs);
+        int bit = from % BITS_PER_BLOCK(fs);
+        read_block(fs, start_block + block, words);
+
+        // bits below from are not candidates
+        int word = bit / 64;
+        if (bit % 64 != 0) {
+            words[word] |= (UINT64_C(1) << (bit % 64)) - 1;
+        }
+
+        int open = find_open_word(words, word, WORDS_PER_BLOCK(fs));
+        if (open != -1) {
+            int index = block * BITS_PER_BLOCK(fs) + open * 64 + __builtin_ctzll(~words[open]);
+            return index < num_bits ? index : -1;
+        }
+
+        from = (block + 1) * BITS_PER_BLOCK(fs);
+    }
+
+    return -1;
+}
+
+void bitmap_set(FsContext *fs, int start_block, int index, int value) {
+    uint64_t words[WORDS_PER_BLOCK(fs)];
+    int block = start_block + index / BITS_PER_BLOCK(fs);
+    int bit = index % BITS_PER_BLOCK(fs);
+
+    read_block(fs, block, words);
+
+    if (value) {
+        words[bit / 64] |= UINT64_C(1) << (bit % 64);
+    } else {
+        words[bit / 64] &= ~(UINT64_C(1) << (bit % 64));
+    }
+
+    write_block(fs, block, words);
+}
+
+// clear bits from index from on, stopping at limit
+static int clear_run(FsContext *fs, int start_block, int from, int limit) {
+    uint64_t words[WORDS_PER_BLOCK(fs)];
+    int loaded = -1;
+    int index = from;
+
+    while (index < limit) {
+        int block = index / BITS_PER_BLOCK(fs);
+        int bit = index % BITS_PER_BLOCK(fs);
+
+        if (block != loaded) {
+            read_block(fs, start_block + block, words);
+            loaded = block;
+        }
+
+        if (words[bit / 64] & (UINT64_C(1) << (bit % 64))) {
+            break;
+        }
+        index++;
+    }
+
+    return index - from;
+}
+
+// sets or clears count bits from index on, each bitmap block written once
+static void set_run(FsContext *fs, int start_block, int index, int count, int value) {
+    uint64_t words[WORDS_PER_BLOCK(fs)];
+
+    while (count > 0) {
+        int block = index / BITS_PER_BLOCK(fs);
+        int bit = index % BITS_PER_BLOCK(fs);
+        int in_block = BITS_PER_BLOCK(fs) - bit < count ? BITS_PER_BLOCK(fs) - bit : count;
+
+        read_block(fs, start_block + block, words);
+
+        for (int i = bit; i < bit + in_block; ++i) {
+            if (value) {
+                words[i / 64] |= UINT64_C(1) << (i % 64);
+            } else {
+                words[i / 64] &= ~(UINT64_C(1) << (i % 64));
+            }
+        }
+
+        write_block(fs, start_block + block, words);
+
+        index += in_block;
+        count -= in_block;
+    }
+}
+
+// Takes up to count free data blocks of group at or after index from, -1 if
+// the group has none there. A free block at from is taken with whatever
+// follows it so the caller's run grows in place; otherwise the first run of
+// the full count wins, or failing that the longest of the first few. Every
+// bit below the group's free_hint is set.
+static int take_run(FsContext *fs, int group, int from, int count, int *length) {
+    GroupDesc *desc = &fs->groups[group];
+    if (desc->free_blocks == 0) {
+        return -1;
+    }
+
+    int bitmap = GROUP_BLOCK_BITMAP(fs, group);
+    int start = from > desc->free_hint ? from : desc->free_hint;
+    int first = bitmap_find_zero(fs, bitmap, desc->data_blocks, start);
+    if (first == -1) {
+        return -1;
+    }
+
+    int best = first;
+    int best_length = 0;
+
+    int index = first;
+    for (int tries = 0; tries < RUN_CANDIDATES && index != -1; ++tries) {
+        int limit = index + count < desc->data_blocks ? index + count : desc->data_blocks;
+        int run = clear_run(fs, bitmap, index, limit);
+
+        if (run > best_length) {
+            best = index;
+            best_length = run;
+        }
+        if (run == count || index == from) {
+            break;
+        }
+
+        index = bitmap_find_zero(fs, bitmap, desc->data_blocks, index + run);
+    }
+
+    set_run(fs, bitmap, best, best_length, 1);
+
+    // a scan from the hint passed nothing but used blocks up to first
+    desc->free_blocks -= best_length;
+    if (start == desc->free_hint) {
+        desc->free_hint = best == first ? best + best_length : first;
+    }
+    write_group(fs, group);
+
+    *length = best_length;
+    return GROUP_DATA_START(fs, group) + best;
+}
+
+// Returns a run of up to count blocks, and its length in *length: from goal
+// on if goal is free, otherwise the best run after it in goal's group, then
+// in the groups that follow.
+int alloc_blocks_near(FsContext *fs, int goal, int count, int *length) {
+    int group = 0;
+    int from = 0;
+
+    if (goal >= fs->sb.group_start && GROUP_OF_BLOCK(fs, goal) < fs->sb.num_groups) {
+        group = GROUP_OF_BLOCK(fs, goal);
+        from = goal - GROUP_DATA_START(fs, group);
+        if (from < 0) {
+            from = 0;
+        }
+    }
+
+    int block_number = take_run(fs, group, from, count, length);
+    if (block_number != -1) {
+        return block_number;
+    }
+
+    // goal's group comes round again last, for the blocks in front of goal
+    for (int i = 1; i <= fs->sb.num_groups; ++i) {
+        block_number = take_run(fs, (group + i) % fs->sb.num_groups, 0, count, length);
+        if (block_number != -1) {
+            return block_number;
+        }
+    }
+
+    return -1;
+}
+
+int alloc_block_near(FsContext *fs, int goal) {
+    int length;
+    return alloc_blocks_near(fs, goal, 1, &length);
+}
+
+// count blocks from block_number on, all within one group
+void free_block_run(FsContext *fs, int block_number, int count) {
+    int group = GROUP_OF_BLOCK(fs, block_number);
+    int index = block_number - GROUP_DATA_START(fs, group);
+    GroupDesc *desc = &fs->groups[group];
+
+    set_run(fs, GROUP_BLOCK_BITMAP(fs, group), index, count, 0);
+
+    desc->free_blocks += count;
+    if (index < desc->free_hint) {
+        desc->free_hint = index;
+    }
+    write_group(fs, group);
+}
+
+void free_block(FsContext *fs, int block_number) {
+    free_block_run(fs, block_number, 1);
+}
+
+// data blocks not yet taken, over all groups
+int count_free_blocks(const FsContext *fs) {
+    int free_blocks = 0;
+
+    for (int i = 0; i < fs->sb.num_groups; ++i) {
+        free_blocks += fs->groups[i].free_blocks;
+    }
+
+    return free_blocks;
+}
+
+// First free inode of group, or of the groups after it. The scan starts at
+// the group's inode hint, which moves past each inode handed out and back
+// down to any inode released below it.
+int alloc_inode(FsContext *fs, int group) {
+    for (int i = 0; i < fs->sb.num_groups; ++i) {
+        int candidate = (group + i) % fs->sb.num_groups;
+        GroupDesc *desc = &fs->groups[candidate];
+        if (desc->free_inodes == 0) {
+            continue;
+        }
+
+        int *hint = &fs->inode_hints[candidate];
+        int index = bitmap_find_zero(fs, GROUP_INODE_BITMAP(fs, candidate), fs->sb.inodes_per_group, *hint);
+        if (index == -1) {
+            continue;
+        }
+
+        bitmap_set(fs, GROUP_INODE_BITMAP(fs, candidate), index, 1);
+
+        *hint = index + 1;
+        desc->free_inodes--;
+        write_group(fs, candidate);
+
+        return candidate * fs->sb.inodes_per_group + index;
+    }
+
+    return -1;
+}
+
+void release_inode(FsContext *fs, int inode_number) {
+    int group = GROUP_OF_INODE(fs, inode_number);
+    int index = inode_number % fs->sb.inodes_per_group;
+
+    bitmap_set(fs, GROUP_INODE_BITMAP(fs, group), index, 0);
+
+    if (index < fs->inode_hints[group]) {
+        fs->inode_hints[group] = index;
+    }
+    fs->groups[group].free_inodes++;
+    write_group(fs, group);
+}
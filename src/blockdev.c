@@ -0,0 +1,444 @@
+#include "blockdev.h"
+#include "lock.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Linux UIO_MAXIOV
+#endif
+
+static int stdio_open(BlockDevice *dev, const char *path) {
+    dev->fp = fopen(path, "rb+");
+    return dev->fp == NULL ? -1 : 0;
+}
+
+static void stdio_close(BlockDevice *dev) {
+    fclose(dev->fp);
+    dev->fp = NULL;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+static void iov_zero(const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+    }
+}
+
+// stdio counts the seek and each buffered call, whatever the library does below
+static int stdio_readv(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    off_t block_offset = (off_t)block_number * dev->block_size;
+
+    fseeko(dev->fp, block_offset, SEEK_SET);
+    STAT_ADD(dev->stats.syscalls, 1);
+
+    for (int i = 0; i < iovcnt; ++i) {
+        STAT_ADD(dev->stats.syscalls, 1);
+        if (fread(iov[i].iov_base, 1, iov[i].iov_len, dev->fp) != iov[i].iov_len) {
+            iov_zero(iov, iovcnt);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int stdio_writev(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    off_t block_offset = (off_t)block_number * dev->block_size;
+
+    fseeko(dev->fp, block_offset, SEEK_SET);
+    STAT_ADD(dev->stats.syscalls, 1);
+
+    for (int i = 0; i < iovcnt; ++i) {
+        STAT_ADD(dev->stats.syscalls, 1);
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, dev->fp) != iov[i].iov_len) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int stdio_sync(BlockDevice *dev) {
+    STAT_ADD(dev->stats.syscalls, 2);
+    if (fflush(dev->fp) != 0) {
+        return -1;
+    }
+
+    return fsync(fileno(dev->fp));
+}
+
+static const BlockDeviceOps stdio_ops = {
+    stdio_open, stdio_close, stdio_readv, stdio_writev, stdio_sync
+};
+
+static int pread_open(BlockDevice *dev, const char *path) {
+    dev->fd = open(path, O_RDWR);
+    return dev->fd == -1 ? -1 : 0;
+}
+
+static void pread_close(BlockDevice *dev) {
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+// Drops the first done bytes from a copy of the vector, for the retry after
+// a short transfer.
+static int iov_advance(struct iovec *iov, int iovcnt, size_t done) {
+    int first = 0;
+
+    while (first < iovcnt && done >= iov[first].iov_len) {
+        done -= iov[first].iov_len;
+        first++;
+    }
+
+    if (first < iovcnt) {
+        iov[first].iov_base = (char *)iov[first].iov_base + done;
+        iov[first].iov_len -= done;
+    }
+
+    memmove(iov, iov + first, (iovcnt - first) * sizeof(struct iovec));
+    return iovcnt - first;
+}
+
+// One preadv per IOV_MAX buffers, more only if the kernel stops short.
+static int pread_readv(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    off_t offset = (off_t)block_number * dev->block_size;
+
+    while (iovcnt > 0) {
+        int batch = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        struct iovec pending[batch];
+        memcpy(pending, iov, batch * sizeof(struct iovec));
+
+        size_t length = iov_length(pending, batch);
+        int left = batch;
+
+        while (length > 0) {
+            ssize_t done = preadv(dev->fd, pending, left, offset);
+            STAT_ADD(dev->stats.syscalls, 1);
+            if (done <= 0) {
+                iov_zero(iov, iovcnt);
+                return -1;
+            }
+
+            offset += done;
+            length -= done;
+            left = iov_advance(pending, left, done);
+        }
+
+        iov += batch;
+        iovcnt -= batch;
+    }
+
+    return 0;
+}
+
+static int pread_writev(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    off_t offset = (off_t)block_number * dev->block_size;
+
+    while (iovcnt > 0) {
+        int batch = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        struct iovec pending[batch];
+        memcpy(pending, iov, batch * sizeof(struct iovec));
+
+        size_t length = iov_length(pending, batch);
+        int left = batch;
+
+        while (length > 0) {
+            ssize_t done = pwritev(dev->fd, pending, left, offset);
+            STAT_ADD(dev->stats.syscalls, 1);
+            if (done <= 0) {
+                return -1;
+            }
+
+            offset += done;
+            length -= done;
+            left = iov_advance(pending, left, done);
+        }
+
+        iov += batch;
+        iovcnt -= batch;
+    }
+
+    return 0;
+}
+
+static int pread_sync(BlockDevice *dev) {
+    STAT_ADD(dev->stats.syscalls, 1);
+    return fsync(dev->fd);
+}
+
+static const BlockDeviceOps pread_ops = {
+    pread_open, pread_close, pread_readv, pread_writev, pread_sync
+};
+
+static int uring_open(BlockDevice *dev, const char *path) {
+    if (pread_open(dev, path) != 0) {
+        return -1;
+    }
+
+    if (aio_init(&dev->aio, dev->fd, AIO_ENGINE_URING) != 0) {
+        pread_close(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Each call goes on the ring and waits for its completion; anything else in
+// flight is reaped along the way.
+static int uring_transfer(BlockDevice *dev, int write, int block_number, const struct iovec *iov, int iovcnt) {
+    off_t offset = (off_t)block_number * dev->block_size;
+
+    while (iovcnt > 0) {
+        int batch = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        IoRequest request;
+        memset(&request, 0, sizeof(request));
+        request.write = write;
+        request.offset = offset;
+        request.iov = iov;
+        request.iovcnt = batch;
+
+        aio_submit(&dev->aio, &request);
+        while (!request.complete) {
+            aio_reap(&dev->aio, 1);
+        }
+
+        size_t length = iov_length(iov, batch);
+        if (request.result != (ssize_t)length) {
+            return -1;
+        }
+
+        offset += length;
+        iov += batch;
+        iovcnt -= batch;
+    }
+
+    return 0;
+}
+
+static int uring_readv(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    if (uring_transfer(dev, 0, block_number, iov, iovcnt) != 0) {
+        iov_zero(iov, iovcnt);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int uring_writev(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    return uring_transfer(dev, 1, block_number, iov, iovcnt);
+}
+
+// the ring's io_uring_enter calls are counted in the AsyncIo stats
+static const BlockDeviceOps uring_ops = {
+    uring_open, pread_close, uring_readv, uring_writev, pread_sync
+};
+
+static int mmap_open(BlockDevice *dev, const char *path) {
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0 || st.st_size == 0) {
+        close(dev->fd);
+        return -1;
+    }
+
+    dev->map_size = st.st_size;
+    dev->map = mmap(NULL, dev->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->map == MAP_FAILED) {
+        dev->map = NULL;
+        close(dev->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mmap_close(BlockDevice *dev) {
+    munmap(dev->map, dev->map_size);
+    close(dev->fd);
+    dev->map = NULL;
+    dev->fd = -1;
+}
+
+// copies make no system calls; only msync is counted
+static int mmap_readv(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    size_t block_offset = (size_t)block_number * dev->block_size;
+
+    if (block_offset + iov_length(iov, iovcnt) > dev->map_size) {
+        iov_zero(iov, iovcnt);
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(iov[i].iov_base, dev->map + block_offset, iov[i].iov_len);
+        block_offset += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+static int mmap_writev(BlockDevice *dev, int block_number, const struct iovec *iov, int iovcnt) {
+    size_t block_offset = (size_t)block_number * dev->block_size;
+
+    if (block_offset + iov_length(iov, iovcnt) > dev->map_size) {
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(dev->map + block_offset, iov[i].iov_base, iov[i].iov_len);
+        block_offset += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+static int mmap_sync(BlockDevice *dev) {
+    STAT_ADD(dev->stats.syscalls, 1);
+    return msync(dev->map, dev->map_size, MS_SYNC);
+}
+
+static const BlockDeviceOps mmap_ops = {
+    mmap_open, mmap_close, mmap_readv, mmap_writev, mmap_sync
+};
+
+int blockdev_open(BlockDevice *dev, const char *path, Backend backend, AioEngine engine, int block_size) {
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = -1;
+    dev->backend = backend;
+    dev->engine = engine;
+    dev->block_size = block_size;
+
+    switch (backend) {
+    case BACKEND_MMAP:
+        dev->ops = &mmap_ops;
+        break;
+
+    case BACKEND_PREAD:
+        dev->ops = &pread_ops;
+        break;
+
+    case BACKEND_URING:
+        dev->ops = &uring_ops;
+        break;
+
+    default:
+        dev->ops = &stdio_ops;
+        break;
+    }
+
+    if (dev->ops->open(dev, path) != 0) {
+        dev->ops = NULL;
+        return -1;
+    }
+
+    // without a ring the synchronous calls are plain pread, the pool stays for the async path
+    if (backend == BACKEND_URING && dev->aio.engine != AIO_ENGINE_URING) {
+        dev->ops = &pread_ops;
+        dev->backend = BACKEND_PREAD;
+    }
+
+    return 0;
+}
+
+void blockdev_close(BlockDevice *dev) {
+    if (dev->ops == NULL) {
+        return;
+    }
+
+    aio_destroy(&dev->aio);
+    dev->ops->close(dev);
+    dev->ops = NULL;
+}
+
+int blockdev_read(void *device, int block_number, void *block) {
+    BlockDevice *dev = device;
+    return blockdev_read_run(dev, block_number, 1, block);
+}
+
+int blockdev_write(void *device, int block_number, const void *block) {
+    BlockDevice *dev = device;
+    return blockdev_write_run(dev, block_number, 1, block);
+}
+
+int blockdev_read_run(void *device, int block_number, int count, void *blocks) {
+    BlockDevice *dev = device;
+    struct iovec iov = { blocks, (size_t)count * dev->block_size };
+
+    return blockdev_readv(dev, block_number, &iov, 1);
+}
+
+int blockdev_write_run(void *device, int block_number, int count, const void *blocks) {
+    BlockDevice *dev = device;
+    struct iovec iov = { (void *)blocks, (size_t)count * dev->block_size };
+
+    return blockdev_writev(dev, block_number, &iov, 1);
+}
+
+int blockdev_readv(void *device, int block_number, const struct iovec *iov, int iovcnt) {
+    BlockDevice *dev = device;
+    STAT_ADD(dev->stats.reads, 1);
+    return dev->ops->readv(dev, block_number, iov, iovcnt);
+}
+
+int blockdev_writev(void *device, int block_number, const struct iovec *iov, int iovcnt) {
+    BlockDevice *dev = device;
+    STAT_ADD(dev->stats.writes, 1);
+    return dev->ops->writev(dev, block_number, iov, iovcnt);
+}
+
+int blockdev_sync(BlockDevice *dev) {
+    return dev->ops->sync(dev);
+}
+
+int blockdev_submit(BlockDevice *dev, int block_number, IoRequest *request) {
+    if (dev->aio.engine == AIO_ENGINE_NONE) {
+        int fd = dev->fp != NULL ? fileno(dev->fp) : dev->fd;
+        if (aio_init(&dev->aio, fd, dev->engine) != 0) {
+            return -1;
+        }
+    }
+
+    // the engine reads the file itself, past any stdio buffer
+    if (dev->fp != NULL) {
+        fflush(dev->fp);
+    }
+
+    request->offset = (off_t)block_number * dev->block_size;
+    STAT_ADD(dev->stats.reads, !request->write);
+    STAT_ADD(dev->stats.writes, request->write);
+
+    aio_submit(&dev->aio, request);
+    return 0;
+}
+
+void blockdev_kick(BlockDevice *dev) {
+    if (dev->aio.engine != AIO_ENGINE_NONE) {
+        aio_kick(&dev->aio);
+    }
+}
+
+int blockdev_reap(BlockDevice *dev, int min_complete) {
+    if (dev->aio.engine == AIO_ENGINE_NONE) {
+        return 0;
+    }
+
+    return aio_reap(&dev->aio, min_complete);
+}
@@ -0,0 +1,413 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int bucket_of(const BlockCache *cache, int block_number) {
+    return (unsigned int)block_number % cache->num_frames;
+}
+
+static void unlink_frame(BlockCache *cache, int index) {
+    CacheFrame *frame = &cache->frames[index];
+    int *link = &cache->buckets[bucket_of(cache, frame->block_number)];
+
+    while (*link != index) {
+        link = &cache->frames[*link].next;
+    }
+
+    *link = frame->next;
+    frame->next = -1;
+    frame->block_number = -1;
+}
+
+static int find_frame(BlockCache *cache, int block_number) {
+    int index = cache->buckets[bucket_of(cache, block_number)];
+
+    while (index != -1 && cache->frames[index].block_number != block_number) {
+        index = cache->frames[index].next;
+    }
+
+    return index;
+}
+
+static int device_read(BlockCache *cache, int block_number, int count, void *blocks) {
+    struct iovec iov = { blocks, (size_t)count * cache->block_size };
+    return cache->read(cache->device, block_number, &iov, 1);
+}
+
+static int device_write(BlockCache *cache, int block_number, int count, const void *blocks) {
+    struct iovec iov = { (void *)blocks, (size_t)count * cache->block_size };
+    return cache->write(cache->device, block_number, &iov, 1);
+}
+
+static void write_back(BlockCache *cache, CacheFrame *frame) {
+    device_write(cache, frame->block_number, 1, frame->data);
+    cache->stats.writebacks++;
+    frame->dirty = 0;
+}
+
+// CLOCK: sweep the hand, clearing reference bits, until an unreferenced frame comes up
+static int evict_frame(BlockCache *cache) {
+    for (;;) {
+        int index = cache->hand;
+        CacheFrame *frame = &cache->frames[index];
+        cache->hand = (cache->hand + 1) % cache->num_frames;
+
+        if (frame->block_number == -1) {
+            return index;
+        }
+
+        if (frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+
+        if (frame->dirty) {
+            write_back(cache, frame);
+        }
+
+        unlink_frame(cache, index);
+        cache->stats.evictions++;
+        return index;
+    }
+}
+
+static CacheFrame *install_frame(BlockCache *cache, int block_number) {
+    int index = evict_frame(cache);
+    CacheFrame *frame = &cache->frames[index];
+
+    int bucket = bucket_of(cache, block_number);
+    frame->block_number = block_number;
+    frame->dirty = 0;
+    frame->referenced = 1;
+    frame->next = cache->buckets[bucket];
+    cache->buckets[bucket] = index;
+
+    return frame;
+}
+
+int cache_init(BlockCache *cache, int num_frames, int block_size, void *device, BlockReadFn read, BlockWriteFn write,
+               int thread_safe) {
+    memset(cache, 0, sizeof(*cache));
+    cache->block_size = block_size;
+    cache->device = device;
+    cache->read = read;
+    cache->write = write;
+    rwlock_init(&cache->lock, thread_safe);
+
+    if (num_frames == 0) {
+        return 0;
+    }
+
+    cache->frames = calloc(num_frames, sizeof(CacheFrame));
+    cache->buckets = malloc(num_frames * sizeof(int));
+    cache->order = malloc(num_frames * sizeof(CacheFrame *));
+    char *data = malloc((size_t)num_frames * block_size);
+
+    if (cache->frames == NULL || cache->buckets == NULL || cache->order == NULL || data == NULL) {
+        free(cache->frames);
+        free(cache->buckets);
+        free(cache->order);
+        free(data);
+        rwlock_destroy(&cache->lock);
+        return -1;
+    }
+
+    cache->num_frames = num_frames;
+
+    for (int i = 0; i < num_frames; ++i) {
+        cache->frames[i].block_number = -1;
+        cache->frames[i].next = -1;
+        cache->frames[i].data = data + (size_t)i * block_size;
+        cache->buckets[i] = -1;
+    }
+
+    return 0;
+}
+
+void cache_destroy(BlockCache *cache) {
+    if (cache->frames != NULL) {
+        cache_flush(cache);
+
+        free(cache->frames[0].data);
+        free(cache->frames);
+        free(cache->buckets);
+        free(cache->order);
+        cache->frames = NULL;
+        cache->buckets = NULL;
+        cache->order = NULL;
+    }
+
+    rwlock_destroy(&cache->lock);
+}
+
+// A hit only reads the frame, so lookups share the lock; the reference bit
+// is the one thing they set, and any of them may set it.
+static int lookup_frame(BlockCache *cache, int block_number, void *block) {
+    int index = find_frame(cache, block_number);
+    if (index == -1) {
+        return 0;
+    }
+
+    CacheFrame *frame = &cache->frames[index];
+    __atomic_store_n(&frame->referenced, 1, __ATOMIC_RELAXED);
+    memcpy(block, frame->data, cache->block_size);
+    STAT_ADD(cache->stats.hits, 1);
+    return 1;
+}
+
+int cache_lookup(BlockCache *cache, int block_number, void *block) {
+    if (cache->num_frames == 0) {
+        return 0;
+    }
+
+    rwlock_read(&cache->lock);
+    int hit = lookup_frame(cache, block_number, block);
+    rwlock_unlock(&cache->lock);
+
+    return hit;
+}
+
+void cache_read(BlockCache *cache, int block_number, void *block) {
+    if (cache->num_frames == 0) {
+        rwlock_read(&cache->lock);
+        device_read(cache, block_number, 1, block);
+        rwlock_unlock(&cache->lock);
+        STAT_ADD(cache->stats.misses, 1);
+        return;
+    }
+
+    if (cache_lookup(cache, block_number, block)) {
+        return;
+    }
+
+    // another thread may have brought the block in meanwhile
+    rwlock_write(&cache->lock);
+
+    if (!lookup_frame(cache, block_number, block)) {
+        CacheFrame *frame = install_frame(cache, block_number);
+        device_read(cache, block_number, 1, frame->data);
+        cache->stats.misses++;
+        memcpy(block, frame->data, cache->block_size);
+    }
+
+    rwlock_unlock(&cache->lock);
+}
+
+void cache_write(BlockCache *cache, int block_number, const void *block) {
+    rwlock_write(&cache->lock);
+
+    if (cache->num_frames == 0) {
+        device_write(cache, block_number, 1, block);
+        cache->stats.misses++;
+        rwlock_unlock(&cache->lock);
+        return;
+    }
+
+    int index = find_frame(cache, block_number);
+    CacheFrame *frame;
+
+    if (index != -1) {
+        frame = &cache->frames[index];
+        frame->referenced = 1;
+        cache->stats.hits++;
+    } else {
+        // whole block overwrite, nothing to fetch from the disk
+        frame = install_frame(cache, block_number);
+        cache->stats.misses++;
+    }
+
+    memcpy(frame->data, block, cache->block_size);
+    frame->dirty = 1;
+
+    rwlock_unlock(&cache->lock);
+}
+
+void cache_read_run(BlockCache *cache, int block_number, int count, void *blocks) {
+    char *out = blocks;
+    int pending = 0; // uncached blocks waiting to be read in one call
+
+    rwlock_read(&cache->lock);
+
+    for (int i = 0; i <= count; ++i) {
+        int index = i < count && cache->num_frames > 0 ? find_frame(cache, block_number + i) : -1;
+
+        if (i < count && index == -1) {
+            pending++;
+            continue;
+        }
+
+        if (pending > 0) {
+            int first = i - pending;
+            device_read(cache, block_number + first, pending, out + (size_t)first * cache->block_size);
+            STAT_ADD(cache->stats.misses, pending);
+            STAT_ADD(cache->stats.run_ios, 1);
+            pending = 0;
+        }
+
+        if (i < count) {
+            CacheFrame *frame = &cache->frames[index];
+            __atomic_store_n(&frame->referenced, 1, __ATOMIC_RELAXED);
+            memcpy(out + (size_t)i * cache->block_size, frame->data, cache->block_size);
+            STAT_ADD(cache->stats.hits, 1);
+        }
+    }
+
+    rwlock_unlock(&cache->lock);
+}
+
+void cache_write_run(BlockCache *cache, int block_number, int count, const void *blocks) {
+    const char *in = blocks;
+
+    rwlock_write(&cache->lock);
+
+    // the whole run goes to the device, so cached copies are refreshed and clean
+    for (int i = 0; i < count && cache->num_frames > 0; ++i) {
+        int index = find_frame(cache, block_number + i);
+        if (index != -1) {
+            CacheFrame *frame = &cache->frames[index];
+            memcpy(frame->data, in + (size_t)i * cache->block_size, cache->block_size);
+            frame->dirty = 0;
+            cache->stats.hits++;
+        }
+    }
+
+    device_write(cache, block_number, count, blocks);
+    cache->stats.run_ios++;
+
+    rwlock_unlock(&cache->lock);
+}
+
+static void overlay_frames(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+        char *out = iov[i].iov_base;
+
+        for (size_t offset = 0; offset < iov[i].iov_len; offset += cache->block_size) {
+            int index = cache->num_frames > 0 ? find_frame(cache, block_number) : -1;
+
+            if (index == -1) {
+                STAT_ADD(cache->stats.misses, 1);
+            } else {
+                CacheFrame *frame = &cache->frames[index];
+                __atomic_store_n(&frame->referenced, 1, __ATOMIC_RELAXED);
+                memcpy(out + offset, frame->data, cache->block_size);
+                STAT_ADD(cache->stats.hits, 1);
+            }
+
+            block_number++;
+        }
+    }
+}
+
+// One device call for the whole vector; cached frames, which may be newer
+// than the disk, are copied over what it returned. The lock is held across
+// both, so that no frame is written back and dropped in between.
+void cache_read_vec(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt) {
+    rwlock_read(&cache->lock);
+
+    cache->read(cache->device, block_number, iov, iovcnt);
+    STAT_ADD(cache->stats.run_ios, 1);
+    overlay_frames(cache, block_number, iov, iovcnt);
+
+    rwlock_unlock(&cache->lock);
+}
+
+void cache_overlay(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt) {
+    rwlock_read(&cache->lock);
+    overlay_frames(cache, block_number, iov, iovcnt);
+    rwlock_unlock(&cache->lock);
+}
+
+void cache_write_vec(BlockCache *cache, int block_number, const struct iovec *iov, int iovcnt) {
+    int next = block_number;
+
+    rwlock_write(&cache->lock);
+
+    // as for cache_write_run, cached copies are refreshed and clean
+    for (int i = 0; i < iovcnt && cache->num_frames > 0; ++i) {
+        const char *in = iov[i].iov_base;
+
+        for (size_t offset = 0; offset < iov[i].iov_len; offset += cache->block_size) {
+            int index = find_frame(cache, next++);
+            if (index != -1) {
+                CacheFrame *frame = &cache->frames[index];
+                memcpy(frame->data, in + offset, cache->block_size);
+                frame->dirty = 0;
+                cache->stats.hits++;
+            }
+        }
+    }
+
+    cache->write(cache->device, block_number, iov, iovcnt);
+    cache->stats.run_ios++;
+
+    rwlock_unlock(&cache->lock);
+}
+
+static int compare_frames(const void *a, const void *b) {
+    int x = (*(CacheFrame *const *)a)->block_number;
+    int y = (*(CacheFrame *const *)b)->block_number;
+
+    return (x > y) - (x < y);
+}
+
+// Dirty frames go out in block order, and frames holding neighbouring blocks
+// share one device call.
+void cache_flush(BlockCache *cache) {
+    if (cache->num_frames == 0) {
+        return;
+    }
+
+    rwlock_write(&cache->lock);
+    int dirty = 0;
+
+    for (int i = 0; i < cache->num_frames; ++i) {
+        CacheFrame *frame = &cache->frames[i];
+        if (frame->block_number != -1 && frame->dirty) {
+            cache->order[dirty++] = frame;
+        }
+    }
+
+    qsort(cache->order, dirty, sizeof(CacheFrame *), compare_frames);
+
+    struct iovec iov[CACHE_FLUSH_IOVS];
+    int first = 0;
+    int iovcnt = 0;
+
+    for (int i = 0; i <= dirty; ++i) {
+        CacheFrame *frame = i < dirty ? cache->order[i] : NULL;
+
+        if (iovcnt > 0 && (frame == NULL || iovcnt == CACHE_FLUSH_IOVS || frame->block_number != first + iovcnt)) {
+            cache->write(cache->device, first, iov, iovcnt);
+            cache->stats.writebacks += iovcnt;
+            iovcnt = 0;
+        }
+
+        if (frame != NULL) {
+            if (iovcnt == 0) {
+                first = frame->block_number;
+            }
+
+            iov[iovcnt].iov_base = frame->data;
+            iov[iovcnt].iov_len = cache->block_size;
+            iovcnt++;
+            frame->dirty = 0;
+        }
+    }
+
+    rwlock_unlock(&cache->lock);
+}
+
+void cache_invalidate(BlockCache *cache) {
+    rwlock_write(&cache->lock);
+
+    for (int i = 0; i < cache->num_frames; ++i) {
+        CacheFrame *frame = &cache->frames[i];
+        frame->block_number = -1;
+        frame->dirty = 0;
+        frame->referenced = 0;
+        frame->next = -1;
+        cache->buckets[i] = -1;
+    }
+
+    rwlock_unlock(&cache->lock);
+}
@@ -0,0 +1,309 @@
+#include "client.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define RECEIVE_CHUNK (64 * 1024)
+#define SEND_BATCH (64 * 1024) // queued bytes that go out without a flush
+
+static int reserve(ClientBuffer *buf, size_t extra) {
+    if (buf->length + extra <= buf->capacity) {
+        return 0;
+    }
+
+    size_t capacity = buf->capacity > 0 ? buf->capacity : RECEIVE_CHUNK;
+    while (capacity < buf->length + extra) {
+        capacity *= 2;
+    }
+
+    char *grown = realloc(buf->data, capacity);
+    if (grown == NULL) {
+        return -1;
+    }
+
+    buf->data = grown;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static int lost(FsClient *client) {
+    client->error = ERR_CONNECTION;
+    return -1;
+}
+
+int client_connect(FsClient *client, const char *socket_path) {
+    memset(client, 0, sizeof(*client));
+    client->next_id = 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        client->fd = -1;
+        return lost(client);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        return lost(client);
+    }
+
+    if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(client->fd);
+        client->fd = -1;
+        return lost(client);
+    }
+
+    return 0;
+}
+
+void client_close(FsClient *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    free(client->out.data);
+    free(client->in.data);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+int client_flush(FsClient *client) {
+    size_t sent = 0;
+    while (sent < client->out.length) {
+        ssize_t bytes = send(client->fd, client->out.data + sent, client->out.length - sent, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            client->out.length = 0;
+            return lost(client);
+        }
+        sent += bytes;
+    }
+
+    client->out.length = 0;
+    return 0;
+}
+
+uint32_t client_send(FsClient *client, WireOp op, const char *path, const char *data, size_t length,
+                     uint32_t count, long long offset) {
+    size_t path_length = strlen(path);
+    size_t frame = sizeof(WireRequest) + path_length + length;
+    if (path_length > 0xffff || frame > WIRE_MAX_FRAME) {
+        client->error = ERR_INVALID;
+        return 0;
+    }
+
+    if (client->out.length + frame > SEND_BATCH && client_flush(client) != 0) {
+        return 0;
+    }
+
+    if (reserve(&client->out, frame) != 0) {
+        client->error = ERR_NO_SPACE;
+        return 0;
+    }
+
+    WireRequest request;
+    memset(&request, 0, sizeof(request));
+    request.length = frame - sizeof(request.length);
+    request.id = client->next_id++;
+    request.op = op;
+    request.path_length = path_length;
+    request.count = count;
+    request.offset = offset;
+    if (client->next_id == 0) {
+        client->next_id = 1;
+    }
+
+    char *at = client->out.data + client->out.length;
+    memcpy(at, &request, sizeof(request));
+    memcpy(at + sizeof(request), path, path_length);
+    if (length > 0) {
+        memcpy(at + sizeof(request) + path_length, data, length);
+    }
+    client->out.length += frame;
+    return request.id;
+}
+
+// Bytes of the reply at start, once it is all here; 0 before that.
+static size_t buffered_reply(const FsClient *client) {
+    size_t available = client->in.length - client->start;
+    if (available < sizeof(WireReply)) {
+        return 0;
+    }
+
+    uint32_t length;
+    memcpy(&length, client->in.data + client->start, sizeof(length));
+    size_t total = sizeof(length) + (size_t)length;
+    return available >= total ? total : 0;
+}
+
+int client_buffered(const FsClient *client) {
+    return buffered_reply(client) > 0;
+}
+
+int client_receive(FsClient *client, FsReply *reply) {
+    // requests still queued would leave the reply waiting forever
+    if (client->out.length > 0 && client_flush(client) != 0) {
+        return -1;
+    }
+
+    size_t total;
+    while ((total = buffered_reply(client)) == 0) {
+        if (client->start > 0) {
+            memmove(client->in.data, client->in.data + client->start, client->in.length - client->start);
+            client->in.length -= client->start;
+            client->start = 0;
+        }
+
+        if (reserve(&client->in, RECEIVE_CHUNK) != 0) {
+            client->error = ERR_NO_SPACE;
+            return -1;
+        }
+
+        ssize_t bytes = read(client->fd, client->in.data + client->in.length, client->in.capacity - client->in.length);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return lost(client);
+        }
+        client->in.length += bytes;
+    }
+
+    WireReply header;
+    memcpy(&header, client->in.data + client->start, sizeof(header));
+    if (header.length < sizeof(header) - sizeof(header.length)) {
+        return lost(client);
+    }
+
+    reply->id = header.id;
+    reply->status = header.status;
+    reply->data = client->in.data + client->start + sizeof(header);
+    reply->length = total - sizeof(header);
+
+    client->start += total;
+    return 0;
+}
+
+// Sends one request and waits for its reply.
+static int call(FsClient *client, WireOp op, const char *path, const char *data, size_t length, uint32_t count,
+                long long offset, FsReply *reply) {
+    uint32_t id = client_send(client, op, path, data, length, count, offset);
+    if (id == 0 || client_flush(client) != 0) {
+        return -1;
+    }
+
+    // replies to requests sent earlier with client_send are dropped
+    do {
+        if (client_receive(client, reply) != 0) {
+            return -1;
+        }
+    } while (reply->id != id);
+
+    if (reply->status < 0) {
+        client->error = -reply->status;
+        return -1;
+    }
+
+    return reply->status;
+}
+
+int client_mkdir(FsClient *client, const char *path) {
+    FsReply reply;
+    return call(client, WIRE_MKDIR, path, NULL, 0, 0, 0, &reply);
+}
+
+int client_create(FsClient *client, const char *path) {
+    FsReply reply;
+    return call(client, WIRE_CREATE, path, NULL, 0, 0, 0, &reply);
+}
+
+int client_write(FsClient *client, const char *path, const char *data) {
+    FsReply reply;
+    return call(client, WIRE_WRITE, path, data, strlen(data), 0, 0, &reply);
+}
+
+int client_read(FsClient *client, const char *path, char *buf, int bufsize) {
+    FsReply reply;
+    int ret = call(client, WIRE_READ, path, NULL, 0, bufsize < 0 ? 0 : bufsize, 0, &reply);
+    if (ret < 0) {
+        return -1;
+    }
+
+    memcpy(buf, reply.data, ret);
+    buf[ret] = '\0';
+    return ret;
+}
+
+int client_delete(FsClient *client, const char *path) {
+    FsReply reply;
+    return call(client, WIRE_DELETE, path, NULL, 0, 0, 0, &reply);
+}
+
+int client_rmdir(FsClient *client, const char *path) {
+    FsReply reply;
+    return call(client, WIRE_RMDIR, path, NULL, 0, 0, 0, &reply);
+}
+
+int client_ls(FsClient *client, const char *path, DirectoryEntry *entries, int max_entries) {
+    FsReply reply;
+    int ret = call(client, WIRE_LS, path, NULL, 0, max_entries < 0 ? 0 : max_entries, 0, &reply);
+    if (ret < 0) {
+        return -1;
+    }
+
+    const char *at = reply.data;
+    for (int i = 0; i < ret; ++i) {
+        WireEntry entry;
+        memcpy(&entry, at, sizeof(entry));
+        at += sizeof(entry);
+
+        int name_length = entry.name_length < MAX_NAME_SIZE ? entry.name_length : MAX_NAME_SIZE - 1;
+        memset(&entries[i], 0, sizeof(entries[i]));
+        entries[i].inode_number = entry.inode_number;
+        entries[i].type = entry.type;
+        memcpy(entries[i].name, at, name_length);
+        at += entry.name_length;
+    }
+
+    return ret;
+}
+
+int client_preallocate(FsClient *client, const char *path, long long size) {
+    FsReply reply;
+    return call(client, WIRE_PREALLOCATE, path, NULL, 0, 0, size, &reply);
+}
+
+int client_pread(FsClient *client, const char *path, char *buf, int length, long long offset) {
+    if (length < 0) {
+        client->error = ERR_INVALID;
+        return -1;
+    }
+
+    FsReply reply;
+    int ret = call(client, WIRE_PREAD, path, NULL, 0, length, offset, &reply);
+    if (ret > 0) {
+        memcpy(buf, reply.data, ret);
+    }
+    return ret;
+}
+
+int client_pwrite(FsClient *client, const char *path, const char *data, int length, long long offset) {
+    if (length < 0) {
+        client->error = ERR_INVALID;
+        return -1;
+    }
+
+    FsReply reply;
+    return call(client, WIRE_PWRITE, path, data, length, 0, offset, &reply);
+}
+
+int client_sync(FsClient *client) {
+    FsReply reply;
+    return call(client, WIRE_SYNC, "/", NULL, 0, 0, 0, &reply);
+}
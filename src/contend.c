@@ -0,0 +1,208 @@
+#include "contend.h"
+#include "fs.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CONTEND_MAX_READERS 64
+#define CONTEND_DIR "/contend/"
+#define CHURN_FILES 8 // names the writer cycles through
+
+typedef struct Run {
+    FsContext fs;
+    const ContendOptions *options;
+    int stop;
+    unsigned long listings;
+    unsigned long changes;
+    unsigned long bad;
+} Run;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// A listing is right if it holds every file that stays and at most one of
+// the writer's, which it deletes before creating the next.
+static void *list_loop(void *arg) {
+    Run *run = arg;
+    int max_entries = run->options->files + CHURN_FILES;
+    DirectoryEntry *entries = malloc(max_entries * sizeof(DirectoryEntry));
+    unsigned long listings = 0;
+    unsigned long bad = 0;
+
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+        int count = fs_ls(&run->fs, CONTEND_DIR, entries, max_entries);
+
+        int kept = 0;
+        int churned = 0;
+        for (int i = 0; i < count; ++i) {
+            if (entries[i].name[0] == 'k') {
+                kept++;
+            } else {
+                churned++;
+            }
+        }
+
+        if (kept != run->options->files || churned > 1) {
+            bad++;
+        }
+        listings++;
+    }
+
+    __atomic_fetch_add(&run->listings, listings, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&run->bad, bad, __ATOMIC_RELAXED);
+    free(entries);
+    return NULL;
+}
+
+static void *churn_loop(void *arg) {
+    Run *run = arg;
+    unsigned long changes = 0;
+
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+        char path[MAX_PATH_SIZE];
+        snprintf(path, sizeof(path), CONTEND_DIR "c%lu", (changes / 2) % CHURN_FILES);
+
+        int ret = changes % 2 == 0 ? fs_create(&run->fs, path) : fs_delete(&run->fs, path);
+        if (ret != 0) {
+            __atomic_fetch_add(&run->bad, 1, __ATOMIC_RELAXED);
+        }
+        changes++;
+    }
+
+    // the last file created goes too
+    if (changes % 2 == 1) {
+        char path[MAX_PATH_SIZE];
+        snprintf(path, sizeof(path), CONTEND_DIR "c%lu", (changes / 2) % CHURN_FILES);
+        fs_delete(&run->fs, path);
+    }
+
+    run->changes = changes;
+    return NULL;
+}
+
+static int run_once(const char *diskfile, const ContendOptions *options, int readers, int kept) {
+    Run *run = calloc(1, sizeof(Run));
+    run->options = options;
+
+    MountOptions mount;
+    fs_default_options(&mount);
+    mount.thread_safe = 1;
+    mount.commit_ops = 64;
+    mount.commit_ms = 5;
+    mount.listing_dirs = kept ? LISTING_DIRS : 0;
+
+    ErrorCode code = fs_mount_with(diskfile, &mount, &run->fs);
+    if (code != ERR_NONE) {
+        print_error("contend", diskfile, code);
+        free(run);
+        return -1;
+    }
+
+    pthread_t threads[CONTEND_MAX_READERS + 1];
+    long long start = now_ns();
+
+    for (int i = 0; i < readers; ++i) {
+        pthread_create(&threads[i], NULL, list_loop, run);
+    }
+    pthread_create(&threads[readers], NULL, churn_loop, run);
+
+    struct timespec pause = { options->seconds, 0 };
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i <= readers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    ListingStats listing;
+    fs_listing_stats(&run->fs, &listing);
+    fs_unmount(&run->fs);
+
+    printf("%7d  %-9s %12.0f %12.0f %10.0f %9lu\n", readers, kept ? "lock-free" : "locked", run->listings / elapsed,
+           run->listings / elapsed / readers, run->changes / elapsed, listing.retries);
+
+    int ret = run->bad > 0 ? -1 : 0;
+    if (ret != 0) {
+        fprintf(stderr, "Error: contend %s: %lu listings or changes came out wrong\n", diskfile, run->bad);
+    }
+
+    free(run);
+    return ret;
+}
+
+void contend_default_options(ContendOptions *options) {
+    options->readers = 8;
+    options->seconds = 1;
+    options->files = 32;
+}
+
+// the directory the runs share, and a mount that only makes and removes it
+static int prepare(const char *diskfile, const ContendOptions *options, int remove) {
+    FsContext fs;
+    ErrorCode code = fs_mount(diskfile, &fs);
+    if (code != ERR_NONE) {
+        print_error("contend", diskfile, code);
+        return -1;
+    }
+
+    int ret = 0;
+    if (!remove && fs_mkdir(&fs, CONTEND_DIR) != 0) {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < options->files; ++i) {
+        char path[MAX_PATH_SIZE];
+        snprintf(path, sizeof(path), CONTEND_DIR "k%d", i);
+        if ((remove ? fs_delete(&fs, path) : fs_create(&fs, path)) != 0) {
+            ret = -1;
+        }
+    }
+
+    if (remove && ret == 0) {
+        ret = fs_rmdir(&fs, CONTEND_DIR);
+    }
+
+    fs_unmount(&fs);
+    return ret;
+}
+
+int contend(const char *diskfile, const ContendOptions *options) {
+    if (options->readers < 1 || options->readers > CONTEND_MAX_READERS || options->seconds < 1 ||
+        options->files < 1 || options->files > LISTING_ENTRIES - 1) {
+        fprintf(stderr, "Error: contend: bad options\n");
+        return -1;
+    }
+
+    if (prepare(diskfile, options, 0) != 0) {
+        return -1;
+    }
+
+    printf("listing %s (%d files) while one writer creates and deletes files in it\n", CONTEND_DIR, options->files);
+    printf("readers  mode        listings/s   per reader  changes/s   retries\n");
+
+    int ret = 0;
+    for (int readers = 1; ret == 0; readers *= 2) {
+        if (readers > options->readers) {
+            readers = options->readers;
+        }
+
+        if (run_once(diskfile, options, readers, 0) != 0 || run_once(diskfile, options, readers, 1) != 0) {
+            ret = -1;
+        }
+
+        if (readers == options->readers) {
+            break;
+        }
+    }
+
+    if (prepare(diskfile, options, 1) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
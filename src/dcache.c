@@ -0,0 +1,238 @@
+#include "dcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int bucket_of(const DentryCache *dcache, int parent, const char *name) {
+    unsigned int hash = 2166136261u ^ (unsigned int)parent;
+    hash *= 16777619u;
+
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; ++c) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+
+    return hash % dcache->num_entries;
+}
+
+static int name_matches(const Dentry *entry, const char *name) {
+    for (int i = 0; i < DCACHE_NAME_SIZE; ++i) {
+        char c = SEQ_LOAD(entry->name[i]);
+        if (c != name[i]) {
+            return 0;
+        }
+        if (c == '\0') {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Safe without the lock: a chain a writer is relinking can at worst lead
+// into another chain or round in a loop, and the walk gives up after as
+// many steps as there are entries.
+static int find_entry(const DentryCache *dcache, int parent, const char *name) {
+    int index = SEQ_LOAD(dcache->buckets[bucket_of(dcache, parent, name)]);
+
+    for (int steps = 0; index != -1 && steps < dcache->num_entries; ++steps) {
+        const Dentry *entry = &dcache->entries[index];
+        if (SEQ_LOAD(entry->parent) == parent && name_matches(entry, name)) {
+            return index;
+        }
+        index = SEQ_LOAD(entry->next);
+    }
+
+    return -1;
+}
+
+static void unlink_entry(DentryCache *dcache, int index) {
+    Dentry *entry = &dcache->entries[index];
+    int *link = &dcache->buckets[bucket_of(dcache, entry->parent, entry->name)];
+
+    while (*link != index) {
+        link = &dcache->entries[*link].next;
+    }
+
+    SEQ_STORE(*link, entry->next);
+    SEQ_STORE(entry->next, -1);
+    SEQ_STORE(entry->parent, -1);
+    dcache->stats.invalidations++;
+}
+
+// CLOCK, as in the block cache
+static int evict_entry(DentryCache *dcache) {
+    for (;;) {
+        int index = dcache->hand;
+        Dentry *entry = &dcache->entries[index];
+        dcache->hand = (dcache->hand + 1) % dcache->num_entries;
+
+        if (entry->parent == -1) {
+            return index;
+        }
+
+        if (__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        unlink_entry(dcache, index);
+        return index;
+    }
+}
+
+static void clear_entries(DentryCache *dcache) {
+    for (int i = 0; i < dcache->num_entries; ++i) {
+        SEQ_STORE(dcache->entries[i].parent, -1);
+        dcache->entries[i].referenced = 0;
+        SEQ_STORE(dcache->entries[i].next, -1);
+        SEQ_STORE(dcache->buckets[i], -1);
+    }
+}
+
+int dcache_init(DentryCache *dcache, int num_entries, int thread_safe) {
+    memset(dcache, 0, sizeof(*dcache));
+    mutex_init(&dcache->lock, thread_safe);
+
+    if (num_entries == 0) {
+        return 0;
+    }
+
+    dcache->entries = calloc(num_entries, sizeof(Dentry));
+    dcache->buckets = malloc(num_entries * sizeof(int));
+
+    if (dcache->entries == NULL || dcache->buckets == NULL) {
+        free(dcache->entries);
+        free(dcache->buckets);
+        dcache->entries = NULL;
+        dcache->buckets = NULL;
+        mutex_destroy(&dcache->lock);
+        return -1;
+    }
+
+    dcache->num_entries = num_entries;
+    clear_entries(dcache);
+
+    return 0;
+}
+
+void dcache_destroy(DentryCache *dcache) {
+    free(dcache->entries);
+    free(dcache->buckets);
+    mutex_destroy(&dcache->lock);
+    memset(dcache, 0, sizeof(*dcache));
+}
+
+// Lookups take no lock: they copy the entry and start over when a writer
+// changed the cache meanwhile. The reference bit and the counters are all
+// they set.
+int dcache_lookup(DentryCache *dcache, int parent, const char *name, int *inode_number, int *type) {
+    if (dcache->num_entries == 0) {
+        STAT_ADD(dcache->stats.misses, 1);
+        return 0;
+    }
+
+    int index;
+    for (;;) {
+        unsigned int start = seq_read_begin(&dcache->seq);
+
+        index = find_entry(dcache, parent, name);
+        if (index != -1) {
+            Dentry *entry = &dcache->entries[index];
+            *inode_number = SEQ_LOAD(entry->inode_number);
+            *type = SEQ_LOAD(entry->type);
+        }
+
+        if (!seq_read_retry(&dcache->seq, start)) {
+            break;
+        }
+        STAT_ADD(dcache->stats.retries, 1);
+    }
+
+    if (index == -1) {
+        STAT_ADD(dcache->stats.misses, 1);
+        return 0;
+    }
+
+    __atomic_store_n(&dcache->entries[index].referenced, 1, __ATOMIC_RELAXED);
+
+    if (*inode_number == -1) {
+        STAT_ADD(dcache->stats.negative_hits, 1);
+    } else {
+        STAT_ADD(dcache->stats.hits, 1);
+    }
+
+    return 1;
+}
+
+void dcache_insert(DentryCache *dcache, int parent, const char *name, int inode_number, int type) {
+    if (dcache->num_entries == 0 || strlen(name) >= DCACHE_NAME_SIZE) {
+        return;
+    }
+
+    mutex_lock(&dcache->lock);
+    seq_write_begin(&dcache->seq);
+
+    int index = find_entry(dcache, parent, name);
+    if (index != -1) {
+        SEQ_STORE(dcache->entries[index].inode_number, inode_number);
+        SEQ_STORE(dcache->entries[index].type, type);
+        __atomic_store_n(&dcache->entries[index].referenced, 1, __ATOMIC_RELAXED);
+    } else {
+        index = evict_entry(dcache);
+        Dentry *entry = &dcache->entries[index];
+
+        int bucket = bucket_of(dcache, parent, name);
+        SEQ_STORE(entry->parent, parent);
+        SEQ_STORE(entry->inode_number, inode_number);
+        SEQ_STORE(entry->type, type);
+        __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        size_t length = strlen(name);
+        for (size_t i = 0; i <= length; ++i) {
+            SEQ_STORE(entry->name[i], name[i]);
+        }
+        SEQ_STORE(entry->next, dcache->buckets[bucket]);
+        SEQ_STORE(dcache->buckets[bucket], index);
+    }
+
+    seq_write_end(&dcache->seq);
+    mutex_unlock(&dcache->lock);
+}
+
+void dcache_invalidate(DentryCache *dcache, int parent, const char *name) {
+    if (dcache->num_entries == 0) {
+        return;
+    }
+
+    mutex_lock(&dcache->lock);
+    seq_write_begin(&dcache->seq);
+
+    int index = find_entry(dcache, parent, name);
+    if (index != -1) {
+        unlink_entry(dcache, index);
+    }
+
+    seq_write_end(&dcache->seq);
+    mutex_unlock(&dcache->lock);
+}
+
+void dcache_invalidate_dir(DentryCache *dcache, int parent) {
+    mutex_lock(&dcache->lock);
+    seq_write_begin(&dcache->seq);
+
+    for (int i = 0; i < dcache->num_entries; ++i) {
+        if (dcache->entries[i].parent == parent) {
+            unlink_entry(dcache, i);
+        }
+    }
+
+    seq_write_end(&dcache->seq);
+    mutex_unlock(&dcache->lock);
+}
+
+void dcache_clear(DentryCache *dcache) {
+    mutex_lock(&dcache->lock);
+    seq_write_begin(&dcache->seq);
+    clear_entries(dcache);
+    seq_write_end(&dcache->seq);
+    mutex_unlock(&dcache->lock);
+}
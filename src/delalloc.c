@@ -0,0 +1,84 @@
+#include "delalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void delalloc_init(DelayedAlloc *delalloc) {
+    memset(delalloc, 0, sizeof(*delalloc));
+
+    for (int i = 0; i < DELALLOC_FILES; ++i) {
+        delalloc->files[i].inode_number = -1;
+    }
+}
+
+void delalloc_destroy(DelayedAlloc *delalloc) {
+    for (int i = 0; i < DELALLOC_FILES; ++i) {
+        free(delalloc->files[i].data);
+    }
+
+    delalloc_init(delalloc);
+}
+
+// Slots are only claimed and dropped by the thread running the transaction;
+// the owner is read atomically so that a reader may look for its own file,
+// whose slot no other thread claims or drops while it holds the file.
+PendingWrite *delalloc_find(DelayedAlloc *delalloc, int inode_number) {
+    for (int i = 0; i < DELALLOC_FILES; ++i) {
+        if (__atomic_load_n(&delalloc->files[i].inode_number, __ATOMIC_ACQUIRE) == inode_number) {
+            return &delalloc->files[i];
+        }
+    }
+
+    return NULL;
+}
+
+// an empty slot for inode_number, NULL when every slot holds a file
+PendingWrite *delalloc_open(DelayedAlloc *delalloc, int inode_number, const char *path, long long size, int allocated) {
+    PendingWrite *pending = delalloc_find(delalloc, -1);
+    if (pending == NULL) {
+        return NULL;
+    }
+
+    pending->length = 0;
+    pending->reserved = 0;
+    pending->size = size;
+    pending->allocated = allocated;
+    snprintf(pending->path, sizeof(pending->path), "%s", path);
+    __atomic_store_n(&pending->inode_number, inode_number, __ATOMIC_RELEASE);
+    return pending;
+}
+
+int delalloc_append(PendingWrite *pending, const char *data, int length) {
+    if (pending->length + length > pending->capacity) {
+        int capacity = pending->capacity == 0 ? 1024 : pending->capacity;
+        while (capacity < pending->length + length) {
+            capacity *= 2;
+        }
+
+        char *grown = realloc(pending->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+
+        pending->data = grown;
+        pending->capacity = capacity;
+    }
+
+    memcpy(pending->data + pending->length, data, length);
+    pending->length += length;
+    return 0;
+}
+
+// sets the file's reservation to blocks, keeping the total in step
+void delalloc_reserve(DelayedAlloc *delalloc, PendingWrite *pending, int blocks) {
+    delalloc->reserved += blocks - pending->reserved;
+    pending->reserved = blocks;
+}
+
+// forgets the buffered bytes and releases the reservation; the buffer is kept for reuse
+void delalloc_drop(DelayedAlloc *delalloc, PendingWrite *pending) {
+    delalloc->reserved -= pending->reserved;
+    pending->length = 0;
+    pending->reserved = 0;
+    __atomic_store_n(&pending->inode_number, -1, __ATOMIC_RELEASE);
+}
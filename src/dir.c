@@ -0,0 +1,491 @@
+#include "dir.h"
+#include "disk.h"
+#include "bitmap.h"
+#include "group.h"
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; ++c) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int compare_hash(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void set_entry(DirectoryEntry *entry, const char *name, int inode_number, int type) {
+    entry->inode_number = inode_number;
+    entry->type = type;
+    memset(entry->name, 0, sizeof(entry->name));
+    strcpy(entry->name, name);
+}
+
+static int find_in_block(const DirectoryEntry *entries, int num_entries, const char *name) {
+    for (int i = 0; i < num_entries; ++i) {
+        if (entries[i].inode_number != 0 && strcmp(entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int find_free_slot(const DirectoryEntry *entries, int num_entries) {
+    for (int i = 0; i < num_entries; ++i) {
+        if (entries[i].inode_number == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// position of the leaf whose hash range holds hash
+static int index_find(const DirIndex *index, unsigned int hash) {
+    int low = 0;
+    int high = index->count - 1;
+
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (index->entries[mid].hash <= hash) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return low;
+}
+
+static int is_indexed(const Inode *dir) {
+    return (dir->flags & INODE_INDEXED) != 0;
+}
+
+// Moves the upper half of a full leaf, by hash, into a new leaf. Entries that
+// share a hash always stay together, so a leaf full of one hash cannot split.
+static int split_leaf(FsContext *fs, int index_block, DirIndex *index, int position) {
+    if (index->count == MAX_INDEX_ENTRIES(fs)) {
+        return DIR_FULL;
+    }
+
+    int num_entries = MAX_ENTRIES(fs);
+    int leaf_block = index->entries[position].block_number;
+    DirectoryEntry leaf[num_entries];
+    read_block(fs, leaf_block, leaf);
+
+    unsigned int hashes[num_entries];
+    for (int i = 0; i < num_entries; ++i) {
+        hashes[i] = name_hash(leaf[i].name);
+    }
+    qsort(hashes, num_entries, sizeof(unsigned int), compare_hash);
+
+    int split = num_entries / 2;
+    while (split < num_entries && hashes[split] == hashes[split-1]) {
+        split++;
+    }
+    if (split == num_entries) {
+        split = num_entries / 2;
+        while (split > 0 && hashes[split] == hashes[split-1]) {
+            split--;
+        }
+    }
+    if (split == 0) {
+        return DIR_FULL;
+    }
+
+    unsigned int split_hash = hashes[split];
+
+    int new_block = alloc_block_near(fs, leaf_block + 1);
+    if (new_block == -1) {
+        return -1;
+    }
+
+    DirectoryEntry upper[num_entries];
+    memset(upper, 0, sizeof(upper));
+
+    int moved = 0;
+    for (int i = 0; i < num_entries; ++i) {
+        if (name_hash(leaf[i].name) >= split_hash) {
+            upper[moved++] = leaf[i];
+            memset(&leaf[i], 0, sizeof(DirectoryEntry));
+        }
+    }
+
+    memmove(&index->entries[position+2], &index->entries[position+1],
+            (index->count - position - 1) * sizeof(DirIndexEntry));
+    index->entries[position+1].hash = split_hash;
+    index->entries[position+1].block_number = new_block;
+    index->count++;
+
+    write_block(fs, leaf_block, leaf);
+    write_block(fs, new_block, upper);
+    write_block(fs, index_block, index);
+
+    return 0;
+}
+
+static int count_entries(const DirectoryEntry *entries, int num_entries) {
+    int count = 0;
+    for (int i = 0; i < num_entries; ++i) {
+        count += entries[i].inode_number != 0;
+    }
+
+    return count;
+}
+
+// Folds the first pair of neighbouring leaves that fits in one leaf into the
+// lower of the two, giving a full index back a slot after deletes.
+static int merge_leaves(FsContext *fs, int index_block, DirIndex *index) {
+    int num_entries = MAX_ENTRIES(fs);
+    DirectoryEntry lower[num_entries];
+    DirectoryEntry upper[num_entries];
+    read_block(fs, index->entries[0].block_number, lower);
+
+    for (int i = 0; i + 1 < index->count; ++i) {
+        read_block(fs, index->entries[i+1].block_number, upper);
+
+        if (count_entries(lower, num_entries) + count_entries(upper, num_entries) > num_entries) {
+            memcpy(lower, upper, sizeof(lower));
+            continue;
+        }
+
+        for (int j = 0; j < num_entries; ++j) {
+            if (upper[j].inode_number != 0) {
+                lower[find_free_slot(lower, num_entries)] = upper[j];
+            }
+        }
+
+        int upper_block = index->entries[i+1].block_number;
+        memmove(&index->entries[i+1], &index->entries[i+2],
+                (index->count - i - 2) * sizeof(DirIndexEntry));
+        index->count--;
+
+        write_block(fs, index->entries[i].block_number, lower);
+        write_block(fs, index_block, index);
+        free_block(fs, upper_block);
+        return 0;
+    }
+
+    return -1;
+}
+
+static int indexed_insert(FsContext *fs, const Inode *dir, const char *name, int inode_number, int type) {
+    char index_data[fs->sb.block_size];
+    DirIndex *index = (DirIndex *)index_data;
+    read_block(fs, dir->direct_blocks[0], index_data);
+
+    unsigned int hash = name_hash(name);
+
+    for (;;) {
+        int position = index_find(index, hash);
+        int leaf_block = index->entries[position].block_number;
+
+        DirectoryEntry leaf[MAX_ENTRIES(fs)];
+        read_block(fs, leaf_block, leaf);
+
+        int slot = find_free_slot(leaf, MAX_ENTRIES(fs));
+        if (slot != -1) {
+            set_entry(&leaf[slot], name, inode_number, type);
+            write_block(fs, leaf_block, leaf);
+            return 0;
+        }
+
+        int ret = split_leaf(fs, dir->direct_blocks[0], index, position);
+        if (ret == DIR_FULL && index->count == MAX_INDEX_ENTRIES(fs) &&
+            merge_leaves(fs, dir->direct_blocks[0], index) == 0) {
+            continue;
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+}
+
+// Rebuilds a full linear directory as an index with one empty leaf, then
+// reinserts its entries; the old linear blocks are released afterwards.
+static int convert_to_index(FsContext *fs, Inode *dir) {
+    int index_block = alloc_block_near(fs, dir->direct_blocks[0] + 1);
+    if (index_block == -1) {
+        return -1;
+    }
+
+    int leaf_block = alloc_block_near(fs, index_block + 1);
+    if (leaf_block == -1) {
+        return -1;
+    }
+
+    char index_data[fs->sb.block_size];
+    memset(index_data, 0, fs->sb.block_size);
+
+    DirIndex *index = (DirIndex *)index_data;
+    index->magic = DIR_INDEX_MAGIC;
+    index->count = 1;
+    index->entries[0].hash = 0;
+    index->entries[0].block_number = leaf_block;
+    write_block(fs, index_block, index_data);
+
+    DirectoryEntry entries[MAX_ENTRIES(fs)];
+    memset(entries, 0, sizeof(entries));
+    write_block(fs, leaf_block, entries);
+
+    Inode indexed = *dir;
+    indexed.flags |= INODE_INDEXED;
+    memset(indexed.direct_blocks, -1, sizeof(indexed.direct_blocks));
+    indexed.direct_blocks[0] = index_block;
+
+    for (int i = 0; i < 4; ++i) {
+        int block_number = dir->direct_blocks[i];
+        if (block_number == -1) {
+            continue;
+        }
+
+        read_block(fs, block_number, entries);
+
+        for (int j = 0; j < MAX_ENTRIES(fs); ++j) {
+            if (entries[j].inode_number == 0) {
+                continue;
+            }
+
+            if (indexed_insert(fs, &indexed, entries[j].name, entries[j].inode_number, entries[j].type) != 0) {
+                return -1;
+            }
+        }
+
+        free_block(fs, block_number);
+    }
+
+    *dir = indexed;
+    return 0;
+}
+
+static int found_entry(const DirectoryEntry *entry, int *type) {
+    if (type != NULL) {
+        *type = entry->type;
+    }
+
+    return entry->inode_number;
+}
+
+int dir_lookup(FsContext *fs, const Inode *dir, const char *name, int *type) {
+    DirectoryEntry entries[MAX_ENTRIES(fs)];
+
+    if (is_indexed(dir)) {
+        char index_data[fs->sb.block_size];
+        DirIndex *index = (DirIndex *)index_data;
+        read_block(fs, dir->direct_blocks[0], index_data);
+
+        int position = index_find(index, name_hash(name));
+        read_block(fs, index->entries[position].block_number, entries);
+
+        int slot = find_in_block(entries, MAX_ENTRIES(fs), name);
+        return slot == -1 ? -1 : found_entry(&entries[slot], type);
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        int block_number = dir->direct_blocks[i];
+        if (block_number == -1) {
+            continue;
+        }
+
+        read_block(fs, block_number, entries);
+
+        int slot = find_in_block(entries, MAX_ENTRIES(fs), name);
+        if (slot != -1) {
+            return found_entry(&entries[slot], type);
+        }
+    }
+
+    return -1;
+}
+
+static int insert_entry(FsContext *fs, int dir_number, Inode *dir, const char *name, int inode_number, int type) {
+    if (!is_indexed(dir)) {
+        DirectoryEntry entries[MAX_ENTRIES(fs)];
+        int free_direct = -1;
+
+        for (int i = 0; i < 4; ++i) {
+            int block_number = dir->direct_blocks[i];
+            if (block_number == -1) {
+                if (free_direct == -1) {
+                    free_direct = i;
+                }
+                continue;
+            }
+
+            read_block(fs, block_number, entries);
+
+            int slot = find_free_slot(entries, MAX_ENTRIES(fs));
+            if (slot != -1) {
+                set_entry(&entries[slot], name, inode_number, type);
+                write_block(fs, block_number, entries);
+
+                dir->size++;
+                write_inode(fs, dir_number, dir);
+                return 0;
+            }
+        }
+
+        // a directory stays linear while it fits in a single block
+        if (free_direct == 0) {
+            int new_block = alloc_block_near(fs, INODE_GOAL(fs, dir_number));
+            if (new_block == -1) {
+                return -1;
+            }
+
+            memset(entries, 0, sizeof(entries));
+            set_entry(&entries[0], name, inode_number, type);
+            write_block(fs, new_block, entries);
+
+            dir->direct_blocks[0] = new_block;
+            dir->size++;
+            write_inode(fs, dir_number, dir);
+            return 0;
+        }
+
+        if (convert_to_index(fs, dir) != 0) {
+            return -1;
+        }
+    }
+
+    int ret = indexed_insert(fs, dir, name, inode_number, type);
+    if (ret != 0) {
+        return ret;
+    }
+
+    dir->size++;
+    write_inode(fs, dir_number, dir);
+    return 0;
+}
+
+// A kept listing is brought up to date as its directory changes, so readers
+// of a busy directory keep finding it.
+static void refresh_listing(FsContext *fs, int dir_number, const Inode *dir) {
+    if (!listing_kept(&fs->listing, dir_number)) {
+        return;
+    }
+
+    DirectoryEntry entries[LISTING_ENTRIES + 1];
+    int count = dir_list(fs, dir, entries, LISTING_ENTRIES + 1);
+    listing_store(&fs->listing, dir_number, entries, count);
+}
+
+int dir_insert(FsContext *fs, int dir_number, Inode *dir, const char *name, int inode_number, int type) {
+    int ret = insert_entry(fs, dir_number, dir, name, inode_number, type);
+    if (ret != 0) {
+        return ret;
+    }
+
+    dcache_insert(&fs->dcache, dir_number, name, inode_number, type);
+    refresh_listing(fs, dir_number, dir);
+    return 0;
+}
+
+int dir_remove(FsContext *fs, int dir_number, Inode *dir, const char *name) {
+    DirectoryEntry entries[MAX_ENTRIES(fs)];
+    int block_number = -1;
+    int slot = -1;
+
+    if (is_indexed(dir)) {
+        char index_data[fs->sb.block_size];
+        DirIndex *index = (DirIndex *)index_data;
+        read_block(fs, dir->direct_blocks[0], index_data);
+
+        block_number = index->entries[index_find(index, name_hash(name))].block_number;
+        read_block(fs, block_number, entries);
+        slot = find_in_block(entries, MAX_ENTRIES(fs), name);
+    } else {
+        for (int i = 0; i < 4 && slot == -1; ++i) {
+            block_number = dir->direct_blocks[i];
+            if (block_number == -1) {
+                continue;
+            }
+
+            read_block(fs, block_number, entries);
+            slot = find_in_block(entries, MAX_ENTRIES(fs), name);
+        }
+    }
+
+    if (slot == -1) {
+        return -1;
+    }
+
+    int inode_number = entries[slot].inode_number;
+    entries[slot].inode_number = 0;
+    write_block(fs, block_number, entries);
+
+    dir->size--;
+    write_inode(fs, dir_number, dir);
+
+    dcache_insert(&fs->dcache, dir_number, name, -1, -1);
+    refresh_listing(fs, dir_number, dir);
+
+    return inode_number;
+}
+
+static int list_block(FsContext *fs, int block_number, DirectoryEntry *entries, int num_entries, int max_entries) {
+    DirectoryEntry block_entries[MAX_ENTRIES(fs)];
+    read_block(fs, block_number, block_entries);
+
+    for (int j = 0; j < MAX_ENTRIES(fs) && num_entries < max_entries; ++j) {
+        if (block_entries[j].inode_number != 0) {
+            entries[num_entries++] = block_entries[j];
+        }
+    }
+
+    return num_entries;
+}
+
+int dir_list(FsContext *fs, const Inode *dir, DirectoryEntry *entries, int max_entries) {
+    int num_entries = 0;
+
+    if (is_indexed(dir)) {
+        char index_data[fs->sb.block_size];
+        DirIndex *index = (DirIndex *)index_data;
+        read_block(fs, dir->direct_blocks[0], index_data);
+
+        for (int i = 0; i < index->count && num_entries < max_entries; ++i) {
+            num_entries = list_block(fs, index->entries[i].block_number, entries, num_entries, max_entries);
+        }
+
+        return num_entries;
+    }
+
+    for (int i = 0; i < 4 && num_entries < max_entries; ++i) {
+        if (dir->direct_blocks[i] != -1) {
+            num_entries = list_block(fs, dir->direct_blocks[i], entries, num_entries, max_entries);
+        }
+    }
+
+    return num_entries;
+}
+
+void dir_release(FsContext *fs, Inode *dir) {
+    if (is_indexed(dir)) {
+        char index_data[fs->sb.block_size];
+        DirIndex *index = (DirIndex *)index_data;
+        read_block(fs, dir->direct_blocks[0], index_data);
+
+        for (int i = 0; i < index->count; ++i) {
+            free_block(fs, index->entries[i].block_number);
+        }
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        if (dir->direct_blocks[i] != -1) {
+            free_block(fs, dir->direct_blocks[i]);
+            dir->direct_blocks[i] = -1;
+        }
+    }
+
+    dir->flags &= ~INODE_INDEXED;
+}
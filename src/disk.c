@@ -1,249 +1,500 @@
-#include "disk.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-void begin_transaction() {
-    char command[100];
-    sprintf(command, "cp %s %s", disk_image, backup_image);
-
-    system(command);
-}
-
-void rollback_transaction() {
-    char command[100];
-    sprintf(command, "cp %s %s", backup_image, disk_image);
-    system(command);
-
-    sprintf(command, "rm %s", backup_image);
-    system(command);
-}
-
-void commit_transaction() {
-    char command[100];
-    sprintf(command, "rm %s", backup_image);
-
-    system(command);
-}
-
-int read_superblock(FILE *disk, SuperBlock *sb) {
-    char block[BLOCK_SIZE];
-    fread(block, BLOCK_SIZE, 1, disk);
-
-    memcpy(sb, block, sizeof(SuperBlock));
-
-    if (sb->magic_number != 0xDEADBEEF) {
-        return -1;
-    }
-
-    return 0;
-}
-
-void read_inode(FILE *disk, int inode_start, int inode_number, Inode *inode) {
-    int block_number = inode_start + (inode_number / MAX_INODES);
-
-    Inode inodes[MAX_INODES];
-    read_block(disk, block_number, inodes);
-
-    int index = inode_number % (MAX_INODES);
-    memcpy(inode, &inodes[index], sizeof(Inode));
-}
-
-void read_block(FILE *disk, int block_number, void *bock) {
-    int block_offset = block_number * BLOCK_SIZE;
-
-    fseek(disk, block_offset, SEEK_SET);
-    fread(bock, BLOCK_SIZE, 1, disk);
-}
-
-void write_superblock(FILE *disk, const SuperBlock *sb) {
-    char block[BLOCK_SIZE];
-    memset(block, 0, BLOCK_SIZE);
-
-    memcpy(block, sb, sizeof(SuperBlock));
-    fwrite(block, BLOCK_SIZE, 1, disk);
-}
-
-void write_inode(FILE *disk, int inode_start, int inode_number, const Inode *inode) {
-    int block_number = inode_start + (inode_number / MAX_INODES);
-
-    Inode inodes[MAX_INODES];
-    read_block(disk, block_number, inodes);
-
-    int index = inode_number % (MAX_INODES);
-    inodes[index] = *inode;
-    write_block(disk, block_number, inodes);
-}
-
-void write_block(FILE *disk, int block_number, const void *block) {
-    int block_offset = block_number * BLOCK_SIZE;
-
-    fseek(disk, block_offset, SEEK_SET);
-    fwrite(block, BLOCK_SIZE, 1, disk);
-}
-
-int create_inode(FILE* disk, SuperBlock *sb, Type type) {
-    int num_blocks = sb->data_start - sb->inode_start;
-
-    Inode inodes[MAX_INODES];
-    for (int i = 0; i < num_blocks; ++i) {
-        read_block(disk, sb->inode_start+i, inodes);
-
-        for (int j = 0; j < MAX_INODES; ++j) {
-            if (inodes[j].is_valid == 0) {
-                inodes[j].is_valid = 1;
-                inodes[j].owner_id = 150230736;
-                inodes[j].is_directory = type;
-                inodes[j].size = 0;
-                memset(inodes[j].direct_blocks, -1, sizeof(inodes[j].direct_blocks));
-
-                write_block(disk, sb->inode_start+i, inodes);
-
-                sb->num_inodes++;
-                write_superblock(disk, sb);
-
-                return i*MAX_INODES + j;
-            }
-        }
-    }
-    return -1;
-}
-
-int tokenize_path(const char *path, char tokens[MAX_DEPTH][TOKEN_LEN]) {
-    if (path[0] != '/') {
-        return -1;
-    }
-
-   int depth = 0;
-    size_t path_len = strlen(path);
-    char path_copy[500];
-
-    strcpy(path_copy, path);
-
-    char *buffer;
-    char *token = strtok_r(path_copy, "/", &buffer);
-
-    while (token != NULL && depth < MAX_DEPTH) {
-        char *next_token = strtok_r(NULL, "/", &buffer);
-
-        if (next_token == NULL && path[path_len - 1] != '/') {
-            snprintf(tokens[depth], TOKEN_LEN, "%s", token);
-        } else {
-            snprintf(tokens[depth], TOKEN_LEN, "%s/", token);
-        }
-
-        depth++;
-        token = next_token;
-    }
-
-    return depth;
-}
-
-int find_inode_by_path(FILE *disk, int inode_start, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth) {
-    int current_inode = 0;
-
-    for (int i = 0; i < depth; ++i) {
-        Inode dir_inode;
-        read_inode(disk, inode_start, current_inode, &dir_inode);
-
-        if (dir_inode.is_directory != 1) {
-            return -1;
-        }
-
-        int found = 0;
-        DirectoryEntry entries[MAX_ENTRIES];
-
-        for (int j = 0; j < 4; ++j) {
-            int block_number = dir_inode.direct_blocks[j];
-            if (block_number == -1) {
-                continue;
-            }
-
-            read_block(disk, block_number, entries);
-
-            for (int k = 0; k < MAX_ENTRIES; ++k) {
-                DirectoryEntry *entry = &entries[k];
-                if (entry->inode_number != 0 && strcmp(entry->name, tokens[i]) == 0) {
-                    current_inode = entry->inode_number;
-                    found = 1;
-                    break;
-                }
-            }
-
-            if (found) {
-                break;
-            }
-        }
-
-        if (!found) {
-            return -1;
-        }
-    }
-
-    return current_inode;
-}
-
-int is_file_exist(FILE *disk, int inode_start, int parent_inode, const char *name) {
-    Inode parent;
-    read_inode(disk, inode_start, parent_inode, &parent);
-
-    for (int i = 0; i < 4; ++i) {
-        int block_number = parent.direct_blocks[i];
-        if (block_number == -1) {
-            continue;
-        }
-
-        DirectoryEntry entries[MAX_ENTRIES];
-        read_block(disk, block_number, entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            int inode_num = entries[j].inode_number;
-
-            if (inode_num == 0) {
-                continue;
-            }
-
-            Inode child;
-            read_inode(disk, inode_start, inode_num, &child);
-
-            if (child.is_directory == 0 && strcmp(entries[j].name, name) == 0) {
-                return 1;
-            }
-        }
-    }
-
-    return 0;
-}
-
-
-int is_dir_exist(FILE *disk, int inode_start, int parent_inode, const char *name) {
-    Inode parent;
-    read_inode(disk, inode_start, parent_inode, &parent);
-
-    for (int i = 0; i < 4; ++i) {
-        int block_number = parent.direct_blocks[i];
-        if (block_number == -1) {
-            continue;
-        }
-
-        DirectoryEntry entries[MAX_ENTRIES];
-        read_block(disk, block_number, entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            int inode_num = entries[j].inode_number;
-
-            if (inode_num == 0) {
-                continue;
-            }
-
-            Inode child;
-            read_inode(disk, inode_start, inode_num, &child);
-
-            if (child.is_directory == 1 && strcmp(entries[j].name, name) == 0) {
-                return 1;
-            }
-        }
-    }
-
-    return 0;
-}
+#include "disk.h"
+#include "bitmap.h"
+#include "dir.h"
+#include "group.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The superblock sits at the start of block 0 whatever the block size, so a
+// MIN_BLOCK_SIZE read is enough to learn the size the image was made with.
+static void probe_block_size(BlockDevice *dev) {
+    char block[MIN_BLOCK_SIZE];
+    if (blockdev_read(dev, 0, block) != 0) {
+        return;
+    }
+
+    const SuperBlock *sb = (const SuperBlock *)block;
+    if (sb->magic_number == FS_MAGIC && sb->block_size >= MIN_BLOCK_SIZE && sb->block_size <= MAX_BLOCK_SIZE) {
+        dev->block_size = sb->block_size;
+    }
+}
+
+int disk_open(FsContext *fs, const MountOptions *options) {
+    if (blockdev_open(&fs->dev, fs->image, options->backend, options->aio_engine, MIN_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+
+    probe_block_size(&fs->dev);
+
+    if (cache_init(&fs->cache, options->cache_frames, fs->dev.block_size, &fs->dev, blockdev_readv, blockdev_writev,
+                   fs->thread_safe) != 0) {
+        blockdev_close(&fs->dev);
+        return -1;
+    }
+
+    if (dcache_init(&fs->dcache, options->dcache_entries, fs->thread_safe) != 0) {
+        cache_destroy(&fs->cache);
+        blockdev_close(&fs->dev);
+        return -1;
+    }
+
+    if (listing_init(&fs->listing, options->listing_dirs, sizeof(DirectoryEntry), fs->thread_safe) != 0) {
+        dcache_destroy(&fs->dcache);
+        cache_destroy(&fs->cache);
+        blockdev_close(&fs->dev);
+        return -1;
+    }
+
+    rwlock_init(&fs->group_lock, fs->thread_safe);
+    return 0;
+}
+
+void disk_close(FsContext *fs) {
+    if (fs->dev.ops == NULL) {
+        return;
+    }
+
+    free_groups(fs);
+    rwlock_destroy(&fs->group_lock);
+    journal_destroy(&fs->journal);
+    listing_destroy(&fs->listing);
+    dcache_destroy(&fs->dcache);
+    cache_destroy(&fs->cache);
+    blockdev_close(&fs->dev);
+}
+
+void flush_blocks(FsContext *fs) {
+    cache_flush(&fs->cache);
+    blockdev_sync(&fs->dev);
+}
+
+// Returns 1, with the journal closed again, when replay is 0 and there is a
+// transaction to replay.
+int open_journal(FsContext *fs, int replay) {
+    if (journal_init(&fs->journal, fs->sb.journal_start, fs->sb.journal_blocks, fs->sb.block_size, fs->thread_safe) != 0) {
+        return -1;
+    }
+
+    int found = journal_recover(&fs->journal, &fs->dev, replay);
+    if (found != 0) {
+        journal_destroy(&fs->journal);
+        return found;
+    }
+
+    // replay may have rewritten blocks behind the cache, superblock included
+    cache_invalidate(&fs->cache);
+    return read_superblock(fs);
+}
+
+// Reads back what the mount keeps in memory of the metadata a transaction
+// changes, after some of it was thrown away.
+static void reload_metadata(FsContext *fs) {
+    // the inode count is the one superblock field a transaction changes;
+    // the rest stays put under other threads reading it
+    char block[fs->sb.block_size];
+    read_block(fs, 0, block);
+    fs->sb.num_inodes = ((const SuperBlock *)block)->num_inodes;
+    read_groups(fs);
+
+    // names looked up or added inside the transaction may no longer hold,
+    // nor listings refreshed in it
+    dcache_clear(&fs->dcache);
+    listing_clear(&fs->listing);
+}
+
+// A failed commit wrote nothing home: the image is as it was before the
+// group, and so is the mount's metadata after this.
+static int commit_group(FsContext *fs) {
+    if (journal_commit(&fs->journal, &fs->dev, &fs->cache) == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(&fs->commit_failed, 1, __ATOMIC_RELAXED);
+    reload_metadata(fs);
+    return -1;
+}
+
+// Each call is an operation of the running transaction, which is committed
+// once enough operations wait or the first has waited long enough (group
+// commit; by default every operation commits on its own). Inside a batch
+// every call joins the batch's transaction, and a rollback throws away the
+// whole batch; calls after it log into a fresh transaction that fs_end_batch
+// throws away as well.
+void begin_transaction(FsContext *fs) {
+    if (fs->batch && fs->journal.active) {
+        return;
+    }
+
+    // a group past its time bound goes out before another operation joins;
+    // if it fails, so does this operation, at commit_transaction
+    if (fs->journal.active && journal_due(&fs->journal)) {
+        commit_group(fs);
+    }
+
+    journal_begin(&fs->journal);
+}
+
+// takes back the running operation only
+void rollback_transaction(FsContext *fs) {
+    if (fs->batch) {
+        fs->batch_failed = 1;
+    }
+
+    journal_abort(&fs->journal);
+    reload_metadata(fs);
+}
+
+// Closes the running operation. One that wrote a block the journal could not
+// take, because it needs more than a pass or memory ran out, is rolled back
+// instead, and -1 returned; so is every operation once a commit has failed.
+int commit_transaction(FsContext *fs) {
+    if (fs->journal.failed || fs->commit_failed) {
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    if (fs->batch) {
+        return 0;
+    }
+
+    if (journal_end(&fs->journal)) {
+        return commit_group(fs);
+    } else if (fs->journal.ops == 1 && fs->committer_running) {
+        // a group has started: its time bound runs from now
+        pthread_cond_signal(&fs->commit_wake);
+    }
+
+    return 0;
+}
+
+// commits the operations waiting for a group commit, -1 if any were lost
+int sync_transaction(FsContext *fs) {
+    if (fs->journal.active && !fs->batch && commit_group(fs) != 0) {
+        return -1;
+    }
+
+    return fs->commit_failed ? -1 : 0;
+}
+
+int read_superblock(FsContext *fs) {
+    char block[fs->dev.block_size];
+    read_block(fs, 0, block);
+
+    memcpy(&fs->sb, block, sizeof(SuperBlock));
+
+    if (fs->sb.magic_number != FS_MAGIC || fs->sb.version != FS_VERSION ||
+        fs->sb.block_size != fs->dev.block_size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// block of the group's inode table holding inode_number, *index is its slot there
+static int inode_block(FsContext *fs, int inode_number, int *index) {
+    int slot = inode_number % fs->sb.inodes_per_group;
+
+    *index = slot % MAX_INODES(fs);
+    return GROUP_INODE_TABLE(fs, GROUP_OF_INODE(fs, inode_number)) + slot / MAX_INODES(fs);
+}
+
+void read_inode(FsContext *fs, int inode_number, Inode *inode) {
+    int index;
+    int block_number = inode_block(fs, inode_number, &index);
+
+    char block[fs->sb.block_size];
+    read_block(fs, block_number, block);
+
+    Inode *inodes = (Inode *)block;
+    memcpy(inode, &inodes[index], sizeof(Inode));
+}
+
+void read_block(FsContext *fs, int block_number, void *block) {
+    if (journal_lookup(&fs->journal, block_number, block)) {
+        return;
+    }
+
+    // a cached block has been read or written, so it is no uninitialised metadata
+    if (cache_lookup(&fs->cache, block_number, block)) {
+        return;
+    }
+
+    if (group_block_uninit(fs, block_number)) {
+        memset(block, 0, fs->sb.block_size);
+        return;
+    }
+
+    cache_read(&fs->cache, block_number, block);
+}
+
+void write_superblock(FsContext *fs) {
+    char block[fs->sb.block_size];
+    memset(block, 0, fs->sb.block_size);
+
+    memcpy(block, &fs->sb, sizeof(SuperBlock));
+    write_block(fs, 0, block);
+}
+
+void write_inode(FsContext *fs, int inode_number, const Inode *inode) {
+    int index;
+    int block_number = inode_block(fs, inode_number, &index);
+
+    char block[fs->sb.block_size];
+    read_block(fs, block_number, block);
+
+    Inode *inodes = (Inode *)block;
+    inodes[index] = *inode;
+    write_block(fs, block_number, block);
+}
+
+int write_block(FsContext *fs, int block_number, const void *block) {
+    if (fs->uninit_groups != 0) {
+        group_block_written(fs, block_number);
+    }
+
+    if (!fs->journal.active) {
+        cache_write(&fs->cache, block_number, block);
+        return 0;
+    }
+
+    // an operation that outgrows the room the ones before it left commits
+    // them first and goes on alone; a batch commits whole or not at all, so
+    // one that outgrows a pass fails
+    int ret = journal_add(&fs->journal, block_number, block);
+    if (ret == JOURNAL_FULL && !fs->batch && journal_commit_before(&fs->journal, &fs->dev, &fs->cache) == 0) {
+        ret = journal_add(&fs->journal, block_number, block);
+    }
+
+    if (ret != 0) {
+        fs->journal.failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void read_blocks(FsContext *fs, int block_number, int count, void *blocks) {
+    char *out = blocks;
+    int pending = 0;
+
+    // blocks the running transaction has rewritten split the run
+    for (int i = 0; i < count; ++i) {
+        if (!journal_lookup(&fs->journal, block_number + i, out + (size_t)i * fs->sb.block_size)) {
+            pending++;
+            continue;
+        }
+
+        if (pending > 0) {
+            cache_read_run(&fs->cache, block_number + i - pending, pending, out + (size_t)(i - pending) * fs->sb.block_size);
+            pending = 0;
+        }
+    }
+
+    if (pending > 0) {
+        cache_read_run(&fs->cache, block_number + count - pending, pending, out + (size_t)(count - pending) * fs->sb.block_size);
+    }
+}
+
+void read_blocks_vec(FsContext *fs, int block_number, const struct iovec *iov, int iovcnt) {
+    // blocks the running transaction has rewritten must come from the log
+    if (!journal_empty(&fs->journal)) {
+        for (int i = 0; i < iovcnt; ++i) {
+            int count = iov[i].iov_len / fs->sb.block_size;
+            read_blocks(fs, block_number, count, iov[i].iov_base);
+            block_number += count;
+        }
+        return;
+    }
+
+    cache_read_vec(&fs->cache, block_number, iov, iovcnt);
+}
+
+// Brings blocks read straight from the device, as prefetches and
+// asynchronous reads are, up to date with the cache and the running
+// transaction.
+void overlay_blocks(FsContext *fs, int block_number, const struct iovec *iov, int iovcnt) {
+    cache_overlay(&fs->cache, block_number, iov, iovcnt);
+
+    if (journal_empty(&fs->journal)) {
+        return;
+    }
+
+    for (int i = 0; i < iovcnt; ++i) {
+        char *base = iov[i].iov_base;
+        for (size_t offset = 0; offset < iov[i].iov_len; offset += fs->sb.block_size) {
+            journal_lookup(&fs->journal, block_number++, base + offset);
+        }
+    }
+}
+
+int write_blocks(FsContext *fs, int block_number, int count, const void *blocks) {
+    const char *in = blocks;
+
+    if (!fs->journal.active) {
+        cache_write_run(&fs->cache, block_number, count, blocks);
+        return 0;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (write_block(fs, block_number + i, in + (size_t)i * fs->sb.block_size) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// A file's inode goes in its parent directory's group; a directory's goes in
+// a roomy group so that its own files can follow it there.
+int create_inode(FsContext *fs, int parent_inode, Type type) {
+    int group = GROUP_OF_INODE(fs, parent_inode);
+    if (type == TYPE_DIR) {
+        group = group_for_directory(fs, group);
+    }
+
+    int inode_number = alloc_inode(fs, group);
+    if (inode_number == -1) {
+        return -1;
+    }
+
+    Inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.is_valid = 1;
+    inode.owner_id = 150230736;
+    inode.is_directory = type;
+    inode.extent_block = -1;
+    if (type == TYPE_DIR) {
+        memset(inode.direct_blocks, -1, sizeof(inode.direct_blocks));
+    }
+
+    write_inode(fs, inode_number, &inode);
+
+    fs->sb.num_inodes++;
+    write_superblock(fs);
+
+    return inode_number;
+}
+
+void free_inode(FsContext *fs, int inode_number) {
+    Inode inode;
+    memset(&inode, 0, sizeof(inode));
+    memset(inode.direct_blocks, -1, sizeof(inode.direct_blocks));
+    inode.extent_block = -1;
+
+    write_inode(fs, inode_number, &inode);
+    release_inode(fs, inode_number);
+
+    fs->sb.num_inodes--;
+    write_superblock(fs);
+}
+
+int tokenize_path(const char *path, char tokens[MAX_DEPTH][TOKEN_LEN]) {
+    if (path[0] != '/') {
+        return -1;
+    }
+
+   int depth = 0;
+    size_t path_len = strlen(path);
+    char path_copy[500];
+
+    strcpy(path_copy, path);
+
+    char *buffer;
+    char *token = strtok_r(path_copy, "/", &buffer);
+
+    while (token != NULL && depth < MAX_DEPTH) {
+        char *next_token = strtok_r(NULL, "/", &buffer);
+
+        if (next_token == NULL && path[path_len - 1] != '/') {
+            snprintf(tokens[depth], TOKEN_LEN, "%s", token);
+        } else {
+            snprintf(tokens[depth], TOKEN_LEN, "%s/", token);
+        }
+
+        depth++;
+        token = next_token;
+    }
+
+    return depth;
+}
+
+int lookup_child(FsContext *fs, int parent_inode, const char *name, int *type) {
+    int inode_number;
+    int child_type = -1;
+
+    if (type == NULL) {
+        type = &child_type;
+    }
+
+    if (dcache_lookup(&fs->dcache, parent_inode, name, &inode_number, type)) {
+        return inode_number;
+    }
+
+    Inode parent;
+    read_inode(fs, parent_inode, &parent);
+
+    // a file has no children; leave it uncached since its number may be reused for a directory
+    if (parent.is_directory != 1) {
+        return -1;
+    }
+
+    *type = -1;
+    inode_number = dir_lookup(fs, &parent, name, type);
+    dcache_insert(&fs->dcache, parent_inode, name, inode_number, *type);
+
+    return inode_number;
+}
+
+int find_inode_by_path(FsContext *fs, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth) {
+    int current_inode = 0;
+
+    for (int i = 0; i < depth; ++i) {
+        int type;
+        current_inode = lookup_child(fs, current_inode, tokens[i], &type);
+        if (current_inode == -1) {
+            return -1;
+        }
+
+        // only the last component may be a file
+        if (i < depth - 1 && type != TYPE_DIR) {
+            return -1;
+        }
+    }
+
+    return current_inode;
+}
+
+int find_cached_inode(FsContext *fs, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth) {
+    int current_inode = 0;
+
+    for (int i = 0; i < depth; ++i) {
+        int type;
+        if (!dcache_lookup(&fs->dcache, current_inode, tokens[i], &current_inode, &type) || current_inode == -1) {
+            return -1;
+        }
+
+        if (i < depth - 1 && type != TYPE_DIR) {
+            return -1;
+        }
+    }
+
+    return current_inode;
+}
+
+static int child_type(FsContext *fs, int parent_inode, const char *name) {
+    int type;
+    if (lookup_child(fs, parent_inode, name, &type) == -1) {
+        return -1;
+    }
+
+    return type;
+}
+
+int is_file_exist(FsContext *fs, int parent_inode, const char *name) {
+    return child_type(fs, parent_inode, name) == TYPE_FILE;
+}
+
+int is_dir_exist(FsContext *fs, int parent_inode, const char *name) {
+    return child_type(fs, parent_inode, name) == TYPE_DIR;
+}
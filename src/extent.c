@@ -0,0 +1,121 @@
+#include "extent.h"
+#include "disk.h"
+#include "bitmap.h"
+#include "group.h"
+#include <string.h>
+
+// Puts the first runs back in the inode and the rest in its extent block,
+// allocating that block the first time a file needs it.
+static int store_extents(FsContext *fs, Inode *inode, const Extent *extents, int num_extents) {
+    int in_inode = num_extents < INODE_EXTENTS ? num_extents : INODE_EXTENTS;
+    memcpy(inode->extents, extents, in_inode * sizeof(Extent));
+
+    if (num_extents > INODE_EXTENTS) {
+        if (inode->extent_block == -1) {
+            const Extent *last = &extents[num_extents-1];
+            inode->extent_block = alloc_block_near(fs, last->start + last->length);
+            if (inode->extent_block == -1) {
+                return -1;
+            }
+        }
+
+        Extent block[MAX_BLOCK_EXTENTS(fs)];
+        memset(block, 0, sizeof(block));
+        memcpy(block, extents + INODE_EXTENTS, (num_extents - INODE_EXTENTS) * sizeof(Extent));
+        write_block(fs, inode->extent_block, block);
+    }
+
+    inode->num_extents = num_extents;
+    return 0;
+}
+
+int extent_list(FsContext *fs, const Inode *inode, Extent *extents) {
+    int in_inode = inode->num_extents < INODE_EXTENTS ? inode->num_extents : INODE_EXTENTS;
+    memcpy(extents, inode->extents, in_inode * sizeof(Extent));
+
+    if (inode->num_extents > INODE_EXTENTS) {
+        Extent block[MAX_BLOCK_EXTENTS(fs)];
+        read_block(fs, inode->extent_block, block);
+        memcpy(extents + INODE_EXTENTS, block, (inode->num_extents - INODE_EXTENTS) * sizeof(Extent));
+    }
+
+    return inode->num_extents;
+}
+
+int extent_lookup(const Extent *extents, int num_extents, int logical, int *run) {
+    for (int i = 0; i < num_extents; ++i) {
+        if (logical < extents[i].length) {
+            *run = extents[i].length - logical;
+            return extents[i].start + logical;
+        }
+
+        logical -= extents[i].length;
+    }
+
+    return -1;
+}
+
+// blocks mapped by the runs, which may reach past the end of the file
+int extent_blocks(const Extent *extents, int num_extents) {
+    int blocks = 0;
+
+    for (int i = 0; i < num_extents; ++i) {
+        blocks += extents[i].length;
+    }
+
+    return blocks;
+}
+
+// Appends count blocks to the end of the file, asking the allocator for a
+// run that starts right after the last one so that sequential growth extends
+// it. An empty file starts in its inode's group.
+int extent_grow(FsContext *fs, int inode_number, Inode *inode, int count) {
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+
+    while (count > 0) {
+        Extent *last = num_extents > 0 ? &extents[num_extents-1] : NULL;
+        int goal = last != NULL ? last->start + last->length : INODE_GOAL(fs, inode_number);
+
+        int length;
+        int block_number = alloc_blocks_near(fs, goal, count, &length);
+        if (block_number == -1) {
+            return -1;
+        }
+
+        count -= length;
+
+        if (last != NULL && block_number == goal) {
+            last->length += length;
+            continue;
+        }
+
+        if (num_extents == MAX_FILE_EXTENTS(fs)) {
+            free_block_run(fs, block_number, length);
+            return -1;
+        }
+
+        extents[num_extents].start = block_number;
+        extents[num_extents].length = length;
+        num_extents++;
+    }
+
+    return store_extents(fs, inode, extents, num_extents);
+}
+
+void extent_release(FsContext *fs, Inode *inode) {
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+
+    for (int i = 0; i < num_extents; ++i) {
+        free_block_run(fs, extents[i].start, extents[i].length);
+    }
+
+    if (inode->extent_block != -1) {
+        free_block(fs, inode->extent_block);
+    }
+
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->num_extents = 0;
+    inode->extent_block = -1;
+}
@@ -1,804 +1,2353 @@
-#include "fs.h"
-#include "disk.h"
-#include "fs_errors.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-void mkfs(const char *diskfile) {
-    FILE *fp = fopen(diskfile, "wb+");
-    if (!fp) {
-        fprintf(stderr, "Error: mkfs: cannot open disk file\n");
-        return;
-    }
-
-    strcpy(disk_image, diskfile);
-    sprintf(backup_image, "%s.backup", disk_image);
-
-    char zero[BLOCK_SIZE];
-    memset(zero, 0, sizeof(zero));
-    fwrite(zero, sizeof(zero), 1024, fp);
-
-    SuperBlock sb;
-    sb.magic_number = 0xDEADBEEF;
-    sb.num_blocks = 1024;
-    sb.num_inodes = 1;
-    sb.bitmap_start = 1;
-    sb.inode_start = 2;
-    sb.data_start = 11;
-
-    fseek(fp, 0, SEEK_SET);
-    fwrite(&sb, BLOCK_SIZE, 1, fp);
-
-    Inode root_inode;
-    root_inode.is_valid = 1;
-    root_inode.is_directory = 1;
-    root_inode.owner_id = 150230736;
-    root_inode.size = 0;
-    memset(root_inode.direct_blocks, -1, sizeof(root_inode.direct_blocks));
-
-    int offset = BLOCK_SIZE * sb.inode_start;
-    fseek(fp, offset, SEEK_SET);
-    fwrite(&root_inode, BLOCK_SIZE, 1, fp);
-
-    fclose(fp);
-}
-
-int mkdir_fs(const char *path) {
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("mkdir_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    int token_len = strlen(tokens[depth-1]);
-    if (tokens[depth-1][token_len-1] != '/') {
-        tokens[depth-1][token_len] = '/';
-        tokens[depth-1][token_len+1] = '\0';
-    }
-
-    begin_transaction();
-
-    FILE *disk = fopen(disk_image ,"rb+");
-    if (disk == NULL) {
-        print_error("mkdir_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("mkdir_fs", path, ERR_FORMAT);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    int parent_inode = find_inode_by_path(disk, sb.inode_start, tokens, depth-1);
-    if (parent_inode == -1) {
-        print_error("mkdir_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    if (is_dir_exist(disk, sb.inode_start, parent_inode, tokens[depth-1])) {
-        print_error("mkdir_fs", path, ERR_DIR_EXISTS);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    Inode parent;
-    read_inode(disk, sb.inode_start, parent_inode, &parent);
-
-    DirectoryEntry entries[MAX_ENTRIES];
-    for (int i = 0; i < 4; ++i) {
-        int block_number = parent.direct_blocks[i];
-        if (block_number == -1) {
-            continue;
-        }
-
-        read_block(disk, block_number, entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            DirectoryEntry *entry = &entries[j];
-            
-            if (entry->inode_number == 0) {
-                int new_inode = create_inode(disk, &sb, TYPE_DIR);
-                if (new_inode == -1) {
-                    print_error("mkdir_fs", path, ERR_NO_SPACE);
-                    return -1;
-                }
-
-                entry->inode_number = new_inode;
-                memset(entry->name, 0, sizeof(entry->name));
-                strcpy(entry->name, tokens[depth-1]);
-
-                write_block(disk, block_number, entries);
-
-                parent.size++;
-                write_inode(disk, sb.inode_start, parent_inode, &parent);
-
-                fclose(disk);
-                commit_transaction();
-                return 0;
-            }
-        }
-    }
-
-    char bitmap[BLOCK_SIZE];
-    read_block(disk, sb.bitmap_start, bitmap);
-
-    int bitmap_size = 1024 - sb.data_start;
-
-    for (int i = 0; i < 4; ++i) {
-        if (parent.direct_blocks[i] != -1) {
-            continue;
-        }
-
-        for (int j = 0; j < bitmap_size; ++j) {
-            if (bitmap[j] != 0) {
-                continue;
-            }
-
-            bitmap[j] = 1;
-
-            int new_inode = create_inode(disk, &sb, TYPE_DIR);
-            if (new_inode == -1) {
-                print_error("mkdir_fs", path, ERR_NO_SPACE);
-                fclose(disk);
-                rollback_transaction();
-                return -1;
-            }
-
-            write_block(disk, sb.bitmap_start, bitmap);
-
-            memset(entries, 0, sizeof(entries));
-            entries[0].inode_number = new_inode;
-            strcpy(entries[0].name, tokens[depth-1]);
-
-            int new_block = sb.data_start + j;
-            write_block(disk, new_block, entries);
-
-            parent.direct_blocks[i] = new_block;
-            parent.size++;
-
-            write_inode(disk, sb.inode_start, parent_inode, &parent);
-
-            fclose(disk);
-            commit_transaction();
-            return 0;
-        }
-    }
-
-    print_error("mkdir_fs", path, ERR_NO_SPACE); 
-    fclose(disk);
-    rollback_transaction();
-    return -1;
-}
-
-int create_fs(const char *path) {
-    if (path[strlen(path)-1] == '/') {
-        print_error("create_fs", path, ERR_NO_SUCH_FILE);
-        return -1;
-    }
-
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("create_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    begin_transaction();
-
-    FILE *disk = fopen(disk_image, "rb+");
-    if (disk == NULL) {
-        print_error("create_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("create_fs", path, ERR_FORMAT);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    int parent_inode = find_inode_by_path(disk, sb.inode_start, tokens, depth - 1);
-    if (parent_inode == -1) {
-        print_error("create_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    if (is_file_exist(disk, sb.inode_start, parent_inode, tokens[depth - 1])) {
-        print_error("create_fs", path, ERR_FILE_EXISTS);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    Inode parent;
-    read_inode(disk, sb.inode_start, parent_inode, &parent);
-
-    DirectoryEntry entries[MAX_ENTRIES];
-    for (int i = 0; i < 4; ++i) {
-        int block_number = parent.direct_blocks[i];
-        if (block_number == -1) {
-            continue;
-        }
-
-        read_block(disk, block_number, entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            DirectoryEntry *entry = &entries[j];
-            if (entry->inode_number == 0) {
-                int new_inode = create_inode(disk, &sb, TYPE_FILE);
-                if (new_inode == -1) {
-                    print_error("mkdir_fs", path, ERR_NO_SPACE);
-                    return -1;
-                }
-
-                entry->inode_number = new_inode;
-                memset(entry->name, 0, sizeof(entry->name));
-                strcpy(entry->name, tokens[depth - 1]);
-
-                write_block(disk, block_number, entries);
-
-                parent.size++;
-                write_inode(disk, sb.inode_start, parent_inode, &parent);
-
-                fclose(disk);
-                commit_transaction();
-                return 0;
-            }
-        }
-    }
-
-    char bitmap[BLOCK_SIZE];
-    read_block(disk, sb.bitmap_start, bitmap);
-
-    int bitmap_size = 1024 - sb.data_start;
-
-    for (int i = 0; i < 4; ++i) {
-        if (parent.direct_blocks[i] != -1) {
-            continue;
-        }
-
-        for (int j = 0; j < bitmap_size; ++j) {
-            if (bitmap[j] != 0) {
-                continue;
-            }
-
-            bitmap[j] = 1;
-
-            int new_inode = create_inode(disk, &sb, TYPE_FILE);
-            if (new_inode == -1) {
-                print_error("mkdir_fs", path, ERR_NO_SPACE);
-                fclose(disk);
-                rollback_transaction();
-                return -1;
-            }
-
-            write_block(disk, sb.bitmap_start, bitmap);
-
-            memset(entries, 0, sizeof(entries));
-            entries[0].inode_number = new_inode;
-            strcpy(entries[0].name, tokens[depth - 1]);
-
-            int new_block = sb.data_start + j;
-            write_block(disk, new_block, entries);
-
-            parent.direct_blocks[i] = new_block;
-            parent.size++;
-
-            write_inode(disk, sb.inode_start, parent_inode, &parent);
-
-            fclose(disk);
-            commit_transaction();
-            return 0;
-        }
-    }
-
-    print_error("mkdir_fs", path, ERR_NO_SPACE);
-    fclose(disk);
-    rollback_transaction();
-    return -1;
-}
-
-int write_fs(const char *path, const char *data) {
-
-    if (path[strlen(path)-1] == '/') {
-        print_error("create_fs", path, ERR_NO_SUCH_FILE);
-        return -1;
-    }
-
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("write_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    begin_transaction();
-
-    FILE *disk = fopen(disk_image ,"rb+");
-    if (disk == NULL) {
-        print_error("write_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("write_fs", path, ERR_FORMAT);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    int inode_number = find_inode_by_path(disk, sb.inode_start, tokens, depth);
-    if (inode_number == -1) {
-        print_error("write_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    Inode inode;
-    read_inode(disk, sb.inode_start, inode_number, &inode);
-
-    if (inode.is_directory != 0) {
-        print_error("write_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    int data_size = strlen(data);
-    if (inode.size + data_size > 4 * BLOCK_SIZE) {
-        print_error("write_fs", path, ERR_NO_SPACE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    char bitmap[BLOCK_SIZE];
-    read_block(disk, sb.bitmap_start, bitmap);
-
-    int remaining = data_size;
-
-    int block_index = inode.size / BLOCK_SIZE;
-    int block_offset = inode.size % BLOCK_SIZE;
-
-    while (remaining > 0 && block_index < 4) {
-        int block_number = -1;
-        char block[BLOCK_SIZE];
-
-        if (inode.direct_blocks[block_index] == -1) {
-            int bitmap_size = sb.num_blocks - sb.data_start;
-
-            for (int i = 0; i < bitmap_size; ++i) {
-                if (bitmap[i] == 0) {
-                    bitmap[i] = 1;
-                    block_number = sb.data_start + i;
-                    inode.direct_blocks[block_index] = block_number;
-
-                    memset(block, 0, BLOCK_SIZE);
-
-                    write_block(disk, sb.bitmap_start, bitmap);
-                    break;
-                }
-            }
-
-            if (block_number == -1) {
-                print_error("mkdir_fs", path, ERR_NO_SPACE);
-                fclose(disk);
-                rollback_transaction();
-                return -1;
-            }
-        } else {
-
-            block_number = inode.direct_blocks[block_index];
-            read_block(disk, block_number, block);
-        }
-
-        int space_in_block = BLOCK_SIZE - block_offset;
-        int to_write = remaining < space_in_block ? remaining : space_in_block;
-
-        memcpy(block+block_offset, data, to_write);
-
-        write_block(disk, block_number, block);
-
-        data += to_write;
-        remaining -= to_write;
-        inode.size += to_write;
-
-        block_index++;
-        block_offset = 0;
-    }
-
-    if (remaining > 0) {
-        print_error("mkdir_fs", path, ERR_NO_SPACE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    write_inode(disk, sb.inode_start, inode_number, &inode);
-
-    fclose(disk);
-    commit_transaction();
-    return data_size;
-}
-
-int read_fs(const char *path, char *buf, int bufsize) {
-
-    if (path[strlen(path)-1] == '/') {
-        print_error("create_fs", path, ERR_NO_SUCH_FILE);
-        return -1;
-    }
-
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("read_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    FILE *disk = fopen(disk_image ,"rb+");
-    if (disk == NULL) {
-        print_error("read_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("read_fs", path, ERR_FORMAT);
-        fclose(disk);
-        return -1;
-    }
-
-    int inode_number = find_inode_by_path(disk, sb.inode_start, tokens, depth);
-    if (inode_number == -1) {
-        print_error("read_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        return -1;
-    }
-
-    Inode inode;
-    read_inode(disk, sb.inode_start, inode_number, &inode);
-
-    if (inode.is_directory != 0) {
-        print_error("read_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        return -1;
-    }
-
-    int to_read = inode.size < bufsize ? inode.size : bufsize;
-
-    int read_total = 0;
-    int block_index = 0;
-
-    while (to_read > 0 && block_index < 4) {
-        int block_number = inode.direct_blocks[block_index];
-
-        if (block_number == -1) {
-            break;
-        }
-
-        char block[BLOCK_SIZE];
-        read_block(disk, block_number, block);
-
-        int chunk = to_read < BLOCK_SIZE ? to_read : BLOCK_SIZE;
-
-        memcpy(buf + read_total, block, chunk);
-        read_total += chunk;
-        to_read -= chunk;
-
-        block_index++;
-    }
-
-    buf[read_total] = '\0';
-
-    fclose(disk);
-    return read_total;
-}
-
-int delete_fs(const char *path) {
-
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("delete_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    begin_transaction();
-
-    FILE *disk = fopen(disk_image ,"rb+");
-    if (disk == NULL) {
-        print_error("delete_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("delete_fs", path, ERR_FORMAT);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    int parent_inode = find_inode_by_path(disk, sb.inode_start, tokens, depth-1);
-    if (parent_inode == -1) {
-        print_error("delete_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    Inode parent;
-    read_inode(disk, sb.inode_start, parent_inode, &parent);
-
-    Inode inode;
-    int inode_number = -1;
-
-    DirectoryEntry entries[MAX_ENTRIES];
-
-    for (int i = 0; i < 4; ++i) {
-        int block_number = parent.direct_blocks[i];
-        if (block_number == -1) {
-            continue;
-        }
-
-        read_block(disk, block_number, entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            DirectoryEntry *entry = &entries[j];
-            if (entry->inode_number != 0 && strcmp(entry->name, tokens[depth-1]) == 0) {
-                inode_number = entry->inode_number;
-                read_inode(disk, sb.inode_start, inode_number, &inode);
-
-                if (inode.is_directory != 0) {
-                    inode_number = -1;
-                    continue;
-                }
-
-                entry->inode_number = 0;
-                break;
-            }
-        }
-
-        if (inode_number != -1) {
-
-            write_block(disk, block_number, entries);
-            break;
-        }
-    }
-
-    if (inode_number == -1) {
-        print_error("delete_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    char bitmap[BLOCK_SIZE];
-    read_block(disk, sb.bitmap_start, &bitmap);
-
-    for (int i = 0; i < 4; ++i) {
-        int block_number = inode.direct_blocks[i];
-        if (block_number != -1) {
-            bitmap[block_number - sb.data_start] = 0;
-        }
-    }
-
-    write_block(disk, sb.bitmap_start, bitmap);
-
-    inode.is_valid = 0;
-    inode.size = 0;
-    memset(inode.direct_blocks, -1, sizeof(inode.direct_blocks));
-
-    write_inode(disk, sb.inode_start, inode_number, &inode);
-
-    parent.size--;
-    write_inode(disk, sb.inode_start, parent_inode, &parent);
-
-    sb.num_inodes--;
-    write_superblock(disk, &sb);
-
-    fclose(disk);
-
-    commit_transaction();
-    return 0;
-}
-
-int rmdir_fs(const char *path) {
-
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("rmdir_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    int token_len = strlen(tokens[depth-1]);
-    if (tokens[depth-1][token_len-1] != '/') {
-        tokens[depth-1][token_len] = '/';
-        tokens[depth-1][token_len+1] = '\0';
-    }
-
-    begin_transaction();
-
-    FILE *disk = fopen(disk_image ,"rb+");
-    if (disk == NULL) {
-        print_error("rmdir_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("rmdir_fs", path, ERR_FORMAT);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    int parent_inode = find_inode_by_path(disk, sb.inode_start, tokens, depth-1);
-    if (parent_inode == -1) {
-        print_error("rmdir_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    Inode parent;
-    read_inode(disk, sb.inode_start, parent_inode, &parent);
-
-    Inode inode;
-    int inode_number = -1;
-
-    DirectoryEntry entries[MAX_ENTRIES];
-
-    for (int i = 0; i < 4; ++i) {
-        int block_number = parent.direct_blocks[i];
-        if (block_number == -1) {
-            continue;
-        }
-
-        read_block(disk, block_number, entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            DirectoryEntry *entry = &entries[j];
-            if (entry->inode_number != 0 && strcmp(entry->name, tokens[depth-1]) == 0) {
-                inode_number = entry->inode_number;
-                read_inode(disk, sb.inode_start, inode_number, &inode);
-
-                if (inode.is_directory != 1) {
-                    inode_number = -1;
-                    continue;
-                }
-
-                entry->inode_number = 0;
-                break;
-            }
-        }
-
-        if (inode_number != -1) {
-
-            write_block(disk, block_number, entries);
-            break;
-        }
-    }
-
-    if (inode_number == -1) {
-        print_error("rmdir_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    if (inode.size > 0) {
-        print_error("rmdir_fs", path, ERR_DIR_NOT_EMPTY);
-        fclose(disk);
-        rollback_transaction();
-        return -1;
-    }
-
-    char bitmap[BLOCK_SIZE];
-    read_block(disk, sb.bitmap_start, &bitmap);
-
-    for (int i = 0; i < 4; ++i) {
-        int block_number = inode.direct_blocks[i];
-        if (block_number != -1) {
-            bitmap[block_number - sb.data_start] = 0;
-        }
-    }
-
-    write_block(disk, sb.bitmap_start, bitmap);
-
-    inode.is_valid = 0;
-    inode.size = 0;
-    memset(inode.direct_blocks, -1, sizeof(inode.direct_blocks));
-
-    write_inode(disk, sb.inode_start, inode_number, &inode);
-
-    parent.size--;
-    write_inode(disk, sb.inode_start, parent_inode, &parent);
-
-    sb.num_inodes--;
-    write_superblock(disk, &sb);
-
-    fclose(disk);
-
-    commit_transaction();
-    return 0;
-}
-
-int ls_fs(const char *path, DirectoryEntry *entries, int max_entries) {
-
-    char tokens[MAX_DEPTH][TOKEN_LEN];
-    int depth = tokenize_path(path, tokens);
-    if (depth == -1) {
-        print_error("ls_fs", path, ERR_PATH);
-        return -1;
-    }
-
-    int token_len = strlen(tokens[depth-1]);
-    if (tokens[depth-1][token_len-1] != '/') {
-        tokens[depth-1][token_len] = '/';
-        tokens[depth-1][token_len+1] = '\0';
-    }
-
-    FILE *disk = fopen(disk_image ,"rb+");
-    if (disk == NULL) {
-        print_error("ls_fs", path, ERR_DISK);
-        return -1;
-    }
-
-    SuperBlock sb;
-    if (read_superblock(disk, &sb) != 0) {
-        print_error("ls_fs", path, ERR_FORMAT);
-        fclose(disk);
-        return -1;
-    }
-
-    int inode_number = find_inode_by_path(disk, sb.inode_start, tokens, depth);
-    if (inode_number == -1) {
-        print_error("ls_fs", path, ERR_NO_SUCH_FILE);
-        fclose(disk);
-        return -1;
-    }
-
-    Inode inode;
-    read_inode(disk, sb.inode_start, inode_number, &inode);
-
-    int num_entries = 0;
-    DirectoryEntry block_entries[MAX_ENTRIES];
-
-    for (int i = 0; i < 4 && num_entries < max_entries; ++i) {
-        int block_num = inode.direct_blocks[i];
-        if (block_num == -1) {
-            continue;
-        }
-
-        read_block(disk, block_num, block_entries);
-
-        for (int j = 0; j < MAX_ENTRIES; ++j) {
-            if (block_entries[j].inode_number != 0) {
-                entries[num_entries++] = block_entries[j];
-
-                if (num_entries == max_entries) {
-                    break;
-                }
-            }
-        }
-    }
-
-    fclose(disk);
-    return num_entries;
-}
+#include "fs.h"
+#include "disk.h"
+#include "bitmap.h"
+#include "dir.h"
+#include "extent.h"
+#include "group.h"
+#include "upgrade.h"
+#include "fs_errors.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+
+static char disk_image[MAX_PATH_SIZE] = "disk.img";
+
+#define FLUSH_METADATA_BLOCKS 8 // journal room a flush leaves besides data
+
+void fs_default_options(MountOptions *options) {
+    options->backend = BACKEND_PREAD;
+    options->aio_engine = AIO_ENGINE_URING;
+    options->cache_frames = CACHE_FRAMES;
+    options->dcache_entries = DCACHE_ENTRIES;
+    options->listing_dirs = LISTING_DIRS;
+    options->commit_ops = 1;
+    options->commit_ms = 0;
+    options->thread_safe = 0;
+    options->image_lock = IMAGE_LOCK_EXCLUSIVE;
+}
+
+ErrorCode fs_mount(const char *diskfile, FsContext *fs) {
+    MountOptions options;
+    fs_default_options(&options);
+
+    return fs_mount_with(diskfile, &options, fs);
+}
+
+static void *commit_main(void *arg);
+
+static void init_locks(FsContext *fs) {
+    rwlock_init(&fs->names, fs->thread_safe);
+    for (int i = 0; i < FS_FILE_LOCKS; ++i) {
+        rwlock_init(&fs->file_locks[i], fs->thread_safe);
+    }
+    mutex_init(&fs->transaction, fs->thread_safe);
+    mutex_init(&fs->async, fs->thread_safe);
+}
+
+static void destroy_locks(FsContext *fs) {
+    rwlock_destroy(&fs->names);
+    for (int i = 0; i < FS_FILE_LOCKS; ++i) {
+        rwlock_destroy(&fs->file_locks[i]);
+    }
+    mutex_destroy(&fs->transaction);
+    mutex_destroy(&fs->async);
+}
+
+// Starts the thread that commits a group whose time is up while no call
+// comes in to do it.
+static void start_committer(FsContext *fs) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fs->commit_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    fs->committer_stop = 0;
+    fs->committer_running = pthread_create(&fs->committer, NULL, commit_main, fs) == 0;
+    if (!fs->committer_running) {
+        pthread_cond_destroy(&fs->commit_wake);
+    }
+}
+
+static void stop_committer(FsContext *fs) {
+    if (!fs->committer_running) {
+        return;
+    }
+
+    mutex_lock(&fs->transaction);
+    fs->committer_stop = 1;
+    pthread_cond_signal(&fs->commit_wake);
+    mutex_unlock(&fs->transaction);
+
+    pthread_join(fs->committer, NULL);
+    pthread_cond_destroy(&fs->commit_wake);
+    fs->committer_running = 0;
+}
+
+ErrorCode fs_mount_with(const char *diskfile, const MountOptions *options, FsContext *fs) {
+    memset(fs, 0, sizeof(*fs));
+    snprintf(fs->image, sizeof(fs->image), "%s", diskfile);
+    fs->thread_safe = options->thread_safe;
+
+    MountOptions opened = *options;
+    if (fs->thread_safe && (opened.backend == BACKEND_STDIO || opened.backend == BACKEND_URING)) {
+        // a FILE position and the synchronous ring belong to one caller at a time
+        opened.backend = BACKEND_PREAD;
+    }
+
+    do {
+        if (image_lock_open(&fs->image_lock, diskfile, 0) != 0 || image_lock(&fs->image_lock, options->image_lock) != 0) {
+            image_lock_close(&fs->image_lock);
+            return ERR_DISK;
+        }
+        if (!image_lock_moved(&fs->image_lock, diskfile)) {
+            break;
+        }
+        image_lock_close(&fs->image_lock);
+    } while (1);
+
+    if (disk_open(fs, &opened) != 0) {
+        image_lock_close(&fs->image_lock);
+        return ERR_DISK;
+    }
+
+    int ret = read_superblock(fs);
+    if (ret != 0 && legacy_version(&fs->dev) != 0) {
+        // an image from before block groups is copied into the current format
+        // once, then mounted like any other
+        disk_close(fs);
+        image_lock_close(&fs->image_lock);
+        if (upgrade_image(diskfile) != 0) {
+            return ERR_FORMAT;
+        }
+        return fs_mount_with(diskfile, options, fs);
+    }
+
+    int shared = fs->image_lock.mode == IMAGE_LOCK_SHARED;
+    if (ret == 0) {
+        ret = open_journal(fs, !shared);
+    }
+
+    if (ret == 1) {
+        // a crash left a transaction to replay, and replaying writes: let the
+        // shared lock go, replay with the image to ourselves, share it again
+        ret = image_lock(&fs->image_lock, IMAGE_LOCK_NONE) != 0 ||
+              image_lock(&fs->image_lock, IMAGE_LOCK_EXCLUSIVE) != 0 ||
+              open_journal(fs, 1) != 0 ||
+              image_lock(&fs->image_lock, IMAGE_LOCK_SHARED) != 0 ? -1 : 0;
+    }
+
+    if (ret != 0 || read_groups(fs) != 0) {
+        disk_close(fs);
+        image_lock_close(&fs->image_lock);
+        return ERR_FORMAT;
+    }
+
+    fs->journal.group_ops = options->commit_ops > 1 ? options->commit_ops : 1;
+    fs->journal.group_ms = options->commit_ms > 0 ? options->commit_ms : 0;
+
+    delalloc_init(&fs->delalloc);
+    readahead_init(&fs->readahead, fs->sb.block_size);
+    if (fs->thread_safe) {
+        // a file's stream position means nothing to readers on several threads
+        fs->readahead.max_window = 0;
+    }
+
+    for (int i = 0; i < FS_OPEN_FILES; ++i) {
+        fs->files[i].inode_number = -1;
+    }
+
+    init_locks(fs);
+    if (fs->thread_safe && fs->journal.group_ops > 1 && fs->journal.group_ms > 0) {
+        start_committer(fs);
+    }
+
+    return ERR_NONE;
+}
+
+// Whether path cannot name a file: empty, or ending in '/'.
+static int names_no_file(const char *path) {
+    size_t length = strlen(path);
+    return length == 0 || path[length - 1] == '/';
+}
+
+// Writes data at the end of the file whose block map is extents, growing it
+// first when the bytes reach past the blocks it already maps. The caller
+// stores the inode.
+static int append_mapped(FsContext *fs, int inode_number, Inode *inode, Extent *extents, int *num_extents,
+                         const char *data, int data_size) {
+    int block_size = fs->sb.block_size;
+
+    readahead_forget(&fs->readahead, &fs->dev, inode_number);
+
+    int allocated = extent_blocks(extents, *num_extents);
+    int needed = (inode->size + data_size + block_size - 1) / block_size;
+
+    if (needed > allocated) {
+        if (extent_grow(fs, inode_number, inode, needed - allocated) != 0) {
+            return -1;
+        }
+        *num_extents = extent_list(fs, inode, extents);
+    }
+
+    int remaining = data_size;
+
+    while (remaining > 0) {
+        int run;
+        int block_number = extent_lookup(extents, *num_extents, inode->size / block_size, &run);
+        int block_offset = inode->size % block_size;
+        int chunk;
+
+        if (block_offset == 0 && remaining >= block_size) {
+            // whole blocks of one extent go down together
+            int count = remaining / block_size < run ? remaining / block_size : run;
+            write_blocks(fs, block_number, count, data);
+            chunk = count * block_size;
+        } else {
+            char block[block_size];
+            if (block_offset == 0) {
+                memset(block, 0, block_size);
+            } else {
+                read_block(fs, block_number, block);
+            }
+
+            int space_in_block = block_size - block_offset;
+            chunk = remaining < space_in_block ? remaining : space_in_block;
+
+            memcpy(block + block_offset, data, chunk);
+            write_block(fs, block_number, block);
+        }
+
+        data += chunk;
+        remaining -= chunk;
+        inode->size += chunk;
+    }
+
+    return 0;
+}
+
+// append_mapped for a file whose map is not at hand; stores the inode.
+static int append_data(FsContext *fs, int inode_number, Inode *inode, const char *data, int data_size) {
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+
+    if (append_mapped(fs, inode_number, inode, extents, &num_extents, data, data_size) != 0) {
+        return -1;
+    }
+
+    write_inode(fs, inode_number, inode);
+    return 0;
+}
+
+static OpenFile *find_open_file(FsContext *fs, int inode_number) {
+    for (int i = 0; i < FS_OPEN_FILES; ++i) {
+        if (fs->files[i].inode_number == inode_number) {
+            return &fs->files[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Why commit_transaction failed: the operation needed more than the journal
+// takes, or an earlier commit failed and the mount takes no more changes.
+static ErrorCode commit_error(const FsContext *fs) {
+    return fs->commit_failed ? ERR_COMMIT : ERR_NO_SPACE;
+}
+
+static void write_back(FsContext *fs, OpenFile *file) {
+    begin_transaction(fs);
+    write_inode(fs, file->inode_number, &file->inode);
+    if (commit_transaction(fs) != 0) {
+        return;
+    }
+
+    file->dirty = 0;
+    fs->file_stats.writebacks++;
+}
+
+// Handles keep their inode in memory; a call by path writes it back before
+// reading the file's inode, and marks it stale once it has changed the file.
+static void sync_open_file(FsContext *fs, int inode_number) {
+    OpenFile *file = find_open_file(fs, inode_number);
+    if (file != NULL && file->dirty) {
+        write_back(fs, file);
+    }
+}
+
+static void invalidate_open_file(FsContext *fs, int inode_number) {
+    OpenFile *file = find_open_file(fs, inode_number);
+    if (file != NULL) {
+        file->stale = 1;
+    }
+}
+
+// Gives a file's buffered appends their blocks, as few runs as the free space
+// allows. Each piece is a transaction that fits one journal pass, the file
+// whole up to its end; the buffer is released either way.
+static int flush_pending(FsContext *fs, PendingWrite *pending) {
+    sync_open_file(fs, pending->inode_number);
+
+    // room for the inode, bitmaps, group descriptors and extent blocks
+    int piece_blocks = journal_pass_blocks(&fs->journal) - FLUSH_METADATA_BLOCKS;
+    int piece = (piece_blocks > 0 ? piece_blocks : 1) * fs->sb.block_size;
+
+    Inode inode;
+    read_inode(fs, pending->inode_number, &inode);
+    int num_extents = inode.num_extents;
+
+    for (int done = 0; done < pending->length; done += piece) {
+        int length = pending->length - done < piece ? pending->length - done : piece;
+
+        begin_transaction(fs);
+        read_inode(fs, pending->inode_number, &inode);
+
+        if (append_data(fs, pending->inode_number, &inode, pending->data + done, length) != 0) {
+            print_error("write_fs", pending->path, ERR_NO_SPACE);
+            rollback_transaction(fs);
+            delalloc_drop(&fs->delalloc, pending);
+            return -1;
+        }
+
+        if (commit_transaction(fs) != 0) {
+            print_error("write_fs", pending->path, commit_error(fs));
+            delalloc_drop(&fs->delalloc, pending);
+            return -1;
+        }
+    }
+
+    invalidate_open_file(fs, pending->inode_number);
+
+    fs->delalloc.stats.flushes++;
+    fs->delalloc.stats.extents += inode.num_extents - num_extents;
+    delalloc_drop(&fs->delalloc, pending);
+    return 0;
+}
+
+static int flush_all_pending(FsContext *fs) {
+    int ret = 0;
+
+    for (int i = 0; i < DELALLOC_FILES; ++i) {
+        PendingWrite *pending = &fs->delalloc.files[i];
+        if (pending->inode_number != -1 && flush_pending(fs, pending) != 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+// Locks for a call that changes a directory or the handle table: every other
+// call waits, and the committer too. Listings read without the lock are
+// thrown away if names_seq moved while they were copied.
+static void lock_names(FsContext *fs) {
+    rwlock_write(&fs->names);
+    mutex_lock(&fs->transaction);
+    seq_write_begin(&fs->names_seq);
+}
+
+static void unlock_names(FsContext *fs) {
+    seq_write_end(&fs->names_seq);
+    mutex_unlock(&fs->transaction);
+    rwlock_unlock(&fs->names);
+}
+
+static RwLock *file_lock(FsContext *fs, int inode_number) {
+    return &fs->file_locks[(unsigned int)inode_number % FS_FILE_LOCKS];
+}
+
+// Locks a file the call changes: exclusive, then the transaction.
+static void lock_file_write(FsContext *fs, int inode_number) {
+    rwlock_write(file_lock(fs, inode_number));
+    mutex_lock(&fs->transaction);
+}
+
+static void unlock_file_write(FsContext *fs, int inode_number) {
+    mutex_unlock(&fs->transaction);
+    rwlock_unlock(file_lock(fs, inode_number));
+}
+
+// Whether a reader of the file has to write something out first: appends
+// waiting for blocks, and for a call by path an inode a handle changed, for a
+// handle the file changed by a call by path.
+static int unsettled(FsContext *fs, int inode_number, const OpenFile *handle) {
+    if (delalloc_find(&fs->delalloc, inode_number) != NULL) {
+        return 1;
+    }
+
+    if (handle != NULL) {
+        return handle->stale;
+    }
+
+    OpenFile *file = find_open_file(fs, inode_number);
+    return file != NULL && file->dirty;
+}
+
+static void reload(FsContext *fs, OpenFile *file);
+
+// Brings the image, or the handle, up to date with the file; the caller holds
+// it exclusive and the transaction.
+static void settle(FsContext *fs, int inode_number, OpenFile *handle) {
+    PendingWrite *pending = delalloc_find(&fs->delalloc, inode_number);
+    if (pending != NULL) {
+        flush_pending(fs, pending);
+    }
+
+    if (handle == NULL) {
+        sync_open_file(fs, inode_number);
+    } else if (handle->stale) {
+        reload(fs, handle);
+    }
+}
+
+// Locks a file the call reads, shared. One with something to write out first
+// is taken exclusive instead, settled, and stays exclusive for the call. The
+// appends and the handle table change under the transaction, for other files
+// too (an append can push this file's out of the table), so they are looked
+// at under it; once this file is settled, only a writer of it, which waits
+// for the shared lock, can unsettle it.
+static void lock_file_read(FsContext *fs, int inode_number, OpenFile *handle) {
+    RwLock *lock = file_lock(fs, inode_number);
+
+    rwlock_read(lock);
+    mutex_lock(&fs->transaction);
+    int ret = unsettled(fs, inode_number, handle);
+    mutex_unlock(&fs->transaction);
+    if (!ret) {
+        return;
+    }
+    rwlock_unlock(lock);
+
+    lock_file_write(fs, inode_number);
+    settle(fs, inode_number, handle);
+    mutex_unlock(&fs->transaction);
+}
+
+// Returns -1 when changes that had been reported done never reached the
+// image, here or at an earlier commit.
+int fs_unmount(FsContext *fs) {
+    stop_committer(fs);
+
+    int ret = 0;
+    if (fs->dev.ops != NULL) {
+        while (fs->reads_in_flight > 0) {
+            fs_poll(fs, 1);
+        }
+
+        for (int i = 0; i < FS_OPEN_FILES; ++i) {
+            OpenFile *file = &fs->files[i];
+            if (file->inode_number != -1 && file->dirty && !fs->commit_failed) {
+                write_back(fs, file);
+            }
+            free(file->extents);
+        }
+
+        if (!fs->commit_failed) {
+            flush_all_pending(fs);
+        }
+        ret = sync_transaction(fs);
+        if (ret != 0) {
+            print_error("unmount", fs->image, ERR_COMMIT);
+        }
+        readahead_destroy(&fs->readahead, &fs->dev);
+    }
+
+    delalloc_destroy(&fs->delalloc);
+    disk_close(fs);
+    destroy_locks(fs);
+    image_lock_close(&fs->image_lock);
+    return ret;
+}
+
+// Returns -1, as fs_unmount does, once a commit has failed.
+int fs_sync(FsContext *fs) {
+    lock_names(fs);
+
+    for (int i = 0; i < FS_OPEN_FILES; ++i) {
+        if (fs->files[i].inode_number != -1 && fs->files[i].dirty) {
+            write_back(fs, &fs->files[i]);
+        }
+    }
+
+    flush_all_pending(fs);
+    int ret = sync_transaction(fs);
+    if (ret != 0) {
+        print_error("sync_fs", fs->image, ERR_COMMIT);
+    }
+    flush_blocks(fs);
+
+    unlock_names(fs);
+    return ret;
+}
+
+// Commits the operations waiting for a group commit once they are due, so
+// that none waits past commit_ms. Calls check this on the way in; a process
+// that goes idle calls it, or fs_sync, to keep the bound. A thread-safe mount
+// has a thread of its own doing this.
+void fs_commit_due(FsContext *fs) {
+    mutex_lock(&fs->transaction);
+    if (fs->journal.active && !fs->batch && journal_due(&fs->journal)) {
+        sync_transaction(fs);
+    }
+    mutex_unlock(&fs->transaction);
+}
+
+static void *commit_main(void *arg) {
+    FsContext *fs = arg;
+
+    pthread_mutex_lock(&fs->transaction.lock);
+
+    while (!fs->committer_stop) {
+        if (fs->journal.active && !fs->batch && journal_due(&fs->journal)) {
+            sync_transaction(fs);
+        }
+
+        if (fs->journal.ops == 0) {
+            // nothing waits: sleep until a group starts
+            pthread_cond_wait(&fs->commit_wake, &fs->transaction.lock);
+            continue;
+        }
+
+        long long due = fs->journal.first_ns + fs->journal.group_ms * 1000000LL;
+        struct timespec deadline = { due / 1000000000LL, due % 1000000000LL };
+        pthread_cond_timedwait(&fs->commit_wake, &fs->transaction.lock, &deadline);
+    }
+
+    pthread_mutex_unlock(&fs->transaction.lock);
+    return NULL;
+}
+
+// Starts running every call as part of one transaction, committed by
+// fs_end_batch. Appends and handle inodes from before are written out first,
+// so that a failed batch takes nothing older with it.
+void fs_begin_batch(FsContext *fs) {
+    fs_sync(fs);
+
+    mutex_lock(&fs->transaction);
+    begin_transaction(fs);
+    fs->batch = 1;
+    fs->batch_failed = 0;
+    mutex_unlock(&fs->transaction);
+}
+
+int fs_batch_failed(const FsContext *fs) {
+    return fs->batch_failed;
+}
+
+// Commits the batch, or returns -1 when a call in it rolled back or commit is
+// 0, in which case none of the batch reaches the image.
+int fs_end_batch(FsContext *fs, int commit) {
+    mutex_lock(&fs->transaction);
+
+    if (!commit) {
+        fs->batch_failed = 1;
+    }
+
+    if (!fs->batch_failed) {
+        for (int i = 0; i < FS_OPEN_FILES; ++i) {
+            if (fs->files[i].inode_number != -1 && fs->files[i].dirty) {
+                write_back(fs, &fs->files[i]);
+            }
+        }
+
+        flush_all_pending(fs);
+    }
+
+    fs->batch = 0;
+
+    if (fs->batch_failed) {
+        rollback_transaction(fs);
+
+        // what the batch buffered or cached never happened
+        for (int i = 0; i < DELALLOC_FILES; ++i) {
+            if (fs->delalloc.files[i].inode_number != -1) {
+                delalloc_drop(&fs->delalloc, &fs->delalloc.files[i]);
+            }
+        }
+
+        for (int i = 0; i < FS_OPEN_FILES; ++i) {
+            fs->files[i].dirty = 0;
+            fs->files[i].stale = 1;
+        }
+
+        mutex_unlock(&fs->transaction);
+        return -1;
+    }
+
+    int ret = commit_transaction(fs) != 0 || sync_transaction(fs) != 0 ? -1 : 0;
+    mutex_unlock(&fs->transaction);
+    return ret;
+}
+
+void fs_cache_stats(const FsContext *fs, CacheStats *stats) {
+    *stats = fs->cache.stats;
+}
+
+void fs_dcache_stats(const FsContext *fs, DentryStats *stats) {
+    *stats = fs->dcache.stats;
+}
+
+void fs_listing_stats(const FsContext *fs, ListingStats *stats) {
+    *stats = fs->listing.stats;
+}
+
+void fs_delalloc_stats(const FsContext *fs, DelallocStats *stats) {
+    *stats = fs->delalloc.stats;
+}
+
+void fs_io_stats(const FsContext *fs, BlockDeviceStats *stats) {
+    *stats = fs->dev.stats;
+}
+
+void fs_aio_stats(const FsContext *fs, AioStats *stats) {
+    *stats = fs->dev.aio.stats;
+}
+
+void fs_readahead_stats(const FsContext *fs, ReadaheadStats *stats) {
+    *stats = fs->readahead.stats;
+}
+
+void fs_open_file_stats(const FsContext *fs, OpenFileStats *stats) {
+    *stats = fs->file_stats;
+}
+
+void fs_journal_stats(const FsContext *fs, JournalStats *stats) {
+    *stats = fs->journal.stats;
+}
+
+void fs_image_lock_stats(const FsContext *fs, ImageLockStats *stats) {
+    *stats = fs->image_lock.stats;
+}
+
+static int mount_for(const char *command, const char *path, ImageLockMode lock, FsContext *fs) {
+    MountOptions options;
+    fs_default_options(&options);
+    options.image_lock = lock;
+
+    ErrorCode code = fs_mount_with(disk_image, &options, fs);
+    if (code != ERR_NONE) {
+        print_error(command, path, code);
+        return -1;
+    }
+
+    return 0;
+}
+
+void mkfs_default_options(MkfsOptions *options) {
+    options->image_size = DEFAULT_IMAGE_SIZE;
+    options->block_size = DEFAULT_BLOCK_SIZE;
+    options->inode_ratio = DEFAULT_INODE_RATIO;
+}
+
+void mkfs(const char *diskfile) {
+    MkfsOptions options;
+    mkfs_default_options(&options);
+
+    mkfs_with(diskfile, &options);
+}
+
+// a sixteenth of the image, at least 64 blocks and at most 64 MiB
+static int journal_size(long long num_blocks, int block_size) {
+    long long blocks = num_blocks / 16;
+    long long max_blocks = (64LL * 1024 * 1024) / block_size;
+
+    if (blocks > max_blocks) {
+        blocks = max_blocks;
+    }
+    if (blocks < 64) {
+        blocks = num_blocks / 4 < 64 ? num_blocks / 4 : 64;
+    }
+
+    return blocks;
+}
+
+// Lays the image out as superblock, group descriptor table, journal, then
+// the block groups. A group spans one bitmap block's worth of data blocks and
+// starts with its block bitmap, inode bitmap and inode table.
+static int plan_layout(const MkfsOptions *options, SuperBlock *sb) {
+    int block_size = options->block_size;
+    if (block_size != 1024 && block_size != 4096 && block_size != 65536) {
+        return -1;
+    }
+
+    long long num_blocks = options->image_size / block_size;
+    if (num_blocks > INT_MAX || options->inode_ratio < MIN_BLOCK_SIZE) {
+        return -1;
+    }
+
+    int inodes_per_block = block_size / sizeof(Inode);
+    int bits_per_block = block_size * 8;
+    int groups_per_block = block_size / sizeof(GroupDesc);
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic_number = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_size = block_size;
+    sb->num_blocks = num_blocks;
+    sb->num_inodes = 1;
+    sb->journal_blocks = journal_size(num_blocks, block_size);
+    sb->blocks_per_group = bits_per_block;
+
+    // the descriptor table is sized for the groups that would fit without it,
+    // which is never fewer than fit once it is placed
+    long long group_blocks = num_blocks - 1 - sb->journal_blocks;
+    long long num_groups = (group_blocks - 1 + bits_per_block - 1) / bits_per_block;
+    sb->gdt_blocks = (num_groups + groups_per_block - 1) / groups_per_block;
+    num_groups = (group_blocks - sb->gdt_blocks + bits_per_block - 1) / bits_per_block;
+    group_blocks -= sb->gdt_blocks;
+    if (num_groups < 1 || sb->journal_blocks < 4) {
+        return -1;
+    }
+
+    // the image's inode budget is shared out evenly; a short last group that
+    // cannot hold its metadata and a data block is left unused
+    long long total_inodes = options->image_size / options->inode_ratio;
+    if (total_inodes > MAX_INODE_NUMBER + 1) {
+        total_inodes = MAX_INODE_NUMBER + 1;
+    }
+
+    for (;;) {
+        if (num_groups < 1) {
+            return -1;
+        }
+
+        long long inodes_per_group = (total_inodes + num_groups - 1) / num_groups;
+        inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+        if (inodes_per_group < inodes_per_block) {
+            inodes_per_group = inodes_per_block;
+        }
+        if (inodes_per_group > bits_per_block) {
+            inodes_per_group = bits_per_block;
+        }
+        if (num_groups * inodes_per_group > MAX_INODE_NUMBER + 1) {
+            inodes_per_group -= inodes_per_block;
+        }
+
+        sb->inodes_per_group = inodes_per_group;
+        sb->inode_table_blocks = inodes_per_group / inodes_per_block;
+
+        long long last_blocks = group_blocks - (num_groups - 1) * bits_per_block;
+        if (last_blocks >= 3 + sb->inode_table_blocks) {
+            break;
+        }
+        num_groups--;
+    }
+
+    sb->num_groups = num_groups;
+    sb->total_inodes = num_groups * sb->inodes_per_group;
+
+    sb->gdt_start = 1;
+    sb->journal_start = sb->gdt_start + sb->gdt_blocks;
+    sb->group_start = sb->journal_start + sb->journal_blocks;
+
+    return 0;
+}
+
+static void write_image_block(FILE *fp, int block_size, int block_number, const void *block) {
+    fseeko(fp, (off_t)block_number * block_size, SEEK_SET);
+    fwrite(block, block_size, 1, fp);
+}
+
+static int write_image(const char *diskfile, const MkfsOptions *options) {
+    SuperBlock sb;
+    if (plan_layout(options, &sb) != 0) {
+        fprintf(stderr, "Error: mkfs: invalid image geometry\n");
+        return -1;
+    }
+
+    FILE *fp = fopen(diskfile, "wb+");
+    if (!fp) {
+        fprintf(stderr, "Error: mkfs: cannot open disk file\n");
+        return -1;
+    }
+
+    snprintf(disk_image, sizeof(disk_image), "%s", diskfile);
+
+    // the image is one sparse file; every block mkfs does not write below
+    // reads back as zeros, so formatting costs the same at any size
+    int block_size = sb.block_size;
+    if (ftruncate(fileno(fp), (off_t)sb.num_blocks * block_size) != 0) {
+        fprintf(stderr, "Error: mkfs: cannot size disk file\n");
+        fclose(fp);
+        return -1;
+    }
+
+    char *block = calloc(1, block_size);
+    if (block == NULL) {
+        fclose(fp);
+        return -1;
+    }
+
+    JournalHeader header;
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = 1;
+
+    memcpy(block, &header, sizeof(header));
+    write_image_block(fp, block_size, sb.journal_start, block);
+
+    // every group starts out uninitialised; group 0 only has the root inode written
+    GroupDesc *groups = calloc(sb.gdt_blocks, block_size);
+    if (groups == NULL) {
+        free(block);
+        fclose(fp);
+        return -1;
+    }
+
+    for (int i = 0; i < sb.num_groups; ++i) {
+        long long group_end = (long long)sb.group_start + (long long)(i + 1) * sb.blocks_per_group;
+        if (group_end > sb.num_blocks) {
+            group_end = sb.num_blocks;
+        }
+
+        long long data_start = (long long)sb.group_start + (long long)i * sb.blocks_per_group + 2 + sb.inode_table_blocks;
+        groups[i].data_blocks = group_end - data_start;
+        groups[i].free_blocks = groups[i].data_blocks;
+        groups[i].free_inodes = sb.inodes_per_group;
+        groups[i].flags = GROUP_BLOCK_UNINIT | GROUP_INODE_UNINIT | GROUP_ITABLE_UNINIT;
+    }
+
+    groups[0].free_inodes--;
+    groups[0].flags &= ~GROUP_INODE_UNINIT;
+    groups[0].inode_table_init = 1;
+    if (sb.inode_table_blocks == 1) {
+        groups[0].flags &= ~GROUP_ITABLE_UNINIT;
+    }
+
+    for (int i = 0; i < sb.gdt_blocks; ++i) {
+        write_image_block(fp, block_size, sb.gdt_start + i, (char *)groups + (size_t)i * block_size);
+    }
+    free(groups);
+
+    Inode root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
+    root_inode.is_valid = 1;
+    root_inode.is_directory = 1;
+    root_inode.owner_id = 150230736;
+    root_inode.extent_block = -1;
+    memset(root_inode.direct_blocks, -1, sizeof(root_inode.direct_blocks));
+
+    int group_start = sb.group_start;
+
+    memset(block, 0, block_size);
+    memcpy(block, &root_inode, sizeof(root_inode));
+    write_image_block(fp, block_size, group_start + 2, block);
+
+    memset(block, 0, block_size);
+    block[0] = 1; // root inode
+    write_image_block(fp, block_size, group_start + 1, block);
+
+    memset(block, 0, block_size);
+    memcpy(block, &sb, sizeof(sb));
+    write_image_block(fp, block_size, 0, block);
+
+    free(block);
+    fclose(fp);
+    return 0;
+}
+
+// Waits for mounts in other processes to finish before cutting the image
+// away under them.
+int mkfs_with(const char *diskfile, const MkfsOptions *options) {
+    ImageLock lock;
+    if (image_lock_open(&lock, diskfile, 1) != 0 || image_lock(&lock, IMAGE_LOCK_EXCLUSIVE) != 0) {
+        fprintf(stderr, "Error: mkfs: cannot open disk file\n");
+        image_lock_close(&lock);
+        return -1;
+    }
+
+    int ret = write_image(diskfile, options);
+    image_lock_close(&lock);
+    return ret;
+}
+
+// A shared mount leaves the image as it found it, and so does one that lost
+// a commit.
+static int check_writable(FsContext *fs, const char *command, const char *path) {
+    if (fs->image_lock.mode == IMAGE_LOCK_SHARED) {
+        print_error(command, path, ERR_READ_ONLY);
+        return -1;
+    }
+    if (__atomic_load_n(&fs->commit_failed, __ATOMIC_RELAXED)) {
+        print_error(command, path, ERR_COMMIT);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int make_dir(FsContext *fs, const char *path) {
+    char tokens[MAX_DEPTH][TOKEN_LEN];
+    int depth = tokenize_path(path, tokens);
+    if (depth == -1) {
+        print_error("mkdir_fs", path, ERR_PATH);
+        return -1;
+    }
+    if (depth == 0) {
+        // "/" is the root, there from mkfs on
+        print_error("mkdir_fs", path, ERR_DIR_EXISTS);
+        return -1;
+    }
+
+    int token_len = strlen(tokens[depth-1]);
+    if (tokens[depth-1][token_len-1] != '/') {
+        tokens[depth-1][token_len] = '/';
+        tokens[depth-1][token_len+1] = '\0';
+    }
+
+    begin_transaction(fs);
+
+    int parent_inode = find_inode_by_path(fs, tokens, depth-1);
+    if (parent_inode == -1) {
+        print_error("mkdir_fs", path, ERR_NO_SUCH_FILE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    if (is_dir_exist(fs, parent_inode, tokens[depth-1])) {
+        print_error("mkdir_fs", path, ERR_DIR_EXISTS);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    Inode parent;
+    read_inode(fs, parent_inode, &parent);
+
+    int new_inode = create_inode(fs, parent_inode, TYPE_DIR);
+    if (new_inode == -1) {
+        print_error("mkdir_fs", path, ERR_NO_SPACE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    int ret = dir_insert(fs, parent_inode, &parent, tokens[depth-1], new_inode, TYPE_DIR);
+    if (ret != 0) {
+        print_error("mkdir_fs", path, ret == DIR_FULL ? ERR_DIR_FULL : ERR_NO_SPACE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    if (commit_transaction(fs) != 0) {
+        print_error("mkdir_fs", path, commit_error(fs));
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_mkdir(FsContext *fs, const char *path) {
+    if (check_writable(fs, "mkdir_fs", path) != 0) {
+        return -1;
+    }
+
+    lock_names(fs);
+    int ret = make_dir(fs, path);
+    unlock_names(fs);
+    return ret;
+}
+
+static int make_file(FsContext *fs, const char *path) {
+    if (names_no_file(path)) {
+        print_error("create_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    char tokens[MAX_DEPTH][TOKEN_LEN];
+    int depth = tokenize_path(path, tokens);
+    if (depth == -1) {
+        print_error("create_fs", path, ERR_PATH);
+        return -1;
+    }
+
+    begin_transaction(fs);
+
+    int parent_inode = find_inode_by_path(fs, tokens, depth - 1);
+    if (parent_inode == -1) {
+        print_error("create_fs", path, ERR_NO_SUCH_FILE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    if (is_file_exist(fs, parent_inode, tokens[depth - 1])) {
+        print_error("create_fs", path, ERR_FILE_EXISTS);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    Inode parent;
+    read_inode(fs, parent_inode, &parent);
+
+    int new_inode = create_inode(fs, parent_inode, TYPE_FILE);
+    if (new_inode == -1) {
+        print_error("mkdir_fs", path, ERR_NO_SPACE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    int ret = dir_insert(fs, parent_inode, &parent, tokens[depth - 1], new_inode, TYPE_FILE);
+    if (ret != 0) {
+        print_error("mkdir_fs", path, ret == DIR_FULL ? ERR_DIR_FULL : ERR_NO_SPACE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    if (commit_transaction(fs) != 0) {
+        print_error("create_fs", path, commit_error(fs));
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_create(FsContext *fs, const char *path) {
+    if (check_writable(fs, "create_fs", path) != 0) {
+        return -1;
+    }
+
+    lock_names(fs);
+    int ret = make_file(fs, path);
+    unlock_names(fs);
+    return ret;
+}
+
+// A slot for the file's appends; when every slot is taken the file with the
+// most bytes buffered is flushed to make room. On a thread-safe mount the
+// other files belong to calls that may be reading them, so it returns NULL
+// instead.
+static PendingWrite *open_pending(FsContext *fs, int inode_number, const Inode *inode, const char *path) {
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int allocated = extent_blocks(extents, extent_list(fs, inode, extents));
+
+    PendingWrite *pending = delalloc_open(&fs->delalloc, inode_number, path, inode->size, allocated);
+    if (pending != NULL || fs->thread_safe) {
+        return pending;
+    }
+
+    PendingWrite *largest = &fs->delalloc.files[0];
+    for (int i = 1; i < DELALLOC_FILES; ++i) {
+        if (fs->delalloc.files[i].length > largest->length) {
+            largest = &fs->delalloc.files[i];
+        }
+    }
+
+    flush_pending(fs, largest);
+    return delalloc_open(&fs->delalloc, inode_number, path, inode->size, allocated);
+}
+
+// How open_file locks the file it resolves; the caller holds names shared,
+// or for OPEN_HELD exclusive along with the transaction.
+typedef enum {
+    OPEN_READ = 0, // shared, appends and a changed handle inode written out
+    OPEN_WRITE,    // exclusive, then the transaction
+    OPEN_HELD      // not at all
+} OpenMode;
+
+static void unlock_file(FsContext *fs, int inode_number, OpenMode mode) {
+    if (mode == OPEN_WRITE) {
+        unlock_file_write(fs, inode_number);
+    } else if (mode == OPEN_READ) {
+        rwlock_unlock(file_lock(fs, inode_number));
+    }
+}
+
+// Resolves path to a regular file for command and locks it, or prints why it
+// cannot. The caller unlocks it with unlock_file.
+static int open_file(FsContext *fs, const char *command, const char *path, Inode *inode, OpenMode mode) {
+    char tokens[MAX_DEPTH][TOKEN_LEN];
+    int depth = tokenize_path(path, tokens);
+    if (depth == -1) {
+        print_error(command, path, ERR_PATH);
+        return -1;
+    }
+
+    int inode_number = find_inode_by_path(fs, tokens, depth);
+    if (inode_number == -1) {
+        print_error(command, path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    if (mode == OPEN_READ) {
+        lock_file_read(fs, inode_number, NULL);
+    } else {
+        if (mode == OPEN_WRITE) {
+            lock_file_write(fs, inode_number);
+        }
+        sync_open_file(fs, inode_number);
+    }
+
+    read_inode(fs, inode_number, inode);
+
+    if (inode->is_directory != 0) {
+        print_error(command, path, ERR_NO_SUCH_FILE);
+        unlock_file(fs, inode_number, mode);
+        return -1;
+    }
+
+    return inode_number;
+}
+
+static int write_now(FsContext *fs, const char *command, const char *path, int inode_number, Inode *inode,
+                     const char *data, int length, long long offset);
+
+// Appends are buffered per file and get their blocks only when the file is
+// flushed: at unmount or fs_sync, before it is read or preallocated, or once
+// DELALLOC_LIMIT bytes are waiting. The blocks they will need are reserved
+// here, so a write that cannot fit still fails straight away. Binary data is
+// fine: the length is data_size, not strlen.
+static int buffer_append(FsContext *fs, const char *command, const char *path, int inode_number, const Inode *inode,
+                         const char *data, int data_size) {
+    int block_size = fs->sb.block_size;
+
+    PendingWrite *pending = delalloc_find(&fs->delalloc, inode_number);
+    if (pending == NULL) {
+        pending = open_pending(fs, inode_number, inode, path);
+        if (pending == NULL) {
+            Inode copy = *inode;
+            return write_now(fs, command, path, inode_number, &copy, data, data_size, inode->size);
+        }
+    }
+
+    long long new_size = pending->size + pending->length + data_size;
+    int needed = (new_size + block_size - 1) / block_size - pending->allocated;
+    if (needed < 0) {
+        needed = 0;
+    }
+
+    int available = count_free_blocks(fs) - (fs->delalloc.reserved - pending->reserved);
+    if (needed > available || delalloc_append(pending, data, data_size) != 0) {
+        print_error(command, path, ERR_NO_SPACE);
+        if (pending->length == 0) {
+            delalloc_drop(&fs->delalloc, pending);
+        }
+        return -1;
+    }
+
+    delalloc_reserve(&fs->delalloc, pending, needed);
+    fs->delalloc.stats.appends++;
+
+    if (pending->length >= DELALLOC_LIMIT && flush_pending(fs, pending) != 0) {
+        return -1;
+    }
+
+    return data_size;
+}
+
+int fs_write(FsContext *fs, const char *path, const char *data) {
+    if (check_writable(fs, "write_fs", path) != 0) {
+        return -1;
+    }
+
+    if (names_no_file(path)) {
+        print_error("create_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    rwlock_read(&fs->names);
+
+    Inode inode;
+    int inode_number = open_file(fs, "write_fs", path, &inode, OPEN_WRITE);
+    int ret = -1;
+    if (inode_number != -1) {
+        ret = buffer_append(fs, "write_fs", path, inode_number, &inode, data, strlen(data));
+        unlock_file_write(fs, inode_number);
+    }
+
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+// Resolves a read_fs path to a regular file, its buffered appends written out
+// first, and locks it to read, or prints why it cannot.
+static int open_for_read(FsContext *fs, const char *path, Inode *inode) {
+    if (names_no_file(path)) {
+        print_error("create_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    return open_file(fs, "read_fs", path, inode, OPEN_READ);
+}
+
+// One device call of a read: blocks that sit together on disk. Whole wanted
+// blocks land in the caller's buffer, a partly wanted first or last block in
+// a bounce block.
+typedef struct RunPlan {
+    int block_number;    // first block of the run on disk
+    struct iovec iov[3];
+    int iovcnt;          // 0 for an empty plan
+    char *dest;          // where the first wanted byte goes
+    char *head_block;
+    char *tail_block;
+    int skip;            // unwanted bytes at the start of the first block
+    int head;            // bytes taken from head_block
+    int whole;           // bytes read straight into dest
+    int tail;            // bytes taken from tail_block
+} RunPlan;
+
+// Plans the read of bytes [pos, end) of the file into dest, up to the end of
+// the run of physically contiguous blocks holding pos, extents that happen to
+// sit back to back on disk included. Returns the bytes planned, 0 past the
+// mapped blocks.
+static int map_run(FsContext *fs, const Extent *extents, int num_extents, char *dest, long long pos, long long end,
+                   char *head_block, char *tail_block, RunPlan *plan) {
+    int block_size = fs->sb.block_size;
+    int logical = pos / block_size;
+
+    memset(plan, 0, sizeof(*plan));
+
+    int run;
+    plan->block_number = extent_lookup(extents, num_extents, logical, &run);
+    if (plan->block_number == -1) {
+        return 0;
+    }
+
+    int next_run;
+    while (extent_lookup(extents, num_extents, logical + run, &next_run) == plan->block_number + run) {
+        run += next_run;
+    }
+
+    plan->dest = dest;
+    plan->head_block = head_block;
+    plan->tail_block = tail_block;
+    plan->skip = pos % block_size;
+
+    long long available = (long long)run * block_size - plan->skip;
+    int bytes = end - pos < available ? end - pos : available;
+    int rest = bytes;
+
+    if (plan->skip > 0) {
+        plan->head = rest < block_size - plan->skip ? rest : block_size - plan->skip;
+        rest -= plan->head;
+
+        plan->iov[plan->iovcnt].iov_base = head_block;
+        plan->iov[plan->iovcnt].iov_len = block_size;
+        plan->iovcnt++;
+    }
+
+    plan->whole = rest / block_size * block_size;
+    plan->tail = rest - plan->whole;
+
+    if (plan->whole > 0) {
+        plan->iov[plan->iovcnt].iov_base = dest + plan->head;
+        plan->iov[plan->iovcnt].iov_len = plan->whole;
+        plan->iovcnt++;
+    }
+
+    if (plan->tail > 0) {
+        plan->iov[plan->iovcnt].iov_base = tail_block;
+        plan->iov[plan->iovcnt].iov_len = block_size;
+        plan->iovcnt++;
+    }
+
+    return bytes;
+}
+
+// copies the wanted bytes of the bounce blocks once the run has been read
+static void finish_run(const RunPlan *plan) {
+    if (plan->head > 0) {
+        memcpy(plan->dest, plan->head_block + plan->skip, plan->head);
+    }
+
+    if (plan->tail > 0) {
+        memcpy(plan->dest + plan->head + plan->whole, plan->tail_block, plan->tail);
+    }
+}
+
+// Prefetches the window past a sequential read, as far as the file goes.
+static void read_ahead(FsContext *fs, FileReadahead *file, const Inode *inode, const Extent *extents, int num_extents) {
+    int first;
+    int window = readahead_next(&fs->readahead, &fs->dev, file, &first);
+    if (window == 0) {
+        return;
+    }
+
+    int block_size = fs->sb.block_size;
+    long long file_blocks = (inode->size + block_size - 1) / block_size;
+    if (file_blocks - first < window) {
+        window = file_blocks > first ? file_blocks - first : 0;
+    }
+
+    int physical[window > 0 ? window : 1];
+    int count = 0;
+
+    while (count < window) {
+        int run;
+        int block_number = extent_lookup(extents, num_extents, first + count, &run);
+        if (block_number == -1) {
+            break;
+        }
+
+        for (int i = 0; i < run && count < window; ++i) {
+            physical[count++] = block_number + i;
+        }
+    }
+
+    // blocks the running transaction rewrote are only put right by
+    // overlay_blocks until a checkpoint takes them out of the journal
+    file->logged = journal_holds(&fs->journal, physical, count);
+    file->checkpoints = journal_checkpoints(&fs->journal);
+    readahead_start(&fs->readahead, &fs->dev, file, first, physical, count);
+}
+
+// Reads length bytes from offset, which the caller keeps inside the file
+// whose block map is extents. Blocks fetched ahead come from the prefetch,
+// the rest in one device call per run, and a sequential reader gets the next
+// window started.
+static int read_mapped(FsContext *fs, int inode_number, const Inode *inode, const Extent *extents, int num_extents,
+                       char *buf, long long offset, int length) {
+    if (length <= 0) {
+        return 0;
+    }
+
+    int block_size = fs->sb.block_size;
+
+    FileReadahead *file = readahead_access(&fs->readahead, &fs->dev, inode_number,
+                                           offset / block_size, (offset + length - 1) / block_size);
+    int done = 0;
+
+    while (done < length) {
+        long long pos = offset + done;
+        int logical = pos / block_size;
+
+        if (file != NULL && file->count > 0 && file->logged &&
+            journal_checkpoints(&fs->journal) != file->checkpoints) {
+            // read from the device before a commit wrote the blocks home
+            readahead_retire(&fs->readahead, &fs->dev, file);
+        }
+
+        char *ahead = file != NULL ? readahead_block(&fs->readahead, &fs->dev, file, logical) : NULL;
+        if (ahead != NULL) {
+            int run;
+            struct iovec iov = { ahead, block_size };
+            overlay_blocks(fs, extent_lookup(extents, num_extents, logical, &run), &iov, 1);
+
+            int skip = pos % block_size;
+            int chunk = length - done < block_size - skip ? length - done : block_size - skip;
+            memcpy(buf + done, ahead + skip, chunk);
+            done += chunk;
+            continue;
+        }
+
+        // stop short of the blocks the prefetch holds
+        long long end = offset + length;
+        if (file != NULL && file->count > 0 && file->start > logical && (long long)file->start * block_size < end) {
+            end = (long long)file->start * block_size;
+        }
+
+        char head_block[block_size];
+        char tail_block[block_size];
+        RunPlan plan;
+
+        int bytes = map_run(fs, extents, num_extents, buf + done, pos, end, head_block, tail_block, &plan);
+        if (bytes == 0) {
+            break;
+        }
+
+        read_blocks_vec(fs, plan.block_number, plan.iov, plan.iovcnt);
+        finish_run(&plan);
+        done += bytes;
+    }
+
+    if (file != NULL) {
+        read_ahead(fs, file, inode, extents, num_extents);
+    }
+    return done;
+}
+
+static int read_range(FsContext *fs, int inode_number, const Inode *inode, char *buf, long long offset, int length) {
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+
+    return read_mapped(fs, inode_number, inode, extents, num_extents, buf, offset, length);
+}
+
+int fs_read(FsContext *fs, const char *path, char *buf, int bufsize) {
+    rwlock_read(&fs->names);
+
+    Inode inode;
+    int inode_number = open_for_read(fs, path, &inode);
+    if (inode_number == -1) {
+        rwlock_unlock(&fs->names);
+        return -1;
+    }
+
+    int to_read = inode.size < bufsize ? inode.size : bufsize;
+    int read_total = read_range(fs, inode_number, &inode, buf, 0, to_read);
+
+    buf[read_total] = '\0';
+
+    unlock_file(fs, inode_number, OPEN_READ);
+    rwlock_unlock(&fs->names);
+    return read_total;
+}
+
+// Positional read: up to length bytes from offset, fewer at the end of the
+// file, with nothing added after them.
+int fs_pread(FsContext *fs, const char *path, char *buf, int length, long long offset) {
+    if (offset < 0 || length < 0) {
+        print_error("pread_fs", path, ERR_INVALID);
+        return -1;
+    }
+
+    rwlock_read(&fs->names);
+
+    Inode inode;
+    int inode_number = open_file(fs, "pread_fs", path, &inode, OPEN_READ);
+    if (inode_number == -1) {
+        rwlock_unlock(&fs->names);
+        return -1;
+    }
+
+    int ret = 0;
+    if (offset < inode.size) {
+        if (length > inode.size - offset) {
+            length = inode.size - offset;
+        }
+        ret = read_range(fs, inode_number, &inode, buf, offset, length);
+    }
+
+    unlock_file(fs, inode_number, OPEN_READ);
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+// Overwrites the mapped bytes [offset, offset + length) in place: blocks the
+// range covers whole are written straight from data, only a partly covered
+// first or last block is read first.
+static void overwrite_range(FsContext *fs, const Extent *extents, int num_extents, const char *data, int length,
+                            long long offset) {
+    int block_size = fs->sb.block_size;
+    int done = 0;
+
+    while (done < length) {
+        long long pos = offset + done;
+        int skip = pos % block_size;
+        int remaining = length - done;
+
+        int run;
+        int block_number = extent_lookup(extents, num_extents, pos / block_size, &run);
+
+        if (skip == 0 && remaining >= block_size) {
+            int count = remaining / block_size < run ? remaining / block_size : run;
+            write_blocks(fs, block_number, count, data + done);
+            done += count * block_size;
+        } else {
+            char block[block_size];
+            read_block(fs, block_number, block);
+
+            int chunk = remaining < block_size - skip ? remaining : block_size - skip;
+            memcpy(block + skip, data + done, chunk);
+            write_block(fs, block_number, block);
+            done += chunk;
+        }
+    }
+}
+
+// Extends the file with zeros up to size, for a write past its end.
+static int zero_fill(FsContext *fs, int inode_number, Inode *inode, Extent *extents, int *num_extents, long long size) {
+    int chunk_size = 16 * fs->sb.block_size;
+    char *zeros = calloc(1, chunk_size);
+    if (zeros == NULL) {
+        return -1;
+    }
+
+    int ret = 0;
+    while (ret == 0 && inode->size < size) {
+        int chunk = size - inode->size < chunk_size ? size - inode->size : chunk_size;
+        ret = append_mapped(fs, inode_number, inode, extents, num_extents, zeros, chunk);
+    }
+
+    free(zeros);
+    return ret;
+}
+
+// Writes length bytes at offset into the file whose block map is extents:
+// in place over its current bytes, then past its end with any gap zeroed.
+// Fails without writing when the free blocks cannot cover it. The caller
+// runs the transaction and stores the inode.
+static int write_mapped(FsContext *fs, int inode_number, Inode *inode, Extent *extents, int *num_extents,
+                        const char *data, int length, long long offset) {
+    int block_size = fs->sb.block_size;
+
+    long long end = offset + length > inode->size ? offset + length : inode->size;
+    long long needed = (end + block_size - 1) / block_size - extent_blocks(extents, *num_extents);
+    if (needed > count_free_blocks(fs) - fs->delalloc.reserved) {
+        return -1;
+    }
+
+    readahead_forget(&fs->readahead, &fs->dev, inode_number);
+
+    int in_place = offset < inode->size ? (inode->size - offset < length ? inode->size - offset : length) : 0;
+    overwrite_range(fs, extents, *num_extents, data, in_place, offset);
+
+    if (zero_fill(fs, inode_number, inode, extents, num_extents, offset) != 0) {
+        return -1;
+    }
+
+    return append_mapped(fs, inode_number, inode, extents, num_extents, data + in_place, length - in_place);
+}
+
+// write_mapped as a transaction of its own, inode stored; for a file with no
+// appends waiting.
+static int write_now(FsContext *fs, const char *command, const char *path, int inode_number, Inode *inode,
+                     const char *data, int length, long long offset) {
+    begin_transaction(fs);
+
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+
+    if (write_mapped(fs, inode_number, inode, extents, &num_extents, data, length, offset) != 0) {
+        print_error(command, path, ERR_NO_SPACE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    write_inode(fs, inode_number, inode);
+    if (commit_transaction(fs) != 0) {
+        print_error(command, path, commit_error(fs));
+        return -1;
+    }
+
+    invalidate_open_file(fs, inode_number);
+    return length;
+}
+
+static int pwrite_file(FsContext *fs, const char *path, int inode_number, Inode *inode, const char *data, int length,
+                       long long offset) {
+    PendingWrite *pending = delalloc_find(&fs->delalloc, inode_number);
+    long long size = pending != NULL ? pending->size + pending->length : inode->size;
+
+    if (offset == size) {
+        return buffer_append(fs, "pwrite_fs", path, inode_number, inode, data, length);
+    }
+
+    if (pending != NULL) {
+        if (flush_pending(fs, pending) != 0) {
+            return -1;
+        }
+        read_inode(fs, inode_number, inode);
+    }
+
+    return write_now(fs, "pwrite_fs", path, inode_number, inode, data, length, offset);
+}
+
+// Positional write of length bytes, NUL bytes included. Bytes inside the file
+// are overwritten in place; the rest extend it, and a gap before offset reads
+// back as zeros. A write at the very end is buffered like write_fs.
+int fs_pwrite(FsContext *fs, const char *path, const char *data, int length, long long offset) {
+    if (check_writable(fs, "pwrite_fs", path) != 0) {
+        return -1;
+    }
+
+    if (offset < 0 || length < 0) {
+        print_error("pwrite_fs", path, ERR_INVALID);
+        return -1;
+    }
+
+    rwlock_read(&fs->names);
+
+    Inode inode;
+    int inode_number = open_file(fs, "pwrite_fs", path, &inode, OPEN_WRITE);
+    int ret = -1;
+    if (inode_number != -1) {
+        ret = pwrite_file(fs, path, inode_number, &inode, data, length, offset);
+        unlock_file_write(fs, inode_number);
+    }
+
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+// Opens a file for fs_pread_fd and fs_pwrite_fd. Opening an open file again
+// returns the same handle, which then needs one more fs_close.
+static int open_handle(FsContext *fs, const char *path) {
+    if (names_no_file(path)) {
+        print_error("open_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    Inode inode;
+    int inode_number = open_file(fs, "open_fs", path, &inode, OPEN_HELD);
+    if (inode_number == -1) {
+        return -1;
+    }
+
+    fs->file_stats.opens++;
+
+    OpenFile *file = find_open_file(fs, inode_number);
+    if (file != NULL) {
+        file->opens++;
+        return file - fs->files;
+    }
+
+    file = find_open_file(fs, -1);
+    if (file == NULL) {
+        print_error("open_fs", path, ERR_TOO_MANY_OPEN);
+        return -1;
+    }
+
+    file->extents = malloc(MAX_FILE_EXTENTS(fs) * sizeof(Extent));
+    if (file->extents == NULL) {
+        print_error("open_fs", path, ERR_TOO_MANY_OPEN);
+        return -1;
+    }
+
+    PendingWrite *pending = delalloc_find(&fs->delalloc, inode_number);
+    if (pending != NULL) {
+        flush_pending(fs, pending);
+        read_inode(fs, inode_number, &inode);
+    }
+
+    file->inode_number = inode_number;
+    file->opens = 1;
+    file->dirty = 0;
+    file->stale = 0;
+    file->inode = inode;
+    file->num_extents = extent_list(fs, &inode, file->extents);
+    snprintf(file->path, sizeof(file->path), "%s", path);
+
+    return file - fs->files;
+}
+
+int fs_open(FsContext *fs, const char *path) {
+    lock_names(fs);
+    int ret = open_handle(fs, path);
+    unlock_names(fs);
+    return ret;
+}
+
+static void reload(FsContext *fs, OpenFile *file) {
+    read_inode(fs, file->inode_number, &file->inode);
+    file->num_extents = extent_list(fs, &file->inode, file->extents);
+    file->stale = 0;
+    STAT_ADD(fs->file_stats.reloads, 1);
+}
+
+static OpenFile *find_handle(FsContext *fs, const char *command, int handle) {
+    if (handle < 0 || handle >= FS_OPEN_FILES || fs->files[handle].inode_number == -1) {
+        char name[16];
+        snprintf(name, sizeof(name), "#%d", handle);
+        print_error(command, name, ERR_BAD_HANDLE);
+        return NULL;
+    }
+
+    return &fs->files[handle];
+}
+
+// The open file behind handle, locked like open_file locks a path and brought
+// up to date with calls by path that changed it since its last use, or NULL
+// after printing why there is none. The caller holds names shared.
+static OpenFile *use_handle(FsContext *fs, const char *command, int handle, OpenMode mode) {
+    OpenFile *file = find_handle(fs, command, handle);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    // a handle never holds a changed inode while write_fs appends are waiting
+    if (mode == OPEN_READ) {
+        lock_file_read(fs, file->inode_number, file);
+    } else {
+        lock_file_write(fs, file->inode_number);
+        settle(fs, file->inode_number, file);
+    }
+
+    STAT_ADD(fs->file_stats.calls, 1);
+    return file;
+}
+
+int fs_pread_fd(FsContext *fs, int handle, char *buf, int length, long long offset) {
+    rwlock_read(&fs->names);
+
+    OpenFile *file = use_handle(fs, "pread_fs", handle, OPEN_READ);
+    if (file == NULL) {
+        rwlock_unlock(&fs->names);
+        return -1;
+    }
+
+    int ret = 0;
+    if (offset < 0 || length < 0) {
+        print_error("pread_fs", file->path, ERR_INVALID);
+        ret = -1;
+    } else if (offset < file->inode.size) {
+        if (length > file->inode.size - offset) {
+            length = file->inode.size - offset;
+        }
+        ret = read_mapped(fs, file->inode_number, &file->inode, file->extents, file->num_extents, buf, offset, length);
+    }
+
+    unlock_file(fs, file->inode_number, OPEN_READ);
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+// fs_pwrite through a handle. Each call is its own transaction, but the inode
+// is only written back on fs_flush, fs_close, fs_sync or unmount; a crash
+// before that loses the size change and leaks the blocks the writes added.
+static int pwrite_handle(FsContext *fs, OpenFile *file, const char *data, int length, long long offset) {
+    if (check_writable(fs, "pwrite_fs", file->path) != 0) {
+        return -1;
+    }
+
+    if (offset < 0 || length < 0) {
+        print_error("pwrite_fs", file->path, ERR_INVALID);
+        return -1;
+    }
+
+    Inode saved = file->inode;
+    begin_transaction(fs);
+
+    if (write_mapped(fs, file->inode_number, &file->inode, file->extents, &file->num_extents, data, length, offset) != 0) {
+        print_error("pwrite_fs", file->path, ERR_NO_SPACE);
+        rollback_transaction(fs);
+
+        // the extent block is only ever changed inside a transaction
+        file->inode = saved;
+        file->num_extents = extent_list(fs, &file->inode, file->extents);
+        return -1;
+    }
+
+    if (commit_transaction(fs) != 0) {
+        print_error("pwrite_fs", file->path, commit_error(fs));
+        file->inode = saved;
+        file->num_extents = extent_list(fs, &file->inode, file->extents);
+        return -1;
+    }
+
+    if (memcmp(&saved, &file->inode, sizeof(Inode)) != 0) {
+        file->dirty = 1;
+    }
+
+    return length;
+}
+
+int fs_pwrite_fd(FsContext *fs, int handle, const char *data, int length, long long offset) {
+    rwlock_read(&fs->names);
+
+    OpenFile *file = use_handle(fs, "pwrite_fs", handle, OPEN_WRITE);
+    int ret = -1;
+    if (file != NULL) {
+        ret = pwrite_handle(fs, file, data, length, offset);
+        unlock_file_write(fs, file->inode_number);
+    }
+
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+int fs_flush(FsContext *fs, int handle) {
+    rwlock_read(&fs->names);
+
+    OpenFile *file = find_handle(fs, "flush_fs", handle);
+    if (file == NULL) {
+        rwlock_unlock(&fs->names);
+        return -1;
+    }
+
+    lock_file_write(fs, file->inode_number);
+    if (file->dirty) {
+        write_back(fs, file);
+    }
+    unlock_file_write(fs, file->inode_number);
+
+    rwlock_unlock(&fs->names);
+    return 0;
+}
+
+int fs_close(FsContext *fs, int handle) {
+    lock_names(fs);
+
+    OpenFile *file = find_handle(fs, "close_fs", handle);
+    if (file == NULL) {
+        unlock_names(fs);
+        return -1;
+    }
+
+    if (file->dirty) {
+        write_back(fs, file);
+    }
+
+    if (--file->opens == 0) {
+        free(file->extents);
+        file->extents = NULL;
+        file->inode_number = -1;
+    }
+
+    unlock_names(fs);
+    return 0;
+}
+
+// An fs_read_submit in flight: one request per run of the file, or a single
+// empty one when there is nothing to read, and the bounce block for a partial
+// last block.
+typedef struct AsyncRead {
+    FsContext *fs;
+    char *buf;
+    int length;        // bytes the read returns
+    int pending;       // requests not completed
+    int failed;
+    unsigned long checkpoints; // journal_checkpoints at submit
+    FsReadDone done;
+    void *arg;
+    char *bounce;
+    IoRequest *requests;
+    RunPlan *plans;    // one per request
+} AsyncRead;
+
+static void run_done(IoRequest *request) {
+    AsyncRead *read = request->arg;
+    FsContext *fs = read->fs;
+    RunPlan *plan = &read->plans[request - read->requests];
+
+    size_t length = 0;
+    for (int i = 0; i < request->iovcnt; ++i) {
+        length += request->iov[i].iov_len;
+    }
+
+    if (request->result != (ssize_t)length) {
+        read->failed = 1;
+    } else if (plan->iovcnt > 0) {
+        overlay_blocks(fs, plan->block_number, plan->iov, plan->iovcnt);
+
+        // a commit since the submit may have written the blocks home after
+        // the device read and dropped them from the journal, so the overlay
+        // missed them; the cache and the image agree on them now
+        if (journal_checkpoints(&fs->journal) != read->checkpoints) {
+            read_blocks_vec(fs, plan->block_number, plan->iov, plan->iovcnt);
+        }
+        finish_run(plan);
+    }
+
+    if (--read->pending > 0) {
+        return;
+    }
+
+    read->buf[read->length] = '\0';
+
+    fs->reads_in_flight--;
+    fs->reads_completed++;
+    read->done(read->arg, read->failed ? -1 : read->length);
+    free(read);
+}
+
+// Queues the reads of the file behind inode; the caller holds the file and
+// the async engine.
+static int submit_runs(FsContext *fs, const Inode *inode, char *buf, int bufsize, FsReadDone done, void *arg) {
+    int to_read = inode->size < bufsize ? inode->size : bufsize;
+
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+
+    // every run covers at least one extent
+    int max_requests = num_extents > 0 ? num_extents : 1;
+    AsyncRead *read = malloc(sizeof(AsyncRead) + max_requests * (sizeof(IoRequest) + sizeof(RunPlan)) + fs->sb.block_size);
+    if (read == NULL) {
+        return -1;
+    }
+
+    memset(read, 0, sizeof(AsyncRead));
+    read->fs = fs;
+    read->checkpoints = journal_checkpoints(&fs->journal);
+    read->buf = buf;
+    read->done = done;
+    read->arg = arg;
+    read->requests = (IoRequest *)(read + 1);
+    read->plans = (RunPlan *)(read->requests + max_requests);
+    read->bounce = (char *)(read->plans + max_requests);
+
+    int num_requests = 0;
+
+    do {
+        IoRequest *request = &read->requests[num_requests];
+        RunPlan *plan = &read->plans[num_requests];
+        memset(request, 0, sizeof(IoRequest));
+        memset(plan, 0, sizeof(RunPlan));
+
+        // runs start on block boundaries, so only the last can need the bounce block
+        if (read->length < to_read) {
+            read->length += map_run(fs, extents, num_extents, buf + read->length, read->length, to_read, NULL, read->bounce, plan);
+        }
+
+        request->done = run_done;
+        request->arg = read;
+        request->iov = plan->iov;
+        request->iovcnt = plan->iovcnt;
+        request->offset = (off_t)plan->block_number * fs->sb.block_size;
+        num_requests++;
+    } while (read->length < to_read && read->plans[num_requests-1].iovcnt > 0);
+
+    // the count is complete before the first request can finish
+    read->pending = num_requests;
+
+    for (int i = 0; i < num_requests; ++i) {
+        IoRequest *request = &read->requests[i];
+
+        // only the first submit can fail, starting the engine
+        if (blockdev_submit(&fs->dev, request->offset / fs->sb.block_size, request) != 0) {
+            free(read);
+            return -1;
+        }
+    }
+
+    fs->reads_in_flight++;
+
+    blockdev_kick(&fs->dev);
+    return 0;
+}
+
+int fs_read_submit(FsContext *fs, const char *path, char *buf, int bufsize, FsReadDone done, void *arg) {
+    rwlock_read(&fs->names);
+
+    Inode inode;
+    int inode_number = open_for_read(fs, path, &inode);
+    if (inode_number == -1) {
+        rwlock_unlock(&fs->names);
+        return -1;
+    }
+
+    mutex_lock(&fs->async);
+    int ret = submit_runs(fs, &inode, buf, bufsize, done, arg);
+    mutex_unlock(&fs->async);
+
+    unlock_file(fs, inode_number, OPEN_READ);
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+// Runs the callbacks of finished fs_read_submit calls and returns how many
+// ran. With wait set it blocks until one has, unless none is in flight.
+int fs_poll(FsContext *fs, int wait) {
+    mutex_lock(&fs->async);
+    unsigned long before = fs->reads_completed;
+
+    do {
+        blockdev_reap(&fs->dev, wait && fs->reads_in_flight > 0 ? 1 : 0);
+    } while (wait && fs->reads_completed == before && fs->reads_in_flight > 0);
+
+    int ran = fs->reads_completed - before;
+    mutex_unlock(&fs->async);
+    return ran;
+}
+
+static int delete_file(FsContext *fs, const char *path) {
+
+    char tokens[MAX_DEPTH][TOKEN_LEN];
+    int depth = tokenize_path(path, tokens);
+    if (depth == -1) {
+        print_error("delete_fs", path, ERR_PATH);
+        return -1;
+    }
+    if (depth == 0) {
+        // "/" is a directory, never a file
+        print_error("delete_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    begin_transaction(fs);
+
+    int parent_inode = find_inode_by_path(fs, tokens, depth-1);
+    if (parent_inode == -1) {
+        print_error("delete_fs", path, ERR_NO_SUCH_FILE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    Inode parent;
+    read_inode(fs, parent_inode, &parent);
+
+    int type;
+    int inode_number = lookup_child(fs, parent_inode, tokens[depth-1], &type);
+    if (inode_number == -1 || type != TYPE_FILE) {
+        print_error("delete_fs", path, ERR_NO_SUCH_FILE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    if (find_open_file(fs, inode_number) != NULL) {
+        print_error("delete_fs", path, ERR_FILE_OPEN);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    Inode inode;
+    read_inode(fs, inode_number, &inode);
+
+    extent_release(fs, &inode);
+    free_inode(fs, inode_number);
+    dir_remove(fs, parent_inode, &parent, tokens[depth-1]);
+
+    if (commit_transaction(fs) != 0) {
+        print_error("delete_fs", path, commit_error(fs));
+        return -1;
+    }
+
+    // appends that never reached the disk go with the file, and so does its
+    // prefetch, before the inode number comes back for another one
+    PendingWrite *pending = delalloc_find(&fs->delalloc, inode_number);
+    if (pending != NULL) {
+        delalloc_drop(&fs->delalloc, pending);
+    }
+    readahead_forget(&fs->readahead, &fs->dev, inode_number);
+
+    return 0;
+}
+
+int fs_delete(FsContext *fs, const char *path) {
+    if (check_writable(fs, "delete_fs", path) != 0) {
+        return -1;
+    }
+
+    lock_names(fs);
+    int ret = delete_file(fs, path);
+    unlock_names(fs);
+    return ret;
+}
+
+static int remove_dir(FsContext *fs, const char *path) {
+
+    char tokens[MAX_DEPTH][TOKEN_LEN];
+    int depth = tokenize_path(path, tokens);
+    if (depth == -1) {
+        print_error("rmdir_fs", path, ERR_PATH);
+        return -1;
+    }
+    if (depth == 0) {
+        // the root cannot be removed
+        print_error("rmdir_fs", path, ERR_PATH);
+        return -1;
+    }
+
+    int token_len = strlen(tokens[depth-1]);
+    if (tokens[depth-1][token_len-1] != '/') {
+        tokens[depth-1][token_len] = '/';
+        tokens[depth-1][token_len+1] = '\0';
+    }
+
+    begin_transaction(fs);
+
+    int parent_inode = find_inode_by_path(fs, tokens, depth-1);
+    if (parent_inode == -1) {
+        print_error("rmdir_fs", path, ERR_NO_SUCH_FILE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    Inode parent;
+    read_inode(fs, parent_inode, &parent);
+
+    int type;
+    int inode_number = lookup_child(fs, parent_inode, tokens[depth-1], &type);
+    if (inode_number == -1 || type != TYPE_DIR) {
+        print_error("rmdir_fs", path, ERR_NO_SUCH_FILE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    Inode inode;
+    read_inode(fs, inode_number, &inode);
+
+    if (inode.size > 0) {
+        print_error("rmdir_fs", path, ERR_DIR_NOT_EMPTY);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    dir_release(fs, &inode);
+    free_inode(fs, inode_number);
+    dcache_invalidate_dir(&fs->dcache, inode_number);
+    listing_drop(&fs->listing, inode_number);
+    dir_remove(fs, parent_inode, &parent, tokens[depth-1]);
+
+    if (commit_transaction(fs) != 0) {
+        print_error("rmdir_fs", path, commit_error(fs));
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_rmdir(FsContext *fs, const char *path) {
+    if (check_writable(fs, "rmdir_fs", path) != 0) {
+        return -1;
+    }
+
+    lock_names(fs);
+    int ret = remove_dir(fs, path);
+    unlock_names(fs);
+    return ret;
+}
+
+// Directory names carry a trailing '/' in their entries; a listing shows them
+// without it.
+static void strip_slashes(DirectoryEntry *entries, int num_entries) {
+    for (int i = 0; i < num_entries; ++i) {
+        int name_len = strlen(entries[i].name);
+        if (name_len > 0 && entries[i].name[name_len-1] == '/') {
+            entries[i].name[name_len-1] = '\0';
+        }
+    }
+}
+
+// ls_fs without taking a lock: the path from cached names and the directory
+// from its kept listing, trusted only if no call held names exclusive
+// meanwhile. Returns -1 when the caller has to take the locks instead.
+static int list_kept(FsContext *fs, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth, DirectoryEntry *entries,
+                     int max_entries) {
+    if (fs->listing.num_dirs == 0) {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < LISTING_RETRIES; ++attempt) {
+        // a change under way would only be waited out spinning; the lock
+        // waits for it properly
+        unsigned int start = seq_read_begin(&fs->names_seq);
+        if (start & 1) {
+            return -1;
+        }
+
+        int inode_number = find_cached_inode(fs, tokens, depth);
+        if (inode_number == -1) {
+            return -1;
+        }
+
+        int num_entries = listing_copy(&fs->listing, inode_number, entries, max_entries);
+        if (num_entries == -1) {
+            return -1;
+        }
+
+        if (!seq_read_retry(&fs->names_seq, start)) {
+            strip_slashes(entries, num_entries);
+            return num_entries;
+        }
+
+        STAT_ADD(fs->listing.stats.retries, 1);
+    }
+
+    return -1;
+}
+
+// The locked listing, kept for list_kept when it is the whole directory.
+static int list_dir(FsContext *fs, const char *path, const char tokens[MAX_DEPTH][TOKEN_LEN], int depth,
+                    DirectoryEntry *entries, int max_entries) {
+    int inode_number = find_inode_by_path(fs, tokens, depth);
+    if (inode_number == -1) {
+        print_error("ls_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    Inode inode;
+    read_inode(fs, inode_number, &inode);
+
+    int num_entries = dir_list(fs, &inode, entries, max_entries);
+
+    // nothing changes a directory while names is held shared
+    if (num_entries == inode.size) {
+        listing_store(&fs->listing, inode_number, entries, num_entries);
+    }
+
+    strip_slashes(entries, num_entries);
+    return num_entries;
+}
+
+int fs_ls(FsContext *fs, const char *path, DirectoryEntry *entries, int max_entries) {
+    char tokens[MAX_DEPTH][TOKEN_LEN];
+    int depth = tokenize_path(path, tokens);
+    if (depth == -1) {
+        print_error("ls_fs", path, ERR_PATH);
+        return -1;
+    }
+
+    // "/" has no component to mark as a directory
+    int token_len = depth > 0 ? strlen(tokens[depth-1]) : 0;
+    if (token_len > 0 && tokens[depth-1][token_len-1] != '/') {
+        tokens[depth-1][token_len] = '/';
+        tokens[depth-1][token_len+1] = '\0';
+    }
+
+    int ret = list_kept(fs, tokens, depth, entries, max_entries);
+    if (ret != -1) {
+        return ret;
+    }
+
+    rwlock_read(&fs->names);
+    ret = list_dir(fs, path, tokens, depth, entries, max_entries);
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+static int preallocate_file(FsContext *fs, const char *path, int inode_number, Inode *inode, long long size) {
+    PendingWrite *pending = delalloc_find(&fs->delalloc, inode_number);
+    if (pending != NULL) {
+        flush_pending(fs, pending);
+        read_inode(fs, inode_number, inode);
+    }
+
+    int block_size = fs->sb.block_size;
+
+    Extent extents[MAX_FILE_EXTENTS(fs)];
+    int num_extents = extent_list(fs, inode, extents);
+    long long needed = (size + block_size - 1) / block_size - extent_blocks(extents, num_extents);
+
+    if (needed <= 0) {
+        return 0;
+    }
+
+    if (needed > count_free_blocks(fs) - fs->delalloc.reserved) {
+        print_error("preallocate_fs", path, ERR_NO_SPACE);
+        return -1;
+    }
+
+    begin_transaction(fs);
+
+    if (extent_grow(fs, inode_number, inode, needed) != 0) {
+        print_error("preallocate_fs", path, ERR_NO_SPACE);
+        rollback_transaction(fs);
+        return -1;
+    }
+
+    write_inode(fs, inode_number, inode);
+
+    if (commit_transaction(fs) != 0) {
+        print_error("preallocate_fs", path, commit_error(fs));
+        return -1;
+    }
+
+    invalidate_open_file(fs, inode_number);
+    return 0;
+}
+
+// Maps blocks for the first size bytes of the file without changing its
+// size, asking for them as one run so later appends land contiguously.
+int fs_preallocate(FsContext *fs, const char *path, long long size) {
+    if (check_writable(fs, "preallocate_fs", path) != 0) {
+        return -1;
+    }
+
+    if (names_no_file(path)) {
+        print_error("preallocate_fs", path, ERR_NO_SUCH_FILE);
+        return -1;
+    }
+
+    rwlock_read(&fs->names);
+
+    Inode inode;
+    int inode_number = open_file(fs, "preallocate_fs", path, &inode, OPEN_WRITE);
+    int ret = -1;
+    if (inode_number != -1) {
+        ret = preallocate_file(fs, path, inode_number, &inode, size);
+        unlock_file_write(fs, inode_number);
+    }
+
+    rwlock_unlock(&fs->names);
+    return ret;
+}
+
+int mkdir_fs(const char *path) {
+    FsContext fs;
+    if (mount_for("mkdir_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_mkdir(&fs, path);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int create_fs(const char *path) {
+    FsContext fs;
+    if (mount_for("create_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_create(&fs, path);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int write_fs(const char *path, const char *data) {
+    FsContext fs;
+    if (mount_for("write_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_write(&fs, path, data);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int read_fs(const char *path, char *buf, int bufsize) {
+    FsContext fs;
+    if (mount_for("read_fs", path, IMAGE_LOCK_SHARED, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_read(&fs, path, buf, bufsize);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int delete_fs(const char *path) {
+    FsContext fs;
+    if (mount_for("delete_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_delete(&fs, path);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int rmdir_fs(const char *path) {
+    FsContext fs;
+    if (mount_for("rmdir_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_rmdir(&fs, path);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int ls_fs(const char *path, DirectoryEntry *entries, int max_entries) {
+    FsContext fs;
+    if (mount_for("ls_fs", path, IMAGE_LOCK_SHARED, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_ls(&fs, path, entries, max_entries);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int preallocate_fs(const char *path, long long size) {
+    FsContext fs;
+    if (mount_for("preallocate_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_preallocate(&fs, path, size);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int pread_fs(const char *path, char *buf, int length, long long offset) {
+    FsContext fs;
+    if (mount_for("pread_fs", path, IMAGE_LOCK_SHARED, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_pread(&fs, path, buf, length, offset);
+    fs_unmount(&fs);
+    return ret;
+}
+
+int pwrite_fs(const char *path, const char *data, int length, long long offset) {
+    FsContext fs;
+    if (mount_for("pwrite_fs", path, IMAGE_LOCK_EXCLUSIVE, &fs) != 0) {
+        return -1;
+    }
+
+    int ret = fs_pwrite(&fs, path, data, length, offset);
+    fs_unmount(&fs);
+    return ret;
+}
@@ -1,42 +1,92 @@
-#include "fs_errors.h"
-#include <stdio.h>
-
-void print_error(const char *command, const char* path, ErrorCode code) {
-    switch (code)
-    {
-    case ERR_PATH:
-        fprintf(stderr, "Error: %s %s: paths must be absolute (start with '/')\n", command, path);
-        break;
-
-    case ERR_DISK:
-        fprintf(stderr, "Error: %s %s: cannot open disk file\n", command, path);
-        break;
-
-    case ERR_FORMAT:
-        fprintf(stderr, "Error: %s %s: wrong filesystem format\n", command, path);
-        break;
-
-    case ERR_NO_SUCH_FILE:
-        fprintf(stderr, "Error: %s %s: no such file or directory\n", command, path);
-        break;
-
-    case ERR_FILE_EXISTS:
-        fprintf(stderr, "Error: %s %s: file already exists\n", command, path);
-        break;
-
-    case ERR_DIR_EXISTS:
-        fprintf(stderr, "Error: %s %s: directory already exists\n", command, path);
-        break;
-
-    case ERR_DIR_NOT_EMPTY:
-        fprintf(stderr, "Error: %s %s: directory not empty\n", command, path);
-        break;
-
-    case ERR_NO_SPACE:
-        fprintf(stderr, "Error: %s %s: no enough space\n", command, path);
-        break;
-    
-    default:
-        break;
-    }
+#include "fs_errors.h"
+#include <stdio.h>
+
+static _Thread_local ErrorCode last_error = ERR_NONE;
+static _Thread_local int quiet = 0;
+
+void print_error(const char *command, const char* path, ErrorCode code) {
+    last_error = code;
+    if (quiet) {
+        return;
+    }
+
+    switch (code)
+    {
+    case ERR_PATH:
+        fprintf(stderr, "Error: %s %s: paths must be absolute (start with '/')\n", command, path);
+        break;
+
+    case ERR_DISK:
+        fprintf(stderr, "Error: %s %s: cannot open disk file\n", command, path);
+        break;
+
+    case ERR_FORMAT:
+        fprintf(stderr, "Error: %s %s: wrong filesystem format\n", command, path);
+        break;
+
+    case ERR_NO_SUCH_FILE:
+        fprintf(stderr, "Error: %s %s: no such file or directory\n", command, path);
+        break;
+
+    case ERR_FILE_EXISTS:
+        fprintf(stderr, "Error: %s %s: file already exists\n", command, path);
+        break;
+
+    case ERR_DIR_EXISTS:
+        fprintf(stderr, "Error: %s %s: directory already exists\n", command, path);
+        break;
+
+    case ERR_DIR_NOT_EMPTY:
+        fprintf(stderr, "Error: %s %s: directory not empty\n", command, path);
+        break;
+
+    case ERR_NO_SPACE:
+        fprintf(stderr, "Error: %s %s: no enough space\n", command, path);
+        break;
+
+    case ERR_INVALID:
+        fprintf(stderr, "Error: %s %s: invalid offset or length\n", command, path);
+        break;
+
+    case ERR_BAD_HANDLE:
+        fprintf(stderr, "Error: %s %s: bad file handle\n", command, path);
+        break;
+
+    case ERR_FILE_OPEN:
+        fprintf(stderr, "Error: %s %s: file is open\n", command, path);
+        break;
+
+    case ERR_TOO_MANY_OPEN:
+        fprintf(stderr, "Error: %s %s: too many open files\n", command, path);
+        break;
+
+    case ERR_READ_ONLY:
+        fprintf(stderr, "Error: %s %s: image is mounted read-only\n", command, path);
+        break;
+
+    case ERR_CONNECTION:
+        fprintf(stderr, "Error: %s %s: lost the connection to the server\n", command, path);
+        break;
+
+    case ERR_COMMIT:
+        fprintf(stderr, "Error: %s %s: a commit failed, the image takes no changes until remounted\n", command, path);
+        break;
+
+    case ERR_DIR_FULL:
+        fprintf(stderr, "Error: %s %s: directory is full\n", command, path);
+        break;
+    
+    default:
+        break;
+    }
+}
+
+ErrorCode take_error(void) {
+    ErrorCode code = last_error;
+    last_error = ERR_NONE;
+    return code;
+}
+
+void quiet_errors(int on) {
+    quiet = on;
 }
\ No newline at end of file
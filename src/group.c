@@ -0,0 +1,171 @@
+#include "group.h"
+#include "disk.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Loads the descriptor table, at mount and again after a rollback. Readers
+// check the flags under group_lock, so the table is read aside and swapped in.
+// The inode hints start over from 0, as a rollback may have freed inodes
+// below them.
+int read_groups(FsContext *fs) {
+    if (fs->inode_hints == NULL) {
+        fs->inode_hints = malloc(sizeof(int) * fs->sb.num_groups);
+        if (fs->inode_hints == NULL) {
+            return -1;
+        }
+    }
+    memset(fs->inode_hints, 0, sizeof(int) * fs->sb.num_groups);
+
+    size_t size = (size_t)fs->sb.gdt_blocks * fs->sb.block_size;
+    char *table = malloc(size);
+    if (table == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < fs->sb.gdt_blocks; ++i) {
+        read_block(fs, fs->sb.gdt_start + i, table + (size_t)i * fs->sb.block_size);
+    }
+
+    int uninit_groups = 0;
+    for (int i = 0; i < fs->sb.num_groups; ++i) {
+        if (((const GroupDesc *)table)[i].flags != 0) {
+            uninit_groups++;
+        }
+    }
+
+    rwlock_write(&fs->group_lock);
+
+    if (fs->groups == NULL) {
+        fs->groups = (GroupDesc *)table;
+    } else {
+        memcpy(fs->groups, table, size);
+        free(table);
+    }
+    fs->uninit_groups = uninit_groups;
+
+    rwlock_unlock(&fs->group_lock);
+    return 0;
+}
+
+// writes back the descriptor block that holds group
+void write_group(FsContext *fs, int group) {
+    int block = group / GROUPS_PER_BLOCK(fs);
+    char *table = (char *)fs->groups;
+
+    write_block(fs, fs->sb.gdt_start + block, table + (size_t)block * fs->sb.block_size);
+}
+
+void free_groups(FsContext *fs) {
+    free(fs->groups);
+    fs->groups = NULL;
+    free(fs->inode_hints);
+    fs->inode_hints = NULL;
+    fs->uninit_groups = 0;
+}
+
+// Spreads directories out so each one's files have room around it: the group
+// with the most free blocks among those with at least the average number of
+// free inodes, scanning from the parent's group so that ties stay there.
+int group_for_directory(const FsContext *fs, int parent_group) {
+    long long free_inodes = 0;
+    for (int i = 0; i < fs->sb.num_groups; ++i) {
+        free_inodes += fs->groups[i].free_inodes;
+    }
+
+    long long average = free_inodes / fs->sb.num_groups;
+    int best = parent_group;
+
+    for (int i = 0; i < fs->sb.num_groups; ++i) {
+        int group = (parent_group + i) % fs->sb.num_groups;
+        const GroupDesc *desc = &fs->groups[group];
+
+        if (desc->free_inodes == 0 || desc->free_inodes < average) {
+            continue;
+        }
+
+        if (fs->groups[best].free_inodes == 0 || desc->free_blocks > fs->groups[best].free_blocks) {
+            best = group;
+        }
+    }
+
+    return best;
+}
+
+// Position of block_number inside its group's metadata, -1 for data blocks
+// and for anything outside the groups.
+static int metadata_offset(const FsContext *fs, int block_number, int *group) {
+    if (fs->groups == NULL || block_number < fs->sb.group_start) {
+        return -1;
+    }
+
+    *group = GROUP_OF_BLOCK(fs, block_number);
+    if (*group >= fs->sb.num_groups) {
+        return -1;
+    }
+
+    int offset = block_number - GROUP_START(fs, *group);
+    return offset < 2 + fs->sb.inode_table_blocks ? offset : -1;
+}
+
+// nonzero if block_number is group metadata that was never written, so it reads as zeros
+int group_block_uninit(FsContext *fs, int block_number) {
+    int group;
+    int offset = metadata_offset(fs, block_number, &group);
+    if (offset == -1) {
+        return 0;
+    }
+
+    rwlock_read(&fs->group_lock);
+
+    const GroupDesc *desc = &fs->groups[group];
+    int uninit;
+
+    if (fs->uninit_groups == 0) {
+        uninit = 0;
+    } else if (offset == 0) {
+        uninit = (desc->flags & GROUP_BLOCK_UNINIT) != 0;
+    } else if (offset == 1) {
+        uninit = (desc->flags & GROUP_INODE_UNINIT) != 0;
+    } else {
+        uninit = (desc->flags & GROUP_ITABLE_UNINIT) != 0 && offset - 2 >= desc->inode_table_init;
+    }
+
+    rwlock_unlock(&fs->group_lock);
+    return uninit;
+}
+
+// Clears the uninitialised state covering block_number before it is first
+// written. Inode table blocks skipped on the way are holes and stay zero.
+void group_block_written(FsContext *fs, int block_number) {
+    int group;
+    int offset = metadata_offset(fs, block_number, &group);
+    if (offset == -1) {
+        return;
+    }
+
+    GroupDesc *desc = &fs->groups[group];
+    int flags = desc->flags;
+
+    rwlock_write(&fs->group_lock);
+
+    if (offset == 0 && (flags & GROUP_BLOCK_UNINIT)) {
+        desc->flags &= ~GROUP_BLOCK_UNINIT;
+    } else if (offset == 1 && (flags & GROUP_INODE_UNINIT)) {
+        desc->flags &= ~GROUP_INODE_UNINIT;
+    } else if (offset >= 2 && (flags & GROUP_ITABLE_UNINIT) && offset - 2 >= desc->inode_table_init) {
+        desc->inode_table_init = offset - 1;
+        if (desc->inode_table_init == fs->sb.inode_table_blocks) {
+            desc->flags &= ~GROUP_ITABLE_UNINIT;
+        }
+    } else {
+        rwlock_unlock(&fs->group_lock);
+        return;
+    }
+
+    if (flags != 0 && desc->flags == 0) {
+        fs->uninit_groups--;
+    }
+
+    rwlock_unlock(&fs->group_lock);
+    write_group(fs, group);
+}
@@ -0,0 +1,598 @@
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static unsigned int checksum_update(unsigned int hash, const void *data, int size) {
+    const unsigned char *bytes = data;
+
+    for (int i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// blocks one descriptor can describe, bounded by the journal region as well
+static int pass_capacity(const Journal *journal) {
+    int per_descriptor = (journal->block_size - sizeof(JournalDescriptor)) / sizeof(int);
+    int per_region = journal->num_blocks - 3;
+
+    return per_descriptor < per_region ? per_descriptor : per_region;
+}
+
+static int slot_of(const Journal *journal, int block_number) {
+    unsigned int mask = journal->num_slots - 1;
+    unsigned int slot = ((unsigned int)block_number * 2654435761u) & mask;
+
+    while (journal->slots[slot] != 0 && journal->blocks[journal->slots[slot] - 1] != block_number) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static int grow(Journal *journal) {
+    int capacity = journal->capacity == 0 ? 16 : journal->capacity * 2;
+
+    int *blocks = realloc(journal->blocks, capacity * sizeof(int));
+    if (blocks == NULL) {
+        return -1;
+    }
+    journal->blocks = blocks;
+
+    char *data = realloc(journal->data, (size_t)capacity * journal->block_size);
+    if (data == NULL) {
+        return -1;
+    }
+    journal->data = data;
+
+    int *slots = calloc(capacity * 2, sizeof(int));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    free(journal->slots);
+    journal->slots = slots;
+    journal->num_slots = capacity * 2;
+    journal->capacity = capacity;
+
+    for (int i = 0; i < journal->count; ++i) {
+        journal->slots[slot_of(journal, journal->blocks[i])] = i + 1;
+    }
+
+    return 0;
+}
+
+static void reset(Journal *journal) {
+    journal->active = 0;
+    journal->count = 0;
+    journal->mark = 0;
+    journal->undo_count = 0;
+    journal->failed = 0;
+    journal->ops = 0;
+    journal->ops_ns = 0;
+
+    if (journal->slots != NULL) {
+        memset(journal->slots, 0, journal->num_slots * sizeof(int));
+    }
+}
+
+// Keeps the image of an entry an earlier operation logged before the running
+// one overwrites it, once per operation.
+static int save_undo(Journal *journal, int index) {
+    for (int i = 0; i < journal->undo_count; ++i) {
+        if (journal->undo[i] == index) {
+            return 0;
+        }
+    }
+
+    if (journal->undo_count == journal->undo_capacity) {
+        int capacity = journal->undo_capacity == 0 ? 8 : journal->undo_capacity * 2;
+
+        int *undo = realloc(journal->undo, capacity * sizeof(int));
+        if (undo == NULL) {
+            return -1;
+        }
+        journal->undo = undo;
+
+        char *data = realloc(journal->undo_data, (size_t)capacity * journal->block_size);
+        if (data == NULL) {
+            return -1;
+        }
+        journal->undo_data = data;
+        journal->undo_capacity = capacity;
+    }
+
+    memcpy(journal->undo_data + (size_t)journal->undo_count * journal->block_size,
+           journal->data + (size_t)index * journal->block_size, journal->block_size);
+    journal->undo[journal->undo_count++] = index;
+    return 0;
+}
+
+static void write_header(Journal *journal, BlockDevice *dev) {
+    char block[journal->block_size];
+    memset(block, 0, journal->block_size);
+
+    JournalHeader *header = (JournalHeader *)block;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = journal->sequence;
+
+    blockdev_write(dev, journal->start, block);
+}
+
+typedef struct LoggedBlock {
+    int home;  // home block number
+    int index; // position in the log
+} LoggedBlock;
+
+static int compare_logged(const void *a, const void *b) {
+    int x = ((const LoggedBlock *)a)->home;
+    int y = ((const LoggedBlock *)b)->home;
+
+    return (x > y) - (x < y);
+}
+
+// Writes the first count logged blocks home in block order. Neighbouring
+// home blocks, such as a file's data, are gathered from the log into one run
+// whatever order they were logged in; lone blocks stay in the cache.
+static void checkpoint(Journal *journal, BlockCache *cache, int count) {
+    int block_size = journal->block_size;
+
+    LoggedBlock order[count];
+    for (int i = 0; i < count; ++i) {
+        order[i].home = journal->blocks[i];
+        order[i].index = i;
+    }
+
+    qsort(order, count, sizeof(LoggedBlock), compare_logged);
+
+    struct iovec iov[count];
+
+    for (int i = 0; i < count;) {
+        int home = order[i].home;
+        int length = 1;
+        while (i + length < count && order[i + length].home == home + length) {
+            length++;
+        }
+
+        if (length == 1) {
+            cache_write(cache, home, journal->data + (size_t)order[i].index * block_size);
+        } else {
+            for (int j = 0; j < length; ++j) {
+                iov[j].iov_base = journal->data + (size_t)order[i + j].index * block_size;
+                iov[j].iov_len = block_size;
+            }
+            cache_write_vec(cache, home, iov, length);
+        }
+
+        i += length;
+    }
+}
+
+int journal_init(Journal *journal, int start, int num_blocks, int block_size, int thread_safe) {
+    memset(journal, 0, sizeof(*journal));
+    journal->start = start;
+    journal->num_blocks = num_blocks;
+    journal->block_size = block_size;
+    journal->group_ops = 1;
+    rwlock_init(&journal->lock, thread_safe);
+
+    if (num_blocks < 4) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void journal_destroy(Journal *journal) {
+    free(journal->blocks);
+    free(journal->data);
+    free(journal->slots);
+    free(journal->undo);
+    free(journal->undo_data);
+    rwlock_destroy(&journal->lock);
+    memset(journal, 0, sizeof(*journal));
+}
+
+int journal_recover(Journal *journal, BlockDevice *dev, int replay) {
+    int block_size = journal->block_size;
+    char block[block_size];
+
+    blockdev_read(dev, journal->start, block);
+    JournalHeader *header = (JournalHeader *)block;
+    if (header->magic != JOURNAL_MAGIC) {
+        return -1;
+    }
+    journal->sequence = header->sequence;
+
+    char descriptor_block[block_size];
+    blockdev_read(dev, journal->start + 1, descriptor_block);
+
+    JournalDescriptor *descriptor = (JournalDescriptor *)descriptor_block;
+    if (descriptor->magic != JOURNAL_DESCRIPTOR_MAGIC || descriptor->sequence != journal->sequence) {
+        return 0;
+    }
+
+    int count = descriptor->count;
+    if (count < 0 || count > pass_capacity(journal)) {
+        return 0;
+    }
+
+    unsigned int hash = checksum_update(2166136261u, descriptor_block, block_size);
+    for (int i = 0; i < count; ++i) {
+        blockdev_read(dev, journal->start + 2 + i, block);
+        hash = checksum_update(hash, block, block_size);
+    }
+
+    blockdev_read(dev, journal->start + 2 + count, block);
+    JournalCommit *commit = (JournalCommit *)block;
+    if (commit->magic != JOURNAL_COMMIT_MAGIC || commit->sequence != journal->sequence ||
+        commit->count != count || commit->checksum != hash) {
+        // the transaction never committed, its home blocks are untouched
+        return 0;
+    }
+
+    if (!replay) {
+        return 1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        blockdev_read(dev, journal->start + 2 + i, block);
+        blockdev_write(dev, descriptor->blocks[i], block);
+    }
+    blockdev_sync(dev);
+
+    journal->sequence++;
+    write_header(journal, dev);
+    blockdev_sync(dev);
+
+    journal->stats.replays++;
+    return 0;
+}
+
+// Starts an operation, in the running transaction when there is one.
+void journal_begin(Journal *journal) {
+    rwlock_write(&journal->lock);
+
+    if (!journal->active) {
+        reset(journal);
+        journal->active = 1;
+    }
+
+    journal->mark = journal->count;
+    journal->undo_count = 0;
+
+    rwlock_unlock(&journal->lock);
+}
+
+// nonzero while the running transaction holds no block, so reads go past it
+int journal_empty(Journal *journal) {
+    rwlock_read(&journal->lock);
+    int empty = !journal->active || journal->count == 0;
+    rwlock_unlock(&journal->lock);
+
+    return empty;
+}
+
+int journal_lookup(Journal *journal, int block_number, void *block) {
+    rwlock_read(&journal->lock);
+
+    int index = 0;
+    if (journal->active && journal->count > 0) {
+        index = journal->slots[slot_of(journal, block_number)];
+    }
+
+    if (index != 0) {
+        memcpy(block, journal->data + (size_t)(index - 1) * journal->block_size, journal->block_size);
+    }
+
+    rwlock_unlock(&journal->lock);
+    return index != 0;
+}
+
+unsigned long journal_checkpoints(Journal *journal) {
+    rwlock_read(&journal->lock);
+    unsigned long checkpoints = journal->checkpoints;
+    rwlock_unlock(&journal->lock);
+
+    return checkpoints;
+}
+
+int journal_holds(Journal *journal, const int *blocks, int count) {
+    rwlock_read(&journal->lock);
+
+    int held = 0;
+    if (journal->active && journal->count > 0) {
+        for (int i = 0; i < count && !held; ++i) {
+            held = journal->slots[slot_of(journal, blocks[i])] != 0;
+        }
+    }
+
+    rwlock_unlock(&journal->lock);
+    return held;
+}
+
+static int add_block(Journal *journal, int block_number, const void *block) {
+    if (journal->count > 0) {
+        int index = journal->slots[slot_of(journal, block_number)];
+        if (index != 0) {
+            if (index - 1 < journal->mark && save_undo(journal, index - 1) != 0) {
+                return -1;
+            }
+            memcpy(journal->data + (size_t)(index - 1) * journal->block_size, block, journal->block_size);
+            return 0;
+        }
+    }
+
+    if (journal->count == pass_capacity(journal)) {
+        return JOURNAL_FULL;
+    }
+
+    if (journal->count == journal->capacity && grow(journal) != 0) {
+        return -1;
+    }
+
+    int index = journal->count++;
+    journal->blocks[index] = block_number;
+    memcpy(journal->data + (size_t)index * journal->block_size, block, journal->block_size);
+    journal->slots[slot_of(journal, block_number)] = index + 1;
+
+    return 0;
+}
+
+int journal_add(Journal *journal, int block_number, const void *block) {
+    if (journal->failed) {
+        return -1;
+    }
+
+    rwlock_write(&journal->lock);
+    int ret = add_block(journal, block_number, block);
+    rwlock_unlock(&journal->lock);
+
+    return ret;
+}
+
+// Closes the running operation; returns whether the transaction is due.
+int journal_end(Journal *journal) {
+    long long now = now_ns();
+
+    if (journal->ops == 0) {
+        journal->first_ns = now;
+    }
+    journal->ops++;
+    journal->ops_ns += now;
+
+    journal->mark = journal->count;
+    journal->undo_count = 0;
+    journal->failed = 0;
+
+    return journal_due(journal);
+}
+
+// Due once group_ops operations wait, the first has waited group_ms (when
+// set), or the write set has filled half a pass, leaving the next operation
+// room without committing the ones before it.
+int journal_due(const Journal *journal) {
+    if (journal->ops == 0) {
+        return 0;
+    }
+
+    return journal->ops >= journal->group_ops ||
+           (journal->group_ms > 0 && now_ns() - journal->first_ns >= journal->group_ms * 1000000LL) ||
+           journal->count >= pass_capacity(journal) / 2;
+}
+
+// Logs the first count blocks of the write set as one transaction, then
+// checkpoints them in place.
+static int write_pass(Journal *journal, BlockDevice *dev, BlockCache *cache, int count) {
+    int block_size = journal->block_size;
+
+    char descriptor_block[block_size];
+    memset(descriptor_block, 0, block_size);
+
+    JournalDescriptor *descriptor = (JournalDescriptor *)descriptor_block;
+    descriptor->magic = JOURNAL_DESCRIPTOR_MAGIC;
+    descriptor->sequence = journal->sequence;
+    descriptor->count = count;
+    memcpy(descriptor->blocks, journal->blocks, count * sizeof(int));
+
+    unsigned int hash = checksum_update(2166136261u, descriptor_block, block_size);
+    hash = checksum_update(hash, journal->data, count * block_size);
+
+    char commit_block[block_size];
+    memset(commit_block, 0, block_size);
+
+    JournalCommit *commit = (JournalCommit *)commit_block;
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->sequence = journal->sequence;
+    commit->count = count;
+    commit->checksum = hash;
+
+    // The commit block may reach the disk before the rest of the write;
+    // its checksum rejects such a torn record at replay.
+    struct iovec iov[3] = {
+        { descriptor_block, block_size },
+        { journal->data, (size_t)count * block_size },
+        { commit_block, block_size }
+    };
+
+    if (blockdev_writev(dev, journal->start + 1, iov, 3) != 0 || blockdev_sync(dev) != 0) {
+        return -1;
+    }
+
+    checkpoint(journal, cache, count);
+    cache_flush(cache);
+    blockdev_sync(dev);
+
+    // retire the transaction; losing this write only means an idempotent replay
+    journal->sequence++;
+    write_header(journal, dev);
+
+    journal->stats.commits++;
+    journal->stats.blocks_logged += count;
+    return 0;
+}
+
+// Counts the finished operations a commit that began at start made durable.
+static void account(Journal *journal, long long start) {
+    if (journal->ops == 0) {
+        return;
+    }
+
+    long long end = now_ns();
+    unsigned long long took = end - start;
+    unsigned long long waited = end - journal->first_ns;
+
+    journal->stats.ops += journal->ops;
+    journal->stats.commit_ns += took;
+    journal->stats.wait_ns += journal->ops * end - journal->ops_ns;
+
+    if ((unsigned long)journal->ops > journal->stats.max_ops) {
+        journal->stats.max_ops = journal->ops;
+    }
+    if (took > journal->stats.max_commit_ns) {
+        journal->stats.max_commit_ns = took;
+    }
+    if (waited > journal->stats.max_wait_ns) {
+        journal->stats.max_wait_ns = waited;
+    }
+}
+
+// Logs the write set, then checkpoints it in place.
+int journal_commit(Journal *journal, BlockDevice *dev, BlockCache *cache) {
+    long long start = now_ns();
+
+    int ret = journal->count > 0 ? write_pass(journal, dev, cache, journal->count) : 0;
+    if (ret == 0) {
+        account(journal, start);
+    }
+
+    // the blocks are home, or some of them may be after a failed pass, and
+    // readers stop finding them here
+    rwlock_write(&journal->lock);
+    if (journal->count > 0) {
+        journal->checkpoints++;
+    }
+    reset(journal);
+    rwlock_unlock(&journal->lock);
+    return ret;
+}
+
+// Trades the images of the entries the running operation overwrote with
+// the ones from before it.
+static void swap_undo(Journal *journal) {
+    int block_size = journal->block_size;
+    char block[block_size];
+
+    for (int i = 0; i < journal->undo_count; ++i) {
+        char *logged = journal->data + (size_t)journal->undo[i] * block_size;
+        char *saved = journal->undo_data + (size_t)i * block_size;
+
+        memcpy(block, logged, block_size);
+        memcpy(logged, saved, block_size);
+        memcpy(saved, block, block_size);
+    }
+}
+
+static int compare_index(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Commits the operations before the running one: the entries below mark, as
+// they were before it overwrote some. What stays is the running operation's
+// own write set, those entries it overwrote included, as a transaction with
+// nothing before it, so an abort now drops all of it.
+int journal_commit_before(Journal *journal, BlockDevice *dev, BlockCache *cache) {
+    if (journal->mark == 0) {
+        return -1;
+    }
+
+    int block_size = journal->block_size;
+    long long start = now_ns();
+
+    rwlock_write(&journal->lock);
+
+    swap_undo(journal);
+    int ret = write_pass(journal, dev, cache, journal->mark);
+    swap_undo(journal);
+
+    if (ret != 0) {
+        rwlock_unlock(&journal->lock);
+        return -1;
+    }
+
+    account(journal, start);
+
+    // entries only move down, the overwritten ones first in log order
+    qsort(journal->undo, journal->undo_count, sizeof(int), compare_index);
+
+    int count = 0;
+    for (int i = 0; i < journal->undo_count; ++i, ++count) {
+        journal->blocks[count] = journal->blocks[journal->undo[i]];
+        memmove(journal->data + (size_t)count * block_size,
+                journal->data + (size_t)journal->undo[i] * block_size, block_size);
+    }
+    for (int i = journal->mark; i < journal->count; ++i, ++count) {
+        journal->blocks[count] = journal->blocks[i];
+        memmove(journal->data + (size_t)count * block_size, journal->data + (size_t)i * block_size, block_size);
+    }
+
+    memset(journal->slots, 0, journal->num_slots * sizeof(int));
+    for (int i = 0; i < count; ++i) {
+        journal->slots[slot_of(journal, journal->blocks[i])] = i + 1;
+    }
+
+    journal->count = count;
+    journal->mark = 0;
+    journal->undo_count = 0;
+    journal->checkpoints++;
+    journal->ops = 0;
+    journal->ops_ns = 0;
+
+    rwlock_unlock(&journal->lock);
+    return 0;
+}
+
+// Puts back what the running operation overwrote and drops what it added;
+// the operations before it stay in the transaction.
+void journal_abort(Journal *journal) {
+    rwlock_write(&journal->lock);
+
+    for (int i = 0; i < journal->undo_count; ++i) {
+        memcpy(journal->data + (size_t)journal->undo[i] * journal->block_size,
+               journal->undo_data + (size_t)i * journal->block_size, journal->block_size);
+    }
+
+    if (journal->count > journal->mark) {
+        memset(journal->slots, 0, journal->num_slots * sizeof(int));
+        journal->count = journal->mark;
+
+        for (int i = 0; i < journal->count; ++i) {
+            journal->slots[slot_of(journal, journal->blocks[i])] = i + 1;
+        }
+    }
+
+    journal->undo_count = 0;
+    journal->failed = 0;
+
+    if (journal->count == 0 && journal->ops == 0) {
+        reset(journal);
+    }
+
+    rwlock_unlock(&journal->lock);
+}
+
+int journal_pass_blocks(const Journal *journal) {
+    return pass_capacity(journal);
+}
@@ -0,0 +1,183 @@
+#include "listing.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int find_dir(const ListingCache *listing, int dir) {
+    for (int i = 0; i < listing->num_dirs; ++i) {
+        if (SEQ_LOAD(listing->dirs[i].dir) == dir) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// CLOCK, as in the block cache
+static Listing *evict_dir(ListingCache *listing) {
+    for (;;) {
+        Listing *slot = &listing->dirs[listing->hand];
+        listing->hand = (listing->hand + 1) % listing->num_dirs;
+
+        if (slot->dir == -1) {
+            return slot;
+        }
+
+        if (__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        return slot;
+    }
+}
+
+int listing_init(ListingCache *listing, int num_dirs, int entry_size, int thread_safe) {
+    memset(listing, 0, sizeof(*listing));
+    mutex_init(&listing->lock, thread_safe);
+    listing->entry_size = entry_size;
+
+    if (num_dirs == 0) {
+        return 0;
+    }
+
+    size_t words = (size_t)LISTING_ENTRIES * entry_size / sizeof(uint64_t);
+    listing->dirs = calloc(num_dirs, sizeof(Listing));
+    uint64_t *storage = malloc(num_dirs * words * sizeof(uint64_t));
+
+    if (listing->dirs == NULL || storage == NULL) {
+        free(listing->dirs);
+        free(storage);
+        listing->dirs = NULL;
+        mutex_destroy(&listing->lock);
+        return -1;
+    }
+
+    for (int i = 0; i < num_dirs; ++i) {
+        listing->dirs[i].dir = -1;
+        listing->dirs[i].words = storage + i * words;
+    }
+
+    listing->num_dirs = num_dirs;
+    return 0;
+}
+
+void listing_destroy(ListingCache *listing) {
+    if (listing->dirs != NULL) {
+        free(listing->dirs[0].words);
+    }
+    free(listing->dirs);
+    mutex_destroy(&listing->lock);
+    memset(listing, 0, sizeof(*listing));
+}
+
+int listing_copy(ListingCache *listing, int dir, void *entries, int max_entries) {
+    int index = find_dir(listing, dir);
+    if (index == -1) {
+        STAT_ADD(listing->stats.misses, 1);
+        return -1;
+    }
+
+    Listing *slot = &listing->dirs[index];
+    int words_per_entry = listing->entry_size / sizeof(uint64_t);
+
+    for (int attempt = 0; attempt < LISTING_RETRIES; ++attempt) {
+        unsigned int start = seq_read_begin(&slot->seq);
+
+        // the slot may have gone to another directory since it was found
+        int count = SEQ_LOAD(slot->count);
+        if (SEQ_LOAD(slot->dir) != dir) {
+            count = -1;
+        } else if (count > max_entries) {
+            count = max_entries > 0 ? max_entries : 0;
+        }
+
+        for (int i = 0; i < count * words_per_entry; ++i) {
+            uint64_t word = SEQ_LOAD(slot->words[i]);
+            memcpy((char *)entries + i * sizeof(word), &word, sizeof(word));
+        }
+
+        if (!seq_read_retry(&slot->seq, start)) {
+            if (count == -1) {
+                STAT_ADD(listing->stats.misses, 1);
+                return -1;
+            }
+
+            __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+            STAT_ADD(listing->stats.hits, 1);
+            return count;
+        }
+
+        STAT_ADD(listing->stats.retries, 1);
+    }
+
+    return -1;
+}
+
+int listing_kept(ListingCache *listing, int dir) {
+    return listing->num_dirs > 0 && find_dir(listing, dir) != -1;
+}
+
+static void drop_slot(ListingCache *listing, Listing *slot) {
+    seq_write_begin(&slot->seq);
+    SEQ_STORE(slot->dir, -1);
+    SEQ_STORE(slot->count, 0);
+    seq_write_end(&slot->seq);
+    listing->stats.drops++;
+}
+
+void listing_store(ListingCache *listing, int dir, const void *entries, int count) {
+    if (listing->num_dirs == 0) {
+        return;
+    }
+
+    mutex_lock(&listing->lock);
+
+    int index = find_dir(listing, dir);
+    if (count > LISTING_ENTRIES) {
+        if (index != -1) {
+            drop_slot(listing, &listing->dirs[index]);
+        }
+        mutex_unlock(&listing->lock);
+        return;
+    }
+
+    Listing *slot = index != -1 ? &listing->dirs[index] : evict_dir(listing);
+    int words = count * listing->entry_size / sizeof(uint64_t);
+
+    seq_write_begin(&slot->seq);
+    SEQ_STORE(slot->dir, dir);
+    SEQ_STORE(slot->count, count);
+    for (int i = 0; i < words; ++i) {
+        uint64_t word;
+        memcpy(&word, (const char *)entries + i * sizeof(word), sizeof(word));
+        SEQ_STORE(slot->words[i], word);
+    }
+    seq_write_end(&slot->seq);
+
+    __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+    listing->stats.stores++;
+    mutex_unlock(&listing->lock);
+}
+
+void listing_drop(ListingCache *listing, int dir) {
+    if (listing->num_dirs == 0) {
+        return;
+    }
+
+    mutex_lock(&listing->lock);
+    int index = find_dir(listing, dir);
+    if (index != -1) {
+        drop_slot(listing, &listing->dirs[index]);
+    }
+    mutex_unlock(&listing->lock);
+}
+
+void listing_clear(ListingCache *listing) {
+    mutex_lock(&listing->lock);
+    for (int i = 0; i < listing->num_dirs; ++i) {
+        if (listing->dirs[i].dir != -1) {
+            drop_slot(listing, &listing->dirs[i]);
+        }
+    }
+    mutex_unlock(&listing->lock);
+}
@@ -0,0 +1,301 @@
+#include "loadgen.h"
+#include "client.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOAD_MAX_CLIENTS 256
+#define LOAD_MAX_DEPTH 1024
+#define FILL_CHUNK (64 * 1024)
+
+// A request in flight, remembered until its reply comes back.
+typedef struct Sent {
+    long long at; // ns
+    int file;
+    int write;
+    long long offset;
+} Sent;
+
+typedef struct LoadClient {
+    const char *socket_path;
+    const LoadOptions *options;
+    long long deadline; // ns
+    unsigned int seed;
+
+    long long *latencies; // ns, one per reply
+    size_t count;
+    size_t capacity;
+    unsigned long errors;
+    unsigned long bad_reads;
+    int failed; // lost the connection
+} LoadClient;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// File f holds 'a' + (f * 7 + position) % 26 at each position, so the
+// bytes from any position on are a run of the alphabet repeated; alphabet
+// holds that run and returns where the one for file at position begins.
+static const char *expected(const char *alphabet, int file, long long position) {
+    return alphabet + (file * 7 + position) % 26;
+}
+
+static char *make_alphabet(int length) {
+    char *alphabet = malloc(length + 26);
+    if (alphabet != NULL) {
+        for (int i = 0; i < length + 26; ++i) {
+            alphabet[i] = 'a' + i % 26;
+        }
+    }
+    return alphabet;
+}
+
+static void file_path(char *path, int file) {
+    snprintf(path, MAX_PATH_SIZE, "/load/f%d", file);
+}
+
+void loadgen_default_options(LoadOptions *options) {
+    options->clients = 4;
+    options->depth = 16;
+    options->seconds = 5;
+    options->files = 16;
+    options->file_size = 1024 * 1024;
+    options->io_size = 4096;
+    options->write_percent = 10;
+}
+
+// Creates the files and fills them with their pattern.
+static int fill_files(const char *socket_path, const LoadOptions *options) {
+    FsClient client;
+    if (client_connect(&client, socket_path) != 0) {
+        fprintf(stderr, "Error: loadgen %s: cannot connect to the server\n", socket_path);
+        return -1;
+    }
+
+    // paths that are empty or relative must come back refused, not take the
+    // server down
+    int ret = 0;
+    const char *bad_paths[] = { "", "load" };
+    for (int i = 0; i < 2; ++i) {
+        if (client_create(&client, bad_paths[i]) != -1 || client.error != ERR_PATH) {
+            fprintf(stderr, "Error: loadgen: the server took the path \"%s\"\n", bad_paths[i]);
+            client_close(&client);
+            return -1;
+        }
+    }
+
+    if (client_mkdir(&client, "/load") != 0 && client.error != ERR_DIR_EXISTS) {
+        ret = -1;
+    }
+
+    char *alphabet = make_alphabet(FILL_CHUNK);
+    for (int f = 0; ret == 0 && f < options->files; ++f) {
+        char path[MAX_PATH_SIZE];
+        file_path(path, f);
+
+        if (client_create(&client, path) != 0 && client.error != ERR_FILE_EXISTS) {
+            ret = -1;
+            break;
+        }
+
+        for (long long at = 0; at < options->file_size; at += FILL_CHUNK) {
+            int length = options->file_size - at < FILL_CHUNK ? options->file_size - at : FILL_CHUNK;
+            if (client_pwrite(&client, path, expected(alphabet, f, at), length, at) != length) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    if (ret == 0 && client_sync(&client) != 0) {
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        print_error("loadgen", "/load", client.error);
+    }
+
+    free(alphabet);
+    client_close(&client);
+    return ret;
+}
+
+static int record(LoadClient *load, long long latency) {
+    if (load->count == load->capacity) {
+        size_t capacity = load->capacity > 0 ? load->capacity * 2 : 65536;
+        long long *grown = realloc(load->latencies, capacity * sizeof(long long));
+        if (grown == NULL) {
+            return -1;
+        }
+        load->latencies = grown;
+        load->capacity = capacity;
+    }
+
+    load->latencies[load->count++] = latency;
+    return 0;
+}
+
+static void *run_client(void *arg) {
+    LoadClient *load = arg;
+    const LoadOptions *options = load->options;
+
+    FsClient client;
+    if (client_connect(&client, load->socket_path) != 0) {
+        load->failed = 1;
+        return NULL;
+    }
+
+    Sent *sent = malloc(options->depth * sizeof(Sent));
+    char *alphabet = make_alphabet(options->io_size);
+    int blocks = options->file_size / options->io_size;
+    int head = 0;      // oldest request in flight
+    int in_flight = 0;
+
+    while (!load->failed && (in_flight > 0 || now_ns() < load->deadline)) {
+        // top the window up while there is time left
+        while (in_flight < options->depth && now_ns() < load->deadline) {
+            Sent *next = &sent[(head + in_flight) % options->depth];
+            next->file = rand_r(&load->seed) % options->files;
+            next->offset = (long long)(rand_r(&load->seed) % blocks) * options->io_size;
+            next->write = rand_r(&load->seed) % 100 < options->write_percent;
+
+            char path[MAX_PATH_SIZE];
+            file_path(path, next->file);
+
+            uint32_t id;
+            if (next->write) {
+                id = client_send(&client, WIRE_PWRITE, path, expected(alphabet, next->file, next->offset),
+                                 options->io_size, 0, next->offset);
+            } else {
+                id = client_send(&client, WIRE_PREAD, path, NULL, 0, options->io_size, next->offset);
+            }
+
+            if (id == 0) {
+                load->failed = 1;
+                break;
+            }
+            next->at = now_ns();
+            in_flight++;
+        }
+
+        if (in_flight == 0) {
+            break;
+        }
+
+        // the window goes out in one write and the replies that came back
+        // together are all taken before it is topped up, so requests and
+        // replies keep travelling in batches
+        if (client_flush(&client) != 0) {
+            load->failed = 1;
+            break;
+        }
+
+        do {
+            FsReply reply;
+            if (client_receive(&client, &reply) != 0) {
+                load->failed = 1;
+                break;
+            }
+
+            Sent *done = &sent[head];
+            head = (head + 1) % options->depth;
+            in_flight--;
+
+            if (record(load, now_ns() - done->at) != 0) {
+                load->failed = 1;
+                break;
+            }
+
+            if (reply.status != options->io_size) {
+                load->errors++;
+            } else if (!done->write &&
+                       memcmp(reply.data, expected(alphabet, done->file, done->offset), options->io_size) != 0) {
+                load->bad_reads++;
+            }
+        } while (in_flight > 0 && client_buffered(&client));
+    }
+
+    free(sent);
+    free(alphabet);
+    client_close(&client);
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const long long *sorted, size_t count, double percent) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t at = (size_t)(count * percent / 100);
+    return sorted[at < count ? at : count - 1] / 1000.0;
+}
+
+int loadgen(const char *socket_path, const LoadOptions *options) {
+    if (options->clients < 1 || options->clients > LOAD_MAX_CLIENTS || options->depth < 1 ||
+        options->depth > LOAD_MAX_DEPTH || options->seconds < 1 || options->files < 1 || options->io_size < 1 ||
+        (long long)options->depth * options->io_size > WIRE_MAX_FRAME || options->file_size < options->io_size ||
+        options->write_percent < 0 || options->write_percent > 100) {
+        fprintf(stderr, "Error: loadgen: bad options\n");
+        return -1;
+    }
+
+    if (fill_files(socket_path, options) != 0) {
+        return -1;
+    }
+
+    LoadClient *loads = calloc(options->clients, sizeof(LoadClient));
+    pthread_t threads[LOAD_MAX_CLIENTS];
+    long long start = now_ns();
+
+    for (int i = 0; i < options->clients; ++i) {
+        loads[i].socket_path = socket_path;
+        loads[i].options = options;
+        loads[i].deadline = start + options->seconds * 1000000000LL;
+        loads[i].seed = 12345 + i;
+        pthread_create(&threads[i], NULL, run_client, &loads[i]);
+    }
+
+    size_t total = 0;
+    unsigned long errors = 0;
+    unsigned long bad_reads = 0;
+    int failed = 0;
+    for (int i = 0; i < options->clients; ++i) {
+        pthread_join(threads[i], NULL);
+        total += loads[i].count;
+        errors += loads[i].errors;
+        bad_reads += loads[i].bad_reads;
+        failed += loads[i].failed;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    long long *all = malloc((total > 0 ? total : 1) * sizeof(long long));
+    size_t at = 0;
+    for (int i = 0; i < options->clients; ++i) {
+        memcpy(all + at, loads[i].latencies, loads[i].count * sizeof(long long));
+        at += loads[i].count;
+        free(loads[i].latencies);
+    }
+    qsort(all, total, sizeof(long long), compare_latency);
+
+    printf("loadgen: %d clients x depth %d, %d%% writes of %d bytes, %.1f s\n", options->clients, options->depth,
+           options->write_percent, options->io_size, elapsed);
+    printf("  requests: %zu (%.0f/s), errors: %lu, bad reads: %lu, lost connections: %d\n", total, total / elapsed,
+           errors, bad_reads, failed);
+    printf("  latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", percentile_us(all, total, 50),
+           percentile_us(all, total, 90), percentile_us(all, total, 99), percentile_us(all, total, 99.9),
+           total > 0 ? all[total - 1] / 1000.0 : 0);
+
+    free(all);
+    free(loads);
+    return errors > 0 || bad_reads > 0 || failed > 0 ? -1 : 0;
+}
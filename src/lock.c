@@ -0,0 +1,174 @@
+#define _GNU_SOURCE // F_OFD_SETLK
+#include "lock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+void rwlock_init(RwLock *lock, int enabled) {
+    lock->enabled = enabled;
+    if (enabled) {
+        pthread_rwlock_init(&lock->lock, NULL);
+    }
+}
+
+void rwlock_destroy(RwLock *lock) {
+    if (lock->enabled) {
+        pthread_rwlock_destroy(&lock->lock);
+        lock->enabled = 0;
+    }
+}
+
+void rwlock_read(RwLock *lock) {
+    if (lock->enabled) {
+        pthread_rwlock_rdlock(&lock->lock);
+    }
+}
+
+void rwlock_write(RwLock *lock) {
+    if (lock->enabled) {
+        pthread_rwlock_wrlock(&lock->lock);
+    }
+}
+
+void rwlock_unlock(RwLock *lock) {
+    if (lock->enabled) {
+        pthread_rwlock_unlock(&lock->lock);
+    }
+}
+
+unsigned int seq_read_begin(const SeqLock *lock) {
+    return __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE);
+}
+
+int seq_read_retry(const SeqLock *lock, unsigned int start) {
+    // the copy's loads may not drift past the second look at the count
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (start & 1) != 0 || __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != start;
+}
+
+void seq_write_begin(SeqLock *lock) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+    // and the writer's stores may not come before it turns odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seq_write_end(SeqLock *lock) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void mutex_init(Mutex *lock, int enabled) {
+    lock->enabled = enabled;
+    if (enabled) {
+        pthread_mutex_init(&lock->lock, NULL);
+    }
+}
+
+void mutex_destroy(Mutex *lock) {
+    if (lock->enabled) {
+        pthread_mutex_destroy(&lock->lock);
+        lock->enabled = 0;
+    }
+}
+
+void mutex_lock(Mutex *lock) {
+    if (lock->enabled) {
+        pthread_mutex_lock(&lock->lock);
+    }
+}
+
+void mutex_unlock(Mutex *lock) {
+    if (lock->enabled) {
+        pthread_mutex_unlock(&lock->lock);
+    }
+}
+
+// Open file description locks belong to the descriptor, so closing another
+// descriptor of the image does not drop them; plain record locks stand in
+// where the kernel headers lack them.
+#ifdef F_OFD_SETLKW
+#define IMAGE_SETLK F_OFD_SETLK
+#define IMAGE_SETLKW F_OFD_SETLKW
+#else
+#define IMAGE_SETLK F_SETLK
+#define IMAGE_SETLKW F_SETLKW
+#endif
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int image_lock_open(ImageLock *lock, const char *path, int create) {
+    memset(lock, 0, sizeof(*lock));
+    lock->mode = IMAGE_LOCK_NONE;
+    lock->fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    return lock->fd == -1 ? -1 : 0;
+}
+
+void image_lock_close(ImageLock *lock) {
+    if (lock->fd != -1) {
+        close(lock->fd);
+        lock->fd = -1;
+    }
+    lock->mode = IMAGE_LOCK_NONE;
+}
+
+int image_lock(ImageLock *lock, ImageLockMode mode) {
+    if (mode == lock->mode) {
+        return 0;
+    }
+
+    struct flock range;
+    memset(&range, 0, sizeof(range));
+    range.l_whence = SEEK_SET; // l_start and l_len 0: the whole file, however it grows
+
+    if (mode == IMAGE_LOCK_NONE) {
+        range.l_type = F_UNLCK;
+        if (fcntl(lock->fd, IMAGE_SETLK, &range) != 0) {
+            return -1;
+        }
+        lock->mode = mode;
+        return 0;
+    }
+
+    range.l_type = mode == IMAGE_LOCK_SHARED ? F_RDLCK : F_WRLCK;
+    lock->stats.locks++;
+
+    // try first, so that only a request another process holds up is timed
+    if (fcntl(lock->fd, IMAGE_SETLK, &range) != 0) {
+        if (errno != EAGAIN && errno != EACCES) {
+            return -1;
+        }
+
+        long long start = now_ns();
+        while (fcntl(lock->fd, IMAGE_SETLKW, &range) != 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+
+        unsigned long long waited = now_ns() - start;
+        lock->stats.waits++;
+        lock->stats.wait_ns += waited;
+        if (waited > lock->stats.max_wait_ns) {
+            lock->stats.max_wait_ns = waited;
+        }
+    }
+
+    lock->mode = mode;
+    return 0;
+}
+
+int image_lock_moved(const ImageLock *lock, const char *path) {
+    struct stat held;
+    struct stat named;
+    if (fstat(lock->fd, &held) != 0 || stat(path, &named) != 0) {
+        return 1;
+    }
+
+    return held.st_dev != named.st_dev || held.st_ino != named.st_ino;
+}
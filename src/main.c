@@ -1,191 +1,721 @@
-#include <stdio.h>
-#include <string.h>
-#include <assert.h>
-#include "fs.h"
-#include "fs_types.h"
-
-
-void print_commands() {
-    printf("Usage:\n");
-    printf("  ./mini_fs mkfs\n");
-    printf("  ./mini_fs mkdir_fs <path>\n");
-    printf("  ./mini_fs create_fs <path>\n");
-    printf("  ./mini_fs write_fs <path> <data>\n");
-    printf("  ./mini_fs read_fs <path>\n");
-    printf("  ./mini_fs delete_fs <path>\n");
-    printf("  ./mini_fs rmdir_fs <path>\n");
-    printf("  ./mini_fs ls_fs <path>\n");
-}
-
-
-void self_test() {
-    printf("$ ./mini_fs mkfs\n");
-    mkfs("disk.img");
-
-    printf("$ ./mini_fs mkdir_fs /dir1/\n");
-    mkdir_fs("/dir1/");
-
-    printf("$ ./mini_fs create_fs /file1.txt\n");
-    create_fs("/file1.txt");
-
-    printf("$ ./mini_fs create_fs /dir1/file2.txt\n");
-    create_fs("/dir1/file2.txt");
-
-    printf("$ ./mini_fs write_fs \"hello world1\"\n");
-    int size = write_fs("/file1.txt", "hello world1");
-    printf("%d\n", size);
-
-    printf("$ ./mini_fs write_fs /dir1/file2.txt \"hello world2\"\n");
-    size = write_fs("/dir1/file2.txt", "hello world2");
-    size = printf("%d\n", size);
-
-    printf("$ ./mini_fs read_fs /file1.txt\n");
-    char buffer[100];
-    size = read_fs("/file1.txt", buffer, 100);
-    buffer[size] = '\0';
-    printf("%s\n", buffer);
-
-    printf("$ ./mini_fs read_fs /dir1/file2.txt\n");
-    size = read_fs("/dir1/file2.txt", buffer, 100);
-    buffer[size] = '\0';
-    printf("%s\n", buffer);
-
-    printf("$ ./mini_fs ls_fs /dir1/\n");
-    DirectoryEntry entries[10];
-    int count = ls_fs("/dir1/", entries, 10);
-    for (int i = 0; i < count; ++i) {
-        printf("%s\n", entries[i].name);
-    }
-
-    printf("$ ./mini_fs delete_fs /file1.txt\n");
-    delete_fs("/file1.txt");
-
-    printf("$ ./mini_fs ls_fs /\n");
-    count = ls_fs("/", entries, 10);
-    for (int i = 0; i < count; ++i) {
-        printf("%s\n", entries[i].name);
-    }
-
-    printf("$ ./mini_fs delete_fs /dir1/file2.txt\n");
-    delete_fs("/dir1/file2.txt");
-
-    printf("$ ./mini_fs ls_fs /dir1\n");
-    count = ls_fs("/dir1", entries, 10);
-    for (int i = 0; i < count; ++i) {
-        printf("%s\n", entries[i].name);
-    }
-
-    printf("$ ./mini_fs rmdir_fs /dir1/\n");
-    rmdir_fs("/dir1/");
-
-    printf("$ ./mini_fs ls_fs /\n");
-    count = ls_fs("/", entries, 10);
-    for (int i = 0; i < count; ++i) {
-        printf("%s\n", entries[i].name);
-    }
-}
-
-int main(int argc, char *argv[]) {
-
-    if (argc < 2) {
-        self_test();
-        return 0;
-    }
-
-
-    if (strcmp(argv[1], "mkfs") == 0) {
-        mkfs("disk.img");
-    }
-
-
-    else if (strcmp(argv[1], "mkdir_fs") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Error: mkdir_fs requires <path>.\n");
-            print_commands();
-            return 1;
-        }
-        mkdir_fs(argv[2]);
-    } 
-
-
-    else if (strcmp(argv[1], "create_fs") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Error: create_fs requires <path>.\n");
-            print_commands();
-            return 1;
-        }
-        create_fs(argv[2]);
-    }
-
-
-    else if (strcmp(argv[1], "write_fs") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Error: write_fs requires <path> <data>.\n");
-            print_commands();
-            return 1;
-        }
-
-        int size = write_fs(argv[2], argv[3]);
-        if (size != -1) {
-            printf("%d\n", size);
-        }
-    }
-
-
-    else if (strcmp(argv[1], "read_fs") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Error: read_fs requires <path>.\n");
-            print_commands();
-            return 1;
-        }
-        char buf[100]; 
-        int bytes = read_fs(argv[2], buf, sizeof(buf)-1);
-        if (bytes > 0) {
-            buf[bytes] = '\0';
-            printf("%s\n", buf);
-        }
-    }
-
-
-    else if (strcmp(argv[1], "delete_fs") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Error: delete_fs requires <path>.\n");
-            print_commands();
-            return 1;
-        }
-        delete_fs(argv[2]);
-    }
-
-
-    else if (strcmp(argv[1], "rmdir_fs") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Error: rmdir_fs requires <path>.\n");
-            print_commands();
-            return 1;
-        }
-        rmdir_fs(argv[2]);
-    }
-
-
-    else if (strcmp(argv[1], "ls_fs") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Error: ls_fs requires <path>.\n");
-            print_commands();
-            return 1;
-        }
-        DirectoryEntry entries[10];
-        int count = ls_fs(argv[2], entries, 128);
-        for (int i = 0; i < count; ++i) {
-            printf("%s\n", entries[i].name);
-        }
-    }
-
-
-    else {
-        fprintf(stderr, "Error: Unknown command '%s'.\n", argv[1]);
-        print_commands();
-        return 1;
-    }
-
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "fs.h"
+#include "fs_types.h"
+#include "contend.h"
+#include "loadgen.h"
+#include "server.h"
+
+
+void print_commands() {
+    printf("Usage:\n");
+    printf("  ./mini_fs mkfs [<size> <block size> <inode ratio>]\n");
+    printf("  ./mini_fs mkdir_fs <path>\n");
+    printf("  ./mini_fs create_fs <path>\n");
+    printf("  ./mini_fs write_fs <path> <data>\n");
+    printf("  ./mini_fs read_fs <path>\n");
+    printf("  ./mini_fs delete_fs <path>\n");
+    printf("  ./mini_fs rmdir_fs <path>\n");
+    printf("  ./mini_fs ls_fs <path>\n");
+    printf("  ./mini_fs preallocate_fs <path> <size>\n");
+    printf("  ./mini_fs pwrite_fs <path> <offset> <data>\n");
+    printf("  ./mini_fs pread_fs <path> <offset> <length>\n");
+    printf("  ./mini_fs batch [--atomic] [--group-commit <ops> <ms>] [<script>]\n");
+    printf("  ./mini_fs serve [--threads <n>] [--group-commit <ops> <ms>] <socket>\n");
+    printf("  ./mini_fs loadgen <socket> [--clients <n>] [--depth <n>] [--seconds <n>] [--files <n>]\n");
+    printf("                             [--size <bytes>] [--io <bytes>] [--writes <percent>]\n");
+    printf("  ./mini_fs contend [--readers <n>] [--seconds <n>] [--files <n>]\n");
+    printf("In a batch, where handles outlive a command:\n");
+    printf("  open_fs <path>\n");
+    printf("  pwrite_fd <handle> <offset> <data>\n");
+    printf("  pread_fd <handle> <offset> <length>\n");
+    printf("  close_fs <handle>\n");
+}
+
+
+// accepts a plain byte count or one with a K, M, G or T suffix
+long long parse_size(const char *text) {
+    char *end;
+    long long size = strtoll(text, &end, 10);
+
+    switch (*end) {
+    case 'T': case 't': size *= 1024;
+    /* fall through */
+    case 'G': case 'g': size *= 1024;
+    /* fall through */
+    case 'M': case 'm': size *= 1024;
+    /* fall through */
+    case 'K': case 'k': size *= 1024;
+        end++;
+        break;
+    }
+
+    return *end == '\0' ? size : -1;
+}
+
+
+void self_test() {
+    printf("$ ./mini_fs mkfs\n");
+    mkfs("disk.img");
+
+    printf("$ ./mini_fs mkdir_fs /dir1/\n");
+    mkdir_fs("/dir1/");
+
+    printf("$ ./mini_fs create_fs /file1.txt\n");
+    create_fs("/file1.txt");
+
+    printf("$ ./mini_fs create_fs /dir1/file2.txt\n");
+    create_fs("/dir1/file2.txt");
+
+    printf("$ ./mini_fs write_fs \"hello world1\"\n");
+    int size = write_fs("/file1.txt", "hello world1");
+    printf("%d\n", size);
+
+    printf("$ ./mini_fs write_fs /dir1/file2.txt \"hello world2\"\n");
+    size = write_fs("/dir1/file2.txt", "hello world2");
+    size = printf("%d\n", size);
+
+    printf("$ ./mini_fs read_fs /file1.txt\n");
+    char buffer[100];
+    size = read_fs("/file1.txt", buffer, 100);
+    buffer[size] = '\0';
+    printf("%s\n", buffer);
+
+    printf("$ ./mini_fs read_fs /dir1/file2.txt\n");
+    size = read_fs("/dir1/file2.txt", buffer, 100);
+    buffer[size] = '\0';
+    printf("%s\n", buffer);
+
+    printf("$ ./mini_fs ls_fs /dir1/\n");
+    DirectoryEntry entries[10];
+    int count = ls_fs("/dir1/", entries, 10);
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n", entries[i].name);
+    }
+
+    printf("$ ./mini_fs delete_fs /file1.txt\n");
+    delete_fs("/file1.txt");
+
+    printf("$ ./mini_fs ls_fs /\n");
+    count = ls_fs("/", entries, 10);
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n", entries[i].name);
+    }
+
+    printf("$ ./mini_fs delete_fs /dir1/file2.txt\n");
+    delete_fs("/dir1/file2.txt");
+
+    printf("$ ./mini_fs ls_fs /dir1\n");
+    count = ls_fs("/dir1", entries, 10);
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n", entries[i].name);
+    }
+
+    printf("$ ./mini_fs rmdir_fs /dir1/\n");
+    rmdir_fs("/dir1/");
+
+    printf("$ ./mini_fs ls_fs /\n");
+    count = ls_fs("/", entries, 10);
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n", entries[i].name);
+    }
+}
+
+int make_image(int argc, char *argv[]) {
+    if (argc != 1 && argc != 4) {
+        fprintf(stderr, "Error: mkfs takes no arguments or <size> <block size> <inode ratio>.\n");
+        print_commands();
+        return 1;
+    }
+
+    if (argc == 1) {
+        mkfs("disk.img");
+    } else {
+        MkfsOptions options;
+        options.image_size = parse_size(argv[1]);
+        options.block_size = parse_size(argv[2]);
+        options.inode_ratio = parse_size(argv[3]);
+
+        if (mkfs_with("disk.img", &options) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void list_directory(FsContext *fs, const char *path) {
+    int max_entries = 128;
+    DirectoryEntry *entries = NULL;
+    int count = -1;
+
+    // a full buffer may mean more entries, so grow it and list again
+    for (;;) {
+        DirectoryEntry *grown = realloc(entries, max_entries * sizeof(DirectoryEntry));
+        if (grown == NULL) {
+            break;
+        }
+        entries = grown;
+
+        count = fs_ls(fs, path, entries, max_entries);
+        if (count < max_entries) {
+            break;
+        }
+        max_entries *= 2;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n", entries[i].name);
+    }
+
+    free(entries);
+}
+
+
+// Runs one command against the mounted image; argv[0] is the command. Returns
+// 1 when the command line is wrong, 0 otherwise: filesystem errors are printed
+// by the calls themselves.
+int run_command(FsContext *fs, int argc, char *argv[]) {
+
+    if (strcmp(argv[0], "mkdir_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: mkdir_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+        fs_mkdir(fs, argv[1]);
+    }
+
+
+    else if (strcmp(argv[0], "create_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: create_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+        fs_create(fs, argv[1]);
+    }
+
+
+    else if (strcmp(argv[0], "write_fs") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: write_fs requires <path> <data>.\n");
+            print_commands();
+            return 1;
+        }
+
+        int size = fs_write(fs, argv[1], argv[2]);
+        if (size != -1) {
+            printf("%d\n", size);
+        }
+    }
+
+
+    else if (strcmp(argv[0], "read_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: read_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+        char buf[100];
+        int bytes = fs_read(fs, argv[1], buf, sizeof(buf)-1);
+        if (bytes > 0) {
+            buf[bytes] = '\0';
+            printf("%s\n", buf);
+        }
+    }
+
+
+    else if (strcmp(argv[0], "delete_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: delete_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+        fs_delete(fs, argv[1]);
+    }
+
+
+    else if (strcmp(argv[0], "rmdir_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: rmdir_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+        fs_rmdir(fs, argv[1]);
+    }
+
+
+    else if (strcmp(argv[0], "ls_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: ls_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+        list_directory(fs, argv[1]);
+    }
+
+
+    else if (strcmp(argv[0], "preallocate_fs") == 0) {
+        long long size = argc == 3 ? parse_size(argv[2]) : -1;
+        if (size < 0) {
+            fprintf(stderr, "Error: preallocate_fs requires <path> <size>.\n");
+            print_commands();
+            return 1;
+        }
+        fs_preallocate(fs, argv[1], size);
+    }
+
+
+    else if (strcmp(argv[0], "pwrite_fs") == 0 || strcmp(argv[0], "pwrite_fd") == 0) {
+        int by_handle = strcmp(argv[0], "pwrite_fd") == 0;
+        if (argc != 4) {
+            fprintf(stderr, "Error: %s requires <%s> <offset> <data>.\n", argv[0], by_handle ? "handle" : "path");
+            print_commands();
+            return 1;
+        }
+
+        int size = by_handle ? fs_pwrite_fd(fs, atoi(argv[1]), argv[3], strlen(argv[3]), parse_size(argv[2]))
+                             : fs_pwrite(fs, argv[1], argv[3], strlen(argv[3]), parse_size(argv[2]));
+        if (size != -1) {
+            printf("%d\n", size);
+        }
+    }
+
+
+    else if (strcmp(argv[0], "pread_fs") == 0 || strcmp(argv[0], "pread_fd") == 0) {
+        int by_handle = strcmp(argv[0], "pread_fd") == 0;
+        long long length = argc == 4 ? parse_size(argv[3]) : -1;
+        if (length < 0 || length > 0x7fffffff) {
+            fprintf(stderr, "Error: %s requires <%s> <offset> <length>.\n", argv[0], by_handle ? "handle" : "path");
+            print_commands();
+            return 1;
+        }
+
+        char *buf = malloc(length > 0 ? length : 1);
+        int bytes = -1;
+        if (buf != NULL) {
+            bytes = by_handle ? fs_pread_fd(fs, atoi(argv[1]), buf, length, parse_size(argv[2]))
+                              : fs_pread(fs, argv[1], buf, length, parse_size(argv[2]));
+        }
+        if (bytes >= 0) {
+            fwrite(buf, 1, bytes, stdout);
+            printf("\n");
+        }
+        free(buf);
+    }
+
+
+    else if (strcmp(argv[0], "open_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: open_fs requires <path>.\n");
+            print_commands();
+            return 1;
+        }
+
+        int handle = fs_open(fs, argv[1]);
+        if (handle != -1) {
+            printf("%d\n", handle);
+        }
+    }
+
+
+    else if (strcmp(argv[0], "close_fs") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Error: close_fs requires <handle>.\n");
+            print_commands();
+            return 1;
+        }
+        fs_close(fs, atoi(argv[1]));
+    }
+
+
+    else {
+        fprintf(stderr, "Error: Unknown command '%s'.\n", argv[0]);
+        print_commands();
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// Splits a script line into words the way the shell does for the quoting
+// tests/commands.txt uses: blanks separate words, quotes keep blanks inside
+// one, and a backslash keeps the next character. Words are written back into
+// line. Returns the word count, or -1 for an unterminated quote.
+int split_line(char *line, char *words[], int max_words) {
+    char *in = line;
+    char *out = line;
+    int count = 0;
+
+    for (;;) {
+        while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n') {
+            in++;
+        }
+
+        if (*in == '\0' || *in == '#' || count == max_words) {
+            return count;
+        }
+
+        words[count++] = out;
+        char quote = 0;
+
+        while (*in != '\0' && (quote != 0 || (*in != ' ' && *in != '\t' && *in != '\r' && *in != '\n'))) {
+            if (quote == 0 && (*in == '"' || *in == '\'')) {
+                quote = *in++;
+            } else if (quote != 0 && *in == quote) {
+                quote = 0;
+                in++;
+            } else if (*in == '\\' && quote != '\'' && in[1] != '\0') {
+                *out++ = in[1];
+                in += 2;
+            } else {
+                *out++ = *in++;
+            }
+        }
+
+        if (quote != 0) {
+            return -1;
+        }
+
+        // out never passes in, so the terminator at most replaces the blank
+        // that ended the word
+        int more = *in != '\0';
+        *out++ = '\0';
+        if (!more) {
+            return count;
+        }
+        in++;
+    }
+}
+
+
+#define BATCH_WORDS 16
+#define BATCH_DEPTH 8
+
+// A batch run: every command shares one mount of disk.img, which is only
+// opened once a command needs it so that a script may start with mkfs.
+typedef struct Session {
+    FsContext fs;
+    MountOptions options;
+    int mounted;
+    int atomic; // inside a batch --atomic
+    int depth;  // scripts being run
+} Session;
+
+int run_line(Session *session, int argc, char *argv[]);
+
+int session_mount(Session *session, const char *command, const char *path) {
+    if (session->mounted) {
+        return 0;
+    }
+
+    ErrorCode code = fs_mount_with("disk.img", &session->options, &session->fs);
+    if (code != ERR_NONE) {
+        print_error(command, path, code);
+        return -1;
+    }
+
+    session->mounted = 1;
+    return 0;
+}
+
+// Runs each line of a script. Output is flushed per command so that it
+// interleaves with error messages as it does one process per command.
+int run_script(Session *session, FILE *in, const char *name) {
+    char *line = NULL;
+    size_t capacity = 0;
+    int number = 0;
+    int ret = 0;
+
+    while (getline(&line, &capacity, in) != -1) {
+        number++;
+
+        char *words[BATCH_WORDS];
+        int count = split_line(line, words, BATCH_WORDS);
+        if (count == 0) {
+            continue;
+        }
+
+        int failed;
+        if (count == -1) {
+            fprintf(stderr, "Error: %s line %d: unterminated quote.\n", name, number);
+            failed = 1;
+        } else {
+            failed = run_line(session, count, words) != 0;
+        }
+        fflush(stdout);
+
+        // an atomic batch stops at its first failure
+        if (session->atomic && (failed || fs_batch_failed(&session->fs))) {
+            fprintf(stderr, "Error: batch %s: line %d failed.\n", name, number);
+            ret = 1;
+            break;
+        }
+    }
+
+    free(line);
+    return ret;
+}
+
+// batch [--atomic] [--group-commit <ops> <ms>] [<script>], from the command
+// line or from a script
+int run_batch(Session *session, int argc, char *argv[]) {
+    int atomic = 0;
+    int group_ops = 0;
+    int group_ms = 0;
+    int arg = 1;
+
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--atomic") == 0) {
+            atomic = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--group-commit") == 0 && arg + 2 < argc &&
+                   atoi(argv[arg + 1]) > 0 && atoi(argv[arg + 2]) >= 0) {
+            group_ops = atoi(argv[arg + 1]);
+            group_ms = atoi(argv[arg + 2]);
+            arg += 3;
+        } else {
+            break;
+        }
+    }
+
+    if (argc > arg + 1 || (arg < argc && strncmp(argv[arg], "--", 2) == 0)) {
+        fprintf(stderr, "Error: batch takes [--atomic] [--group-commit <ops> <ms>] [<script>].\n");
+        print_commands();
+        return 1;
+    }
+
+    // a mount keeps the commit policy it was made with, so remount under
+    // the new one; unmounting commits whatever the old group held
+    if (group_ops > 0 && !session->atomic) {
+        if (session->mounted) {
+            session->mounted = 0;
+            if (fs_unmount(&session->fs) != 0) {
+                return 1;
+            }
+        }
+        session->options.commit_ops = group_ops;
+        session->options.commit_ms = group_ms;
+    }
+
+    const char *name = arg < argc ? argv[arg] : "-";
+    if (session->depth == BATCH_DEPTH) {
+        fprintf(stderr, "Error: batch %s: scripts nested too deep.\n", name);
+        return 1;
+    }
+
+    FILE *in = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Error: batch %s: cannot open script.\n", name);
+        return 1;
+    }
+
+    session->depth++;
+    int ret;
+
+    if (atomic && !session->atomic) {
+        if (session_mount(session, "batch", name) != 0) {
+            ret = 1;
+        } else {
+            fs_begin_batch(&session->fs);
+            session->atomic = 1;
+            ret = run_script(session, in, name);
+            session->atomic = 0;
+
+            if (fs_end_batch(&session->fs, ret == 0) != 0) {
+                fprintf(stderr, "Error: batch %s: nothing was written.\n", name);
+                ret = 1;
+            }
+        }
+    } else {
+        ret = run_script(session, in, name);
+    }
+
+    session->depth--;
+    if (in != stdin) {
+        fclose(in);
+    }
+    return ret;
+}
+
+int run_line(Session *session, int argc, char *argv[]) {
+    if (strcmp(argv[0], "batch") == 0) {
+        return run_batch(session, argc, argv);
+    }
+
+    if (strcmp(argv[0], "mkfs") == 0) {
+        if (session->atomic) {
+            fprintf(stderr, "Error: mkfs cannot run inside an atomic batch.\n");
+            return 1;
+        }
+
+        if (session->mounted) {
+            session->mounted = 0;
+            if (fs_unmount(&session->fs) != 0) {
+                return 1;
+            }
+        }
+        return make_image(argc, argv);
+    }
+
+    if (session_mount(session, argv[0], argc > 1 ? argv[1] : "") != 0) {
+        return 1;
+    }
+
+    return run_command(&session->fs, argc, argv);
+}
+
+// serve [--threads <n>] [--group-commit <ops> <ms>] <socket>: disk.img
+// stays mounted until the server is stopped
+int run_server(int argc, char *argv[]) {
+    MountOptions options;
+    fs_default_options(&options);
+    int threads = 1;
+    int arg = 1;
+
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0 &&
+            atoi(argv[arg + 1]) <= SERVER_MAX_THREADS) {
+            threads = atoi(argv[arg + 1]);
+            arg += 2;
+        } else if (strcmp(argv[arg], "--group-commit") == 0 && arg + 2 < argc &&
+                   atoi(argv[arg + 1]) > 0 && atoi(argv[arg + 2]) >= 0) {
+            options.commit_ops = atoi(argv[arg + 1]);
+            options.commit_ms = atoi(argv[arg + 2]);
+            arg += 3;
+        } else {
+            break;
+        }
+    }
+
+    if (argc != arg + 1) {
+        fprintf(stderr, "Error: serve takes [--threads <n>] [--group-commit <ops> <ms>] <socket>.\n");
+        print_commands();
+        return 1;
+    }
+
+    ServerStats stats;
+    if (serve("disk.img", argv[arg], &options, threads, &stats) != 0) {
+        return 1;
+    }
+
+    printf("served %lu requests from %lu clients in %lu socket reads and %lu writes\n", stats.requests,
+           stats.connections, stats.reads, stats.writes);
+    return 0;
+}
+
+// loadgen <socket> [--clients <n>] [--depth <n>] [--seconds <n>] [--files <n>]
+// [--size <bytes>] [--io <bytes>] [--writes <percent>]
+int run_loadgen(int argc, char *argv[]) {
+    LoadOptions options;
+    loadgen_default_options(&options);
+
+    if (argc < 2 || strncmp(argv[1], "--", 2) == 0) {
+        fprintf(stderr, "Error: loadgen takes <socket> [options].\n");
+        print_commands();
+        return 1;
+    }
+
+    for (int arg = 2; arg < argc; arg += 2) {
+        long long value = arg + 1 < argc ? parse_size(argv[arg + 1]) : -1;
+        int *field = NULL;
+
+        if (strcmp(argv[arg], "--clients") == 0) {
+            field = &options.clients;
+        } else if (strcmp(argv[arg], "--depth") == 0) {
+            field = &options.depth;
+        } else if (strcmp(argv[arg], "--seconds") == 0) {
+            field = &options.seconds;
+        } else if (strcmp(argv[arg], "--files") == 0) {
+            field = &options.files;
+        } else if (strcmp(argv[arg], "--size") == 0) {
+            field = &options.file_size;
+        } else if (strcmp(argv[arg], "--io") == 0) {
+            field = &options.io_size;
+        } else if (strcmp(argv[arg], "--writes") == 0) {
+            field = &options.write_percent;
+        }
+
+        if (field == NULL || value < 0 || value > 0x7fffffff) {
+            fprintf(stderr, "Error: loadgen: bad option '%s'.\n", argv[arg]);
+            print_commands();
+            return 1;
+        }
+        *field = value;
+    }
+
+    return loadgen(argv[1], &options) == 0 ? 0 : 1;
+}
+
+// contend [--readers <n>] [--seconds <n>] [--files <n>]: readers listing a
+// directory of disk.img against a writer changing it
+int run_contend(int argc, char *argv[]) {
+    ContendOptions options;
+    contend_default_options(&options);
+
+    for (int arg = 1; arg < argc; arg += 2) {
+        int value = arg + 1 < argc ? atoi(argv[arg + 1]) : 0;
+        int *field = NULL;
+
+        if (strcmp(argv[arg], "--readers") == 0) {
+            field = &options.readers;
+        } else if (strcmp(argv[arg], "--seconds") == 0) {
+            field = &options.seconds;
+        } else if (strcmp(argv[arg], "--files") == 0) {
+            field = &options.files;
+        }
+
+        if (field == NULL || value <= 0) {
+            fprintf(stderr, "Error: contend: bad option '%s'.\n", argv[arg]);
+            print_commands();
+            return 1;
+        }
+        *field = value;
+    }
+
+    return contend("disk.img", &options) == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc < 2) {
+        self_test();
+        return 0;
+    }
+
+    // the server and its load generator are long-running front ends, not
+    // commands a batch could run
+    if (strcmp(argv[1], "serve") == 0) {
+        return run_server(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[1], "loadgen") == 0) {
+        return run_loadgen(argc - 1, argv + 1);
+    }
+
+    if (strcmp(argv[1], "contend") == 0) {
+        return run_contend(argc - 1, argv + 1);
+    }
+
+    Session session;
+    memset(&session, 0, sizeof(session));
+    fs_default_options(&session.options);
+
+    // a lone command that only reads shares the image with other readers
+    if (strcmp(argv[1], "read_fs") == 0 || strcmp(argv[1], "ls_fs") == 0 || strcmp(argv[1], "pread_fs") == 0) {
+        session.options.image_lock = IMAGE_LOCK_SHARED;
+    }
+
+    int ret = run_line(&session, argc - 1, argv + 1);
+
+    if (session.mounted && fs_unmount(&session.fs) != 0) {
+        ret = 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,219 @@
+#include "readahead.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void wait_prefetch(BlockDevice *dev, FileReadahead *file) {
+    while (file->pending > 0) {
+        blockdev_reap(dev, 1);
+    }
+
+    if (file->failed) {
+        file->count = 0;
+        file->used = 0;
+        file->failed = 0;
+    }
+}
+
+// Drops the prefetch, counting what was never read. Returns that count.
+static int retire(Readahead *ra, BlockDevice *dev, FileReadahead *file) {
+    wait_prefetch(dev, file);
+
+    int unread = file->count - file->used;
+    ra->stats.wasted += unread;
+
+    file->count = 0;
+    file->used = 0;
+    return unread;
+}
+
+static void release(Readahead *ra, BlockDevice *dev, FileReadahead *file) {
+    retire(ra, dev, file);
+
+    free(file->data);
+    memset(file, 0, sizeof(*file));
+    file->inode_number = -1;
+}
+
+void readahead_init(Readahead *ra, int block_size) {
+    memset(ra, 0, sizeof(*ra));
+    ra->block_size = block_size;
+    ra->max_window = READAHEAD_MAX_BYTES / block_size;
+    if (ra->max_window < READAHEAD_MIN_WINDOW) {
+        ra->max_window = READAHEAD_MIN_WINDOW;
+    }
+
+    for (int i = 0; i < READAHEAD_FILES; ++i) {
+        ra->files[i].inode_number = -1;
+    }
+}
+
+void readahead_destroy(Readahead *ra, BlockDevice *dev) {
+    for (int i = 0; i < READAHEAD_FILES; ++i) {
+        if (ra->files[i].inode_number != -1) {
+            release(ra, dev, &ra->files[i]);
+        }
+    }
+}
+
+static FileReadahead *claim(Readahead *ra, BlockDevice *dev, int inode_number) {
+    FileReadahead *oldest = &ra->files[0];
+
+    for (int i = 0; i < READAHEAD_FILES; ++i) {
+        FileReadahead *file = &ra->files[i];
+        if (file->inode_number == inode_number) {
+            return file;
+        }
+
+        if (file->inode_number == -1 || (oldest->inode_number != -1 && file->last_access < oldest->last_access)) {
+            oldest = file;
+        }
+    }
+
+    if (oldest->inode_number != -1) {
+        release(ra, dev, oldest);
+    }
+
+    oldest->inode_number = inode_number;
+    oldest->window = READAHEAD_MIN_WINDOW;
+    oldest->next = -1; // no read to carry on from yet
+    return oldest;
+}
+
+FileReadahead *readahead_access(Readahead *ra, BlockDevice *dev, int inode_number, int first, int last) {
+    if (ra->max_window == 0) {
+        return NULL;
+    }
+
+    FileReadahead *file = claim(ra, dev, inode_number);
+    file->last_access = ++ra->clock;
+    // a reader going through in pieces that are not whole blocks starts
+    // where the previous piece left off, inside its last block
+    file->sequential = first == file->next || first == file->next - 1;
+
+    // a reader that jumped around gains nothing from what was fetched ahead,
+    // even if it landed inside it
+    if (!file->sequential) {
+        retire(ra, dev, file);
+        file->window = READAHEAD_MIN_WINDOW;
+    }
+
+    file->next = last + 1;
+    return file;
+}
+
+char *readahead_block(Readahead *ra, BlockDevice *dev, FileReadahead *file, int logical) {
+    if (logical < file->start || logical >= file->start + file->count) {
+        return NULL;
+    }
+
+    wait_prefetch(dev, file);
+
+    // a failed request took the whole prefetch with it
+    if (file->count == 0) {
+        return NULL;
+    }
+
+    int index = logical - file->start;
+    if (!file->read[index]) {
+        file->read[index] = 1;
+        file->used++;
+        ra->stats.hits++;
+    }
+
+    return file->data + (size_t)index * ra->block_size;
+}
+
+int readahead_next(Readahead *ra, BlockDevice *dev, FileReadahead *file, int *first) {
+    if (!file->sequential || (file->count > 0 && file->next < file->start + file->count)) {
+        return 0;
+    }
+
+    if (file->count > 0) {
+        int count = file->count;
+        int unread = retire(ra, dev, file);
+
+        // read in full: the reader keeps up, fetch further ahead next time
+        if (unread == 0 && count == file->window) {
+            file->window = file->window * 2 < ra->max_window ? file->window * 2 : ra->max_window;
+        } else if (unread > count / 2) {
+            file->window = file->window / 2 > READAHEAD_MIN_WINDOW ? file->window / 2 : READAHEAD_MIN_WINDOW;
+        }
+    }
+
+    *first = file->next;
+    return file->window;
+}
+
+static void prefetch_done(IoRequest *request) {
+    FileReadahead *file = request->arg;
+
+    file->pending--;
+    if (request->result != (ssize_t)request->iov[0].iov_len) {
+        file->failed = 1;
+    }
+}
+
+void readahead_start(Readahead *ra, BlockDevice *dev, FileReadahead *file, int first, const int *physical, int count) {
+    if (count <= 0) {
+        return;
+    }
+
+    if (file->data == NULL) {
+        int max = ra->max_window;
+        file->data = malloc((size_t)max * ra->block_size + max * (1 + sizeof(IoRequest) + sizeof(struct iovec)));
+        if (file->data == NULL) {
+            return;
+        }
+
+        file->requests = (IoRequest *)(file->data + (size_t)max * ra->block_size);
+        file->iov = (struct iovec *)(file->requests + max);
+        file->read = (unsigned char *)(file->iov + max);
+    }
+
+    file->start = first;
+    file->count = count;
+    file->used = 0;
+    memset(file->read, 0, count);
+    memset(file->requests, 0, count * sizeof(IoRequest));
+
+    for (int i = 0; i < count;) {
+        int length = 1;
+        while (i + length < count && physical[i + length] == physical[i] + length) {
+            length++;
+        }
+
+        IoRequest *request = &file->requests[i];
+        file->iov[i].iov_base = file->data + (size_t)i * ra->block_size;
+        file->iov[i].iov_len = (size_t)length * ra->block_size;
+        request->iov = &file->iov[i];
+        request->iovcnt = 1;
+        request->done = prefetch_done;
+        request->arg = file;
+
+        if (blockdev_submit(dev, physical[i], request) != 0) {
+            wait_prefetch(dev, file);
+            file->count = 0;
+            return;
+        }
+
+        file->pending++;
+        i += length;
+    }
+
+    blockdev_kick(dev);
+
+    ra->stats.windows++;
+    ra->stats.prefetched += count;
+}
+
+void readahead_retire(Readahead *ra, BlockDevice *dev, FileReadahead *file) {
+    retire(ra, dev, file);
+}
+
+void readahead_forget(Readahead *ra, BlockDevice *dev, int inode_number) {
+    for (int i = 0; i < READAHEAD_FILES; ++i) {
+        if (ra->files[i].inode_number == inode_number) {
+            release(ra, dev, &ra->files[i]);
+        }
+    }
+}
@@ -0,0 +1,577 @@
+#define _GNU_SOURCE // accept4
+#include "server.h"
+#include "fs_errors.h"
+#include "protocol.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define READ_CHUNK (64 * 1024)         // room made in a client's input before each read
+#define OUT_LIMIT (4 * WIRE_MAX_FRAME) // unsent replies at which a client's requests wait
+#define LS_ENTRIES 4096                // entries a listing returns at most
+#define EVENTS 64
+
+typedef struct Buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+typedef struct Connection {
+    int fd;
+    Buffer in;         // received bytes, from the oldest unanswered request on
+    Buffer out;        // replies
+    size_t sent;       // bytes of out already written
+    uint32_t events;   // what epoll watches the socket for
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+struct Server;
+
+typedef struct Worker {
+    struct Server *server;
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;            // eventfd written to stop the loop
+    Connection *clients;
+    ServerStats stats;
+} Worker;
+
+typedef struct Server {
+    FsContext fs;
+    int listen_fd;
+    Worker workers[SERVER_MAX_THREADS];
+    int num_workers;
+} Server;
+
+static int reserve(Buffer *buf, size_t extra) {
+    if (buf->length + extra <= buf->capacity) {
+        return 0;
+    }
+
+    size_t capacity = buf->capacity > 0 ? buf->capacity : READ_CHUNK;
+    while (capacity < buf->length + extra) {
+        capacity *= 2;
+    }
+
+    char *grown = realloc(buf->data, capacity);
+    if (grown == NULL) {
+        return -1;
+    }
+
+    buf->data = grown;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static int add_listing(FsContext *fs, const char *path, uint32_t count, Buffer *out, size_t at) {
+    int max_entries = count < LS_ENTRIES ? count : LS_ENTRIES;
+    DirectoryEntry *entries = malloc((max_entries > 0 ? max_entries : 1) * sizeof(DirectoryEntry));
+    if (entries == NULL) {
+        return -ERR_NO_SPACE;
+    }
+
+    int num_entries = fs_ls(fs, path, entries, max_entries);
+
+    for (int i = 0; i < num_entries; ++i) {
+        WireEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.inode_number = entries[i].inode_number;
+        entry.type = entries[i].type;
+        entry.name_length = strlen(entries[i].name);
+
+        memcpy(out->data + at, &entry, sizeof(entry));
+        memcpy(out->data + at + sizeof(entry), entries[i].name, entry.name_length);
+        at += sizeof(entry) + entry.name_length;
+    }
+
+    free(entries);
+    return num_entries;
+}
+
+// Runs a request and appends its reply to out. Returns -1 only when there is
+// no memory for the reply.
+static int answer(FsContext *fs, const WireRequest *request, const char *path, const char *data, size_t data_length,
+                  Buffer *out) {
+    size_t room = WIRE_MAX_FRAME - sizeof(WireReply);
+    size_t payload = 0;
+
+    if (request->op == WIRE_READ || request->op == WIRE_PREAD) {
+        payload = request->count < room ? request->count : room;
+    } else if (request->op == WIRE_LS) {
+        size_t entries = request->count < LS_ENTRIES ? request->count : LS_ENTRIES;
+        payload = entries * (sizeof(WireEntry) + MAX_NAME_SIZE);
+    }
+
+    // fs_read adds a terminator after the bytes
+    if (reserve(out, sizeof(WireReply) + payload + 1) != 0) {
+        return -1;
+    }
+
+    size_t at = out->length + sizeof(WireReply);
+    char *body = out->data + at;
+    int status;
+
+    take_error();
+
+    switch (request->op) {
+    case WIRE_MKDIR:
+        status = fs_mkdir(fs, path);
+        break;
+
+    case WIRE_CREATE:
+        status = fs_create(fs, path);
+        break;
+
+    case WIRE_WRITE: {
+        char *text = malloc(data_length + 1);
+        if (text == NULL) {
+            return -1;
+        }
+        memcpy(text, data, data_length);
+        text[data_length] = '\0';
+        status = fs_write(fs, path, text);
+        free(text);
+        break;
+    }
+
+    case WIRE_READ:
+        status = fs_read(fs, path, body, payload);
+        break;
+
+    case WIRE_DELETE:
+        status = fs_delete(fs, path);
+        break;
+
+    case WIRE_RMDIR:
+        status = fs_rmdir(fs, path);
+        break;
+
+    case WIRE_LS:
+        status = add_listing(fs, path, request->count, out, at);
+        break;
+
+    case WIRE_PREAD:
+        status = fs_pread(fs, path, body, payload, request->offset);
+        break;
+
+    case WIRE_PWRITE:
+        status = data_length > 0x7fffffff ? -1 : fs_pwrite(fs, path, data, data_length, request->offset);
+        break;
+
+    case WIRE_PREALLOCATE:
+        status = fs_preallocate(fs, path, request->offset);
+        break;
+
+    case WIRE_SYNC:
+        status = fs_sync(fs);
+        break;
+
+    default:
+        print_error("serve", path, ERR_INVALID);
+        status = -1;
+        break;
+    }
+
+    size_t length = 0;
+    if (status < 0) {
+        ErrorCode code = take_error();
+        status = -(code != ERR_NONE ? code : ERR_INVALID);
+    } else if (request->op == WIRE_READ || request->op == WIRE_PREAD) {
+        length = status;
+    } else if (request->op == WIRE_LS) {
+        char *end = body;
+        for (int i = 0; i < status; ++i) {
+            WireEntry entry;
+            memcpy(&entry, end, sizeof(entry));
+            end += sizeof(entry) + entry.name_length;
+        }
+        length = end - body;
+    }
+
+    WireReply reply;
+    reply.length = sizeof(WireReply) - sizeof(reply.length) + length;
+    reply.id = request->id;
+    reply.status = status;
+
+    memcpy(out->data + out->length, &reply, sizeof(reply));
+    out->length += sizeof(reply) + length;
+    return 0;
+}
+
+// Answers every whole request received, until the replies waiting to go out
+// reach OUT_LIMIT. Returns -1 for a client that broke the protocol.
+static int answer_requests(Worker *worker, Connection *conn) {
+    FsContext *fs = &worker->server->fs;
+    size_t done = 0;
+
+    while (conn->out.length - conn->sent < OUT_LIMIT && conn->in.length - done >= sizeof(WireRequest)) {
+        WireRequest request;
+        memcpy(&request, conn->in.data + done, sizeof(request));
+
+        size_t header = sizeof(WireRequest) - sizeof(request.length);
+        if (request.length < header || request.length > WIRE_MAX_FRAME - sizeof(request.length) ||
+            request.path_length > request.length - header) {
+            return -1;
+        }
+
+        if (conn->in.length - done < sizeof(request.length) + request.length) {
+            break;
+        }
+
+        char path[MAX_PATH_SIZE];
+        const char *frame = conn->in.data + done;
+        const char *data = frame + sizeof(WireRequest) + request.path_length;
+        size_t data_length = request.length - header - request.path_length;
+
+        // every call resolves an absolute path; anything else goes no further
+        int ret;
+        if (request.path_length == 0 || request.path_length >= MAX_PATH_SIZE || frame[sizeof(WireRequest)] != '/') {
+            Buffer *out = &conn->out;
+            WireReply reply = { sizeof(WireReply) - sizeof(reply.length), request.id, -ERR_PATH };
+            ret = reserve(out, sizeof(reply));
+            if (ret == 0) {
+                memcpy(out->data + out->length, &reply, sizeof(reply));
+                out->length += sizeof(reply);
+            }
+        } else {
+            memcpy(path, frame + sizeof(WireRequest), request.path_length);
+            path[request.path_length] = '\0';
+            ret = answer(fs, &request, path, data, data_length, &conn->out);
+        }
+
+        if (ret != 0) {
+            return -1;
+        }
+
+        worker->stats.requests++;
+        done += sizeof(request.length) + request.length;
+    }
+
+    memmove(conn->in.data, conn->in.data + done, conn->in.length - done);
+    conn->in.length -= done;
+    return 0;
+}
+
+static int receive(Worker *worker, Connection *conn) {
+    if (reserve(&conn->in, READ_CHUNK) != 0) {
+        return -1;
+    }
+
+    ssize_t bytes = read(conn->fd, conn->in.data + conn->in.length, conn->in.capacity - conn->in.length);
+    if (bytes < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+
+    if (bytes == 0) {
+        return -1; // the client hung up
+    }
+
+    worker->stats.reads++;
+    conn->in.length += bytes;
+    return 0;
+}
+
+static int send_replies(Worker *worker, Connection *conn) {
+    while (conn->sent < conn->out.length) {
+        ssize_t bytes = send(conn->fd, conn->out.data + conn->sent, conn->out.length - conn->sent, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        worker->stats.writes++;
+        conn->sent += bytes;
+    }
+
+    conn->out.length = 0;
+    conn->sent = 0;
+    return 0;
+}
+
+// Reads while the client's replies are not piling up, and waits to write
+// while some are unsent.
+static int watch(Worker *worker, Connection *conn, int op) {
+    uint32_t events = 0;
+    if (conn->out.length - conn->sent < OUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (conn->sent < conn->out.length) {
+        events |= EPOLLOUT;
+    }
+
+    if (op == EPOLL_CTL_MOD && events == conn->events) {
+        return 0;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    conn->events = events;
+    return epoll_ctl(worker->epoll_fd, op, conn->fd, &event);
+}
+
+static void drop(Worker *worker, Connection *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->clients = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+
+    close(conn->fd);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+static void accept_clients(Worker *worker) {
+    for (;;) {
+        int fd = accept4(worker->server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return; // EAGAIN: another loop took it, or none is left
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        conn->next = worker->clients;
+        if (worker->clients != NULL) {
+            worker->clients->prev = conn;
+        }
+        worker->clients = conn;
+
+        if (watch(worker, conn, EPOLL_CTL_ADD) != 0) {
+            drop(worker, conn);
+            continue;
+        }
+
+        worker->stats.connections++;
+    }
+}
+
+static void serve_client(Worker *worker, Connection *conn, uint32_t events) {
+    int failed = 0;
+
+    if (events & EPOLLIN) {
+        failed = receive(worker, conn);
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        failed = 1;
+    }
+
+    // requests held back by OUT_LIMIT are answered once their replies drain
+    if (!failed) {
+        failed = answer_requests(worker, conn) != 0 || send_replies(worker, conn) != 0 ||
+                 answer_requests(worker, conn) != 0 || send_replies(worker, conn) != 0;
+    }
+
+    if (failed || watch(worker, conn, EPOLL_CTL_MOD) != 0) {
+        drop(worker, conn);
+    }
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    struct epoll_event events[EVENTS];
+
+    // errors go back to the clients, not to the server's terminal
+    quiet_errors(1);
+
+    for (;;) {
+        int count = epoll_wait(worker->epoll_fd, events, EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == &worker->wake_fd) {
+                goto stop;
+            }
+
+            if (events[i].data.ptr == worker->server) {
+                accept_clients(worker);
+            } else {
+                serve_client(worker, events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+
+stop:
+    while (worker->clients != NULL) {
+        drop(worker, worker->clients);
+    }
+    return NULL;
+}
+
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    // bound under a name of its own and renamed once listening, so a client
+    // that finds the socket file can connect to it straight away
+    char bound[sizeof(addr.sun_path)];
+    if (snprintf(bound, sizeof(bound), "%s.%d", socket_path, (int)getpid()) >= (int)sizeof(bound)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, bound);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(bound);
+
+    // a socket file left by a server that did not shut down is replaced
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+        rename(bound, socket_path) != 0) {
+        unlink(bound);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int start_worker(Server *server, Worker *worker) {
+    worker->server = server;
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (worker->epoll_fd < 0 || worker->wake_fd < 0) {
+        return -1;
+    }
+
+    // every loop accepts; EPOLLEXCLUSIVE wakes one of them per client
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = server;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) != 0) {
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &worker->wake_fd;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) != 0) {
+        return -1;
+    }
+
+    return pthread_create(&worker->thread, NULL, worker_main, worker) == 0 ? 0 : -1;
+}
+
+static void close_worker(Worker *worker) {
+    if (worker->epoll_fd >= 0) {
+        close(worker->epoll_fd);
+    }
+    if (worker->wake_fd >= 0) {
+        close(worker->wake_fd);
+    }
+}
+
+int serve(const char *diskfile, const char *socket_path, const MountOptions *options, int threads, ServerStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    if (threads < 1 || threads > SERVER_MAX_THREADS) {
+        return -1;
+    }
+
+    Server *server = calloc(1, sizeof(Server));
+    if (server == NULL) {
+        return -1;
+    }
+
+    MountOptions mount = *options;
+    mount.thread_safe = 1;
+
+    ErrorCode code = fs_mount_with(diskfile, &mount, &server->fs);
+    if (code != ERR_NONE) {
+        print_error("serve", diskfile, code);
+        free(server);
+        return -1;
+    }
+
+    server->listen_fd = listen_on(socket_path);
+    if (server->listen_fd < 0) {
+        fprintf(stderr, "Error: serve %s: cannot listen on the socket\n", socket_path);
+        fs_unmount(&server->fs);
+        free(server);
+        return -1;
+    }
+
+    // the loops leave the signals that stop the server to this thread; a
+    // shell starting it in the background may have set SIGINT ignored, and an
+    // ignored signal never reaches sigwait
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int ret = 0;
+    for (int i = 0; i < threads; ++i) {
+        Worker *worker = &server->workers[i];
+        worker->epoll_fd = -1;
+        worker->wake_fd = -1;
+
+        if (start_worker(server, worker) != 0) {
+            close_worker(worker);
+            ret = -1;
+            break;
+        }
+        server->num_workers++;
+    }
+
+    if (ret == 0) {
+        int caught;
+        sigwait(&signals, &caught);
+    } else {
+        fprintf(stderr, "Error: serve %s: cannot start the server threads\n", socket_path);
+    }
+
+    for (int i = 0; i < server->num_workers; ++i) {
+        uint64_t one = 1;
+        if (write(server->workers[i].wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "Error: serve %s: cannot stop a server thread\n", socket_path);
+        }
+    }
+
+    for (int i = 0; i < server->num_workers; ++i) {
+        Worker *worker = &server->workers[i];
+        pthread_join(worker->thread, NULL);
+        close_worker(worker);
+
+        stats->connections += worker->stats.connections;
+        stats->requests += worker->stats.requests;
+        stats->reads += worker->stats.reads;
+        stats->writes += worker->stats.writes;
+    }
+
+    close(server->listen_fd);
+    unlink(socket_path);
+    fs_unmount(&server->fs);
+    free(server);
+    return ret;
+}
@@ -0,0 +1,283 @@
+#include "upgrade.h"
+#include "fs.h"
+#include "dir.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LEGACY_BLOCK_SIZE 1024
+#define LEGACY_DIRECT_BLOCKS 4
+#define LEGACY_ENTRIES (LEGACY_BLOCK_SIZE / (int)sizeof(DirectoryEntry))
+
+// the superblock of FS_VERSION_UNTYPED and FS_VERSION_DIRECT
+typedef struct LegacySuperBlock {
+    int magic_number;
+    int num_blocks;
+    int num_inodes;
+    int bitmap_start;
+    int inode_start;
+    int data_start;
+    int version;
+    int journal_start;
+    int journal_blocks;
+    int bitmap_blocks;
+    int free_hint;
+    int inode_bitmap_start;
+    int inode_bitmap_blocks;
+    int total_inodes;
+} LegacySuperBlock;
+
+typedef struct LegacyInode {
+    int is_valid;
+    int size; // bytes, or entries for a directory
+    int direct_blocks[LEGACY_DIRECT_BLOCKS];
+    int is_directory;
+    int owner_id;
+    int flags; // INODE_INDEXED, same bit as today
+} LegacyInode;
+
+#define LEGACY_INODES (LEGACY_BLOCK_SIZE / (int)sizeof(LegacyInode))
+
+typedef struct Legacy {
+    BlockDevice dev;
+    LegacySuperBlock sb;
+    FsContext *to; // the new image
+} Legacy;
+
+int legacy_version(BlockDevice *dev) {
+    char block[LEGACY_BLOCK_SIZE];
+    if (dev->block_size != LEGACY_BLOCK_SIZE || blockdev_read(dev, 0, block) != 0) {
+        return 0;
+    }
+
+    const LegacySuperBlock *sb = (const LegacySuperBlock *)block;
+    if (sb->magic_number != (int)FS_MAGIC ||
+        (sb->version != FS_VERSION_UNTYPED && sb->version != FS_VERSION_DIRECT)) {
+        return 0;
+    }
+
+    return sb->version;
+}
+
+static int read_legacy_inode(Legacy *legacy, int inode_number, LegacyInode *inode) {
+    if (inode_number < 0 || inode_number >= legacy->sb.total_inodes) {
+        return -1;
+    }
+
+    char block[LEGACY_BLOCK_SIZE];
+    if (blockdev_read(&legacy->dev, legacy->sb.inode_start + inode_number / LEGACY_INODES, block) != 0) {
+        return -1;
+    }
+
+    memcpy(inode, (LegacyInode *)block + inode_number % LEGACY_INODES, sizeof(*inode));
+    return inode->is_valid ? 0 : -1;
+}
+
+static int legacy_block(const Legacy *legacy, int block_number) {
+    return block_number >= legacy->sb.data_start && block_number < legacy->sb.num_blocks;
+}
+
+static int copy_file(Legacy *legacy, const LegacyInode *inode, const char *path) {
+    if (fs_create(legacy->to, path) != 0) {
+        return -1;
+    }
+
+    if (inode->size <= 0) {
+        return 0;
+    }
+    if (inode->size > LEGACY_DIRECT_BLOCKS * LEGACY_BLOCK_SIZE) {
+        fprintf(stderr, "Error: upgrade: %s is larger than its blocks\n", path);
+        return -1;
+    }
+
+    char data[LEGACY_DIRECT_BLOCKS * LEGACY_BLOCK_SIZE];
+    memset(data, 0, sizeof(data));
+    for (int i = 0; i * LEGACY_BLOCK_SIZE < inode->size; ++i) {
+        // a block never written reads back as zeros, as it did before
+        if (legacy_block(legacy, inode->direct_blocks[i]) &&
+            blockdev_read(&legacy->dev, inode->direct_blocks[i], data + i * LEGACY_BLOCK_SIZE) != 0) {
+            return -1;
+        }
+    }
+
+    return fs_pwrite(legacy->to, path, data, inode->size, 0) == inode->size ? 0 : -1;
+}
+
+static int copy_dir(Legacy *legacy, const LegacyInode *dir, const char *path, int depth);
+
+static int copy_entries(Legacy *legacy, int block_number, const char *path, int depth) {
+    if (!legacy_block(legacy, block_number)) {
+        return 0;
+    }
+
+    DirectoryEntry entries[LEGACY_ENTRIES];
+    if (blockdev_read(&legacy->dev, block_number, entries) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < LEGACY_ENTRIES; ++i) {
+        if (entries[i].inode_number == 0) {
+            continue;
+        }
+
+        // the inode decides the type: FS_VERSION_UNTYPED left the byte 0
+        LegacyInode child;
+        if (read_legacy_inode(legacy, entries[i].inode_number, &child) != 0) {
+            continue;
+        }
+
+        char name[MAX_NAME_SIZE];
+        snprintf(name, sizeof(name), "%.*s", MAX_NAME_SIZE - 1, entries[i].name);
+        size_t name_len = strlen(name);
+        if (name_len > 0 && name[name_len - 1] == '/') {
+            name[--name_len] = '\0';
+        }
+        if (name_len == 0) {
+            continue;
+        }
+
+        char child_path[MAX_PATH_SIZE];
+        if (snprintf(child_path, sizeof(child_path), "%s%s%s", path, name, child.is_directory ? "/" : "") >=
+            (int)sizeof(child_path)) {
+            return -1;
+        }
+
+        int ret = child.is_directory ? copy_dir(legacy, &child, child_path, depth + 1)
+                                     : copy_file(legacy, &child, child_path);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int copy_dir(Legacy *legacy, const LegacyInode *dir, const char *path, int depth) {
+    if (depth > MAX_DEPTH) {
+        return -1;
+    }
+    if (depth > 0 && fs_mkdir(legacy->to, path) != 0) {
+        return -1;
+    }
+
+    if (!(dir->flags & INODE_INDEXED)) {
+        for (int i = 0; i < LEGACY_DIRECT_BLOCKS; ++i) {
+            if (copy_entries(legacy, dir->direct_blocks[i], path, depth) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // direct_blocks[0] is the index, its leaves are plain entry blocks
+    char block[LEGACY_BLOCK_SIZE];
+    if (!legacy_block(legacy, dir->direct_blocks[0]) ||
+        blockdev_read(&legacy->dev, dir->direct_blocks[0], block) != 0) {
+        return -1;
+    }
+
+    const DirIndex *index = (const DirIndex *)block;
+    int max_count = (int)((LEGACY_BLOCK_SIZE - sizeof(DirIndex)) / sizeof(DirIndexEntry));
+    if (index->magic != DIR_INDEX_MAGIC || index->count < 0 || index->count > max_count) {
+        return -1;
+    }
+
+    for (int i = 0; i < index->count; ++i) {
+        if (copy_entries(legacy, index->entries[i].block_number, path, depth) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Makes a current image of the same size at target and copies the tree into it.
+static int copy_image(Legacy *legacy, const char *target) {
+    MkfsOptions mkfs;
+    mkfs_default_options(&mkfs);
+    mkfs.image_size = (long long)legacy->sb.num_blocks * LEGACY_BLOCK_SIZE;
+    mkfs.block_size = LEGACY_BLOCK_SIZE;
+    if (legacy->sb.total_inodes > 0 && mkfs.image_size / legacy->sb.total_inodes < mkfs.inode_ratio) {
+        // at least as many inodes as before
+        mkfs.inode_ratio = (int)(mkfs.image_size / legacy->sb.total_inodes);
+    }
+
+    LegacyInode root;
+    if (mkfs_with(target, &mkfs) != 0 || read_legacy_inode(legacy, 0, &root) != 0) {
+        return -1;
+    }
+
+    FsContext to;
+    if (fs_mount(target, &to) != ERR_NONE) {
+        return -1;
+    }
+
+    legacy->to = &to;
+    int ret = copy_dir(legacy, &root, "/", 0);
+    fs_unmount(&to);
+    return ret;
+}
+
+int upgrade_image(const char *diskfile) {
+    ImageLock lock;
+    do {
+        if (image_lock_open(&lock, diskfile, 0) != 0 || image_lock(&lock, IMAGE_LOCK_EXCLUSIVE) != 0) {
+            image_lock_close(&lock);
+            return -1;
+        }
+        if (!image_lock_moved(&lock, diskfile)) {
+            break;
+        }
+        image_lock_close(&lock);
+    } while (1);
+
+    Legacy legacy;
+    memset(&legacy, 0, sizeof(legacy));
+    if (blockdev_open(&legacy.dev, diskfile, BACKEND_PREAD, AIO_ENGINE_THREADS, LEGACY_BLOCK_SIZE) != 0) {
+        image_lock_close(&lock);
+        return -1;
+    }
+
+    if (legacy_version(&legacy.dev) == 0) {
+        // upgraded by another mount while we waited for the lock
+        blockdev_close(&legacy.dev);
+        image_lock_close(&lock);
+        return 0;
+    }
+
+    char block[LEGACY_BLOCK_SIZE];
+    blockdev_read(&legacy.dev, 0, block);
+    memcpy(&legacy.sb, block, sizeof(legacy.sb));
+
+    // a crash may have left a committed transaction the old mount never replayed
+    Journal journal;
+    int ret = journal_init(&journal, legacy.sb.journal_start, legacy.sb.journal_blocks, LEGACY_BLOCK_SIZE, 0);
+    if (ret == 0) {
+        ret = journal_recover(&journal, &legacy.dev, 1) < 0 ? -1 : 0;
+        journal_destroy(&journal);
+    }
+
+    if (ret == 0) {
+        blockdev_read(&legacy.dev, 0, block);
+        memcpy(&legacy.sb, block, sizeof(legacy.sb));
+    }
+
+    char target[MAX_PATH_SIZE + 16];
+    snprintf(target, sizeof(target), "%s.upgrade", diskfile);
+    if (ret == 0) {
+        ret = copy_image(&legacy, target);
+    }
+    if (ret == 0) {
+        ret = rename(target, diskfile);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Error: upgrade: %s is left in version %d\n", diskfile, legacy.sb.version);
+        unlink(target);
+    }
+
+    blockdev_close(&legacy.dev);
+    image_lock_close(&lock);
+    return ret;
+}